@@ -0,0 +1,547 @@
+/* cgicache.c: CGI Response Micro-Cache */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define CGI_CACHE_MAGIC     0x43474943u /* "CGIC" */
+#define CGI_CACHE_PASS      0x43474950u /* "CGIP": output was not cacheable */
+#define CGI_CACHE_PASSTTL   5           /* Seconds requests bypass after uncacheable output */
+#define CGI_CACHE_MAXSIZ    (64*1024*1024)  /* Bytes of entries kept before refusing new ones */
+#define CGI_CACHE_SWEEP     60          /* Seconds between sweeps for expired entries */
+
+/**
+ * Headers that select between cached variants of a script's output.
+ */
+static const HeaderID CGICacheVary[] = {
+    HEADER_ACCEPT,
+    HEADER_ACCEPT_ENCODING,
+    HEADER_ACCEPT_LANGUAGE,
+};
+
+/* On-disk Structures */
+
+typedef struct {
+    uint32_t magic;                     /*< CGI_CACHE_MAGIC or CGI_CACHE_PASS */
+    uint32_t keylen;                    /*< Length of key following header */
+    int64_t  expires;                   /*< Absolute expiration time */
+} CGICacheHeader;
+
+typedef struct {
+    int64_t  swept;                     /*< Time of last sweep */
+    uint64_t size;                      /*< Bytes in stored entries (as of last sweep) */
+} CGICacheState;
+
+/* Globals */
+
+static char           CGICachePath[64]; /*< Directory holding cache entries */
+static CGICacheState *CGICacheShared = NULL;    /*< Shared with forked workers */
+static pid_t          CGICacheOwner  = 0;       /*< Process that created directory */
+
+/**
+ * Remove lock file of entry unless somebody holds it.
+ **/
+static void cgi_cache_unlock(const char *path) {
+    char lock[PATH_MAX];
+    int  fd;
+
+    snprintf(lock, sizeof(lock), "%s.lock", path);
+    if ((fd = open(lock, O_RDONLY)) < 0) {
+        return;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+        unlink(lock);
+    }
+    close(fd);
+}
+
+/**
+ * Remove expired entries (or, on shutdown, everything) from cache directory.
+ *
+ * @param   all         Whether to remove every file and the directory itself.
+ *
+ * Besides expired entries, this removes lock files whose entry is gone and
+ * that nobody holds, and pending entries that have not been written to for
+ * a whole sweep interval (left behind by killed workers).  A lock file can
+ * still be removed between another worker opening and locking it, which
+ * only means two workers may run the script for that key once.
+ **/
+static void cgi_cache_sweep(bool all) {
+    DIR           *dir = opendir(CGICachePath);
+    struct dirent *entry;
+    time_t         now  = time(NULL);
+    uint64_t       size = 0;
+
+    if (!dir) {
+        return;
+    }
+
+    while ((entry = readdir(dir))) {
+        char        path[sizeof(CGICachePath) + NAME_MAX + 2];
+        char       *dot = strchr(entry->d_name, '.');
+        struct stat s;
+
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", CGICachePath, entry->d_name);
+        if (all || lstat(path, &s) < 0) {
+            unlink(path);
+            continue;
+        }
+
+        if (!dot) {
+            CGICacheHeader header;
+            int fd = open(path, O_RDONLY);
+            if (fd < 0 || pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.expires <= now) {
+                unlink(path);
+                cgi_cache_unlock(path);
+            } else {
+                size += s.st_size;
+            }
+            if (fd >= 0) {
+                close(fd);
+            }
+        } else if (streq(dot, ".lock")) {
+            snprintf(path, sizeof(path), "%s/%.*s", CGICachePath, (int)(dot - entry->d_name), entry->d_name);
+            if (access(path, F_OK) < 0) {
+                cgi_cache_unlock(path);
+            }
+        } else if (s.st_mtime + CGI_CACHE_SWEEP < now) {
+            unlink(path);
+        }
+    }
+    closedir(dir);
+
+    if (all) {
+        rmdir(CGICachePath);
+    } else {
+        __atomic_store_n(&CGICacheShared->size, size, __ATOMIC_RELAXED);
+        debug("CGI CACHE SWEEP: %llu bytes", (unsigned long long)size);
+    }
+}
+
+/**
+ * Remove cache directory when the server exits.
+ **/
+static void cgi_cache_cleanup(void) {
+    if (getpid() == CGICacheOwner) {
+        cgi_cache_sweep(true);
+    }
+}
+
+/**
+ * Exit (running cgi_cache_cleanup) on SIGINT or SIGTERM.
+ **/
+static void * cgi_cache_thread(void *arg) {
+    sigset_t *signals = arg;
+    int       signal;
+
+    while (sigwait(signals, &signal) != 0);
+    exit(EXIT_SUCCESS);
+    return NULL;
+}
+
+/**
+ * Create directory for cache entries.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * The directory gets an unpredictable name from mkdtemp(3) and is private to
+ * the server, so other users cannot plant or read entries.  It is removed
+ * when the server exits, including on SIGINT or SIGTERM.
+ **/
+int cgi_cache_init(void) {
+    static sigset_t signals;
+    pthread_t       thread;
+
+    CGICacheShared = mmap(NULL, sizeof(CGICacheState), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (CGICacheShared == MAP_FAILED) {
+        fprintf(stderr, "Unable to map CGI cache state: %s\n", strerror(errno));
+        CGICacheShared = NULL;
+        return -1;
+    }
+    CGICacheShared->swept = time(NULL);
+
+    strcpy(CGICachePath, "/tmp/spidey-cgi.XXXXXX");
+    if (!mkdtemp(CGICachePath)) {
+        fprintf(stderr, "Unable to create %s: %s\n", CGICachePath, strerror(errno));
+        return -1;
+    }
+    CGICacheOwner = getpid();
+    atexit(cgi_cache_cleanup);
+
+    /* Exit cleanly on SIGINT or SIGTERM (the profile thread already does) */
+    if (!ProfileMode) {
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        if ((errno = pthread_sigmask(SIG_BLOCK, &signals, NULL)) != 0 ||
+            (errno = signal_thread(&thread, cgi_cache_thread, &signals)) != 0) {
+            fprintf(stderr, "Unable to start CGI cache thread: %s\n", strerror(errno));
+            return -1;
+        }
+        pthread_detach(thread);
+    }
+
+    debug("CGI cache directory: %s", CGICachePath);
+    return 0;
+}
+
+/**
+ * Build cache key for request.
+ *
+ * @return  Length of key or -1 if request is not cacheable.
+ *
+ * The key is the script path, query string, and the values of the Vary
+ * headers.  Requests carrying credentials or that are not GETs are never
+ * cached.
+ **/
+static int cgi_cache_key(Request *r, char *key, size_t size) {
+    if (!streq(r->method, "GET") || r->headers[HEADER_COOKIE] || r->headers[HEADER_AUTHORIZATION]) {
+        return -1;
+    }
+
+    size_t length = snprintf(key, size, "%s?%s", r->path, r->query);
+    for (size_t i = 0; i < sizeof(CGICacheVary) / sizeof(CGICacheVary[0]) && length < size; i++) {
+        const char *value = r->headers[CGICacheVary[i]];
+        length += snprintf(key + length, size - length, "\n%s", value ? value : "");
+    }
+    return length < size ? (int)length : -1;
+}
+
+/**
+ * Compute FNV-1a hash of key.
+ **/
+static uint64_t cgi_cache_hash(const char *key, size_t length) {
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < length; i++) {
+        h ^= (unsigned char)key[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+/**
+ * Send cache entry if it is present, matches the key and is still fresh.
+ *
+ * @return  CGI_CACHE_HIT if the entry was sent, CGI_CACHE_BYPASS if the entry
+ *          records that the script's output is not cacheable, and otherwise
+ *          CGI_CACHE_MISS.
+ **/
+static CGICacheStatus cgi_cache_send(Request *r, CGICache *c) {
+    CGICacheHeader header;
+    CGICacheStatus status = CGI_CACHE_MISS;
+    char   key[CGI_CACHE_KEYSIZ];
+    int    fd = open(c->path, O_RDONLY);
+    struct stat s;
+
+    if (fd < 0) {
+        return CGI_CACHE_MISS;
+    }
+
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        (header.magic != CGI_CACHE_MAGIC && header.magic != CGI_CACHE_PASS) ||
+        header.keylen != c->keylen || header.expires <= time(NULL) ||
+        pread(fd, key, header.keylen, sizeof(header)) != header.keylen || memcmp(key, c->key, c->keylen) != 0 ||
+        fstat(fd, &s) < 0) {
+        goto done;
+    }
+
+    if (header.magic == CGI_CACHE_PASS) {
+        status = CGI_CACHE_BYPASS;
+        goto done;
+    }
+
+    off_t offset = sizeof(header) + header.keylen;
+    response_flush(r);
+    TRACE(r, FIRST_BYTE, s.st_size - offset);
+    while (offset < s.st_size) {
+        ssize_t nsent = sendfile(r->fd, fd, &offset, s.st_size - offset);
+        if (nsent <= 0) {
+            if (nsent < 0 && errno == EINTR) continue;
+            break;
+        }
+    }
+    status = CGI_CACHE_HIT;
+
+done:
+    close(fd);
+    return status;
+}
+
+/**
+ * Lookup request in CGI cache, coalescing concurrent misses.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   c           CGICache state to initialize.
+ * @return  CGI_CACHE_HIT if the cached response was sent, CGI_CACHE_MISS if
+ *          the caller must run the script and record its output with
+ *          cgi_cache_write/cgi_cache_commit, or CGI_CACHE_BYPASS if the
+ *          request is not cacheable.
+ *
+ * On a miss, an exclusive flock(2) on the entry's lock file is held until
+ * commit or abort.  Any other process or thread missing on the same key
+ * blocks on that lock and then finds the freshly written entry, so only one
+ * CGI process runs per key.  If the output turns out not to be cacheable,
+ * the entry instead records that for CGI_CACHE_PASSTTL seconds, which sends
+ * the waiters (and later requests) straight to the script in parallel.
+ **/
+CGICacheStatus cgi_cache_lookup(Request *r, CGICache *c) {
+    char lock[sizeof(c->path) + 8];
+
+    c->lock_fd = c->fd = c->pipe[0] = c->pipe[1] = -1;
+    if (CGICacheTTL < 0 || (c->keylen = cgi_cache_key(r, c->key, sizeof(c->key))) < 0) {
+        return CGI_CACHE_BYPASS;
+    }
+
+    uint64_t hash = cgi_cache_hash(c->key, c->keylen);
+    snprintf(c->path, sizeof(c->path), "%s/%016llx", CGICachePath, (unsigned long long)hash);
+    snprintf(lock, sizeof(lock), "%s.lock", c->path);
+
+    /* Fast path: fresh entry already present */
+    CGICacheStatus status = cgi_cache_send(r, c);
+    if (status != CGI_CACHE_MISS) {
+        debug("CGI CACHE %s: %s", status == CGI_CACHE_HIT ? "HIT" : "PASS", c->path);
+        return status;
+    }
+
+    /* Slow path: serialize misses on this key */
+    if ((c->lock_fd = open(lock, O_CREAT | O_RDWR, 0600)) < 0) {
+        return CGI_CACHE_BYPASS;
+    }
+    while (flock(c->lock_fd, LOCK_EX) < 0 && errno == EINTR);
+
+    /* Another worker may have filled the entry while we waited */
+    if ((status = cgi_cache_send(r, c)) != CGI_CACHE_MISS) {
+        debug("CGI CACHE COALESCED %s: %s", status == CGI_CACHE_HIT ? "HIT" : "PASS", c->path);
+        cgi_cache_abort(c);
+        return status;
+    }
+
+    snprintf(c->temp, sizeof(c->temp), "%s.%d.%lx", c->path, getpid(), (unsigned long)(uintptr_t)c);
+    if ((c->fd = open(c->temp, O_CREAT | O_TRUNC | O_RDWR, 0600)) < 0) {
+        cgi_cache_abort(c);
+        return CGI_CACHE_BYPASS;
+    }
+
+    /* Reserve space for header and key; header is written on commit */
+    CGICacheHeader header = {0};
+    if (pwrite(c->fd, &header, sizeof(header), 0) != sizeof(header) ||
+        pwrite(c->fd, c->key, c->keylen, sizeof(header)) != c->keylen) {
+        cgi_cache_abort(c);
+        return CGI_CACHE_BYPASS;
+    }
+    c->offset = sizeof(header) + c->keylen;
+
+    debug("CGI CACHE MISS: %s", c->path);
+    return CGI_CACHE_MISS;
+}
+
+/**
+ * Drop pending cache entry after a write error (the lock is kept).
+ **/
+static void cgi_cache_discard(CGICache *c) {
+    close(c->fd);
+    unlink(c->temp);
+    c->fd = -1;
+}
+
+/**
+ * Append script output to pending cache entry.
+ *
+ * @param   c           CGICache state.
+ * @param   data        Output data.
+ * @param   length      Length of output data.
+ **/
+void cgi_cache_write(CGICache *c, const void *data, size_t length) {
+    if (c->fd < 0) {
+        return;
+    }
+
+    if (pwrite(c->fd, data, length, c->offset) != (ssize_t)length) {
+        cgi_cache_discard(c);
+        return;
+    }
+    c->offset += length;
+}
+
+/**
+ * Copy script output waiting in pipe into pending cache entry.
+ *
+ * @param   c           CGICache state.
+ * @param   pipe        Read end of script output pipe.
+ * @param   length      Maximum number of bytes to copy.
+ * @return  Number of bytes copied (0 if no entry is pending or at the end of
+ *          output).
+ *
+ * The data is duplicated with tee(2) and stays in the pipe, so the caller
+ * must still consume exactly the returned number of bytes (typically by
+ * splicing them to the socket).  Nothing passes through user space.
+ **/
+ssize_t cgi_cache_tee(CGICache *c, int pipe, size_t length) {
+    if (c->fd < 0) {
+        return 0;
+    }
+    if (c->pipe[0] < 0 && pipe2(c->pipe, O_CLOEXEC) < 0) {
+        cgi_cache_discard(c);
+        return 0;
+    }
+
+    ssize_t n = tee(pipe, c->pipe[1], length, 0);
+    if (n <= 0) {
+        if (n < 0) {
+            cgi_cache_discard(c);
+        }
+        return 0;
+    }
+
+    loff_t offset = c->offset;
+    for (ssize_t moved = 0; moved < n; ) {
+        ssize_t m = splice(c->pipe[0], NULL, c->fd, &offset, n - moved, SPLICE_F_MOVE);
+        if (m <= 0) {
+            /* Leftover data dies with the pipe when the entry is aborted */
+            cgi_cache_discard(c);
+            return n;
+        }
+        moved += m;
+    }
+    c->offset = offset;
+    return n;
+}
+
+/**
+ * Determine freshness lifetime from script's Cache-Control header.
+ *
+ * @return  Lifetime in seconds (0 if the output must not be cached).
+ **/
+static int cgi_cache_lifetime(CGICache *c) {
+    char    buffer[BUFSIZ];
+    ssize_t nread = pread(c->fd, buffer, sizeof(buffer) - 1, sizeof(CGICacheHeader) + c->keylen);
+    if (nread <= 0) {
+        return 0;
+    }
+    buffer[nread] = 0;
+
+    /* Only consider the script's header block */
+    char *end = strstr(buffer, "\n\n");
+    char *crlf = strstr(buffer, "\r\n\r\n");
+    if (crlf && (!end || crlf < end)) {
+        end = crlf;
+    }
+    if (end) {
+        *end = 0;
+    }
+
+    char *state;
+    for (char *line = strtok_r(buffer, "\r\n", &state); line; line = strtok_r(NULL, "\r\n", &state)) {
+        if (strncasecmp(line, "Cache-Control:", 14) != 0) {
+            continue;
+        }
+
+        if (strstr(line, "no-store") || strstr(line, "no-cache") || strstr(line, "private")) {
+            return 0;
+        }
+        char *age = strstr(line, "max-age=");
+        return age ? atoi(age + 8) : CGICacheTTL;
+    }
+
+    return CGICacheTTL;
+}
+
+/**
+ * Publish pending cache entry and release waiters.
+ *
+ * @param   c           CGICache state.
+ * @param   status      Whether the script completed successfully.
+ *
+ * Expired entries are swept from here, and new entries are not stored while
+ * the live ones add up to more than CGI_CACHE_MAXSIZ.  Output that is not
+ * stored (including that of failed scripts) leaves a CGI_CACHE_PASS entry.
+ **/
+void cgi_cache_commit(CGICache *c, bool status) {
+    if (c->fd < 0) {
+        cgi_cache_abort(c);
+        return;
+    }
+
+    int     lifetime = status ? cgi_cache_lifetime(c) : 0;
+    int64_t now      = time(NULL);
+    int64_t swept    = __atomic_load_n(&CGICacheShared->swept, __ATOMIC_RELAXED);
+    bool    full     = __atomic_load_n(&CGICacheShared->size, __ATOMIC_RELAXED) + c->offset > CGI_CACHE_MAXSIZ;
+
+    /* Sweep every interval, or every second while the cache is full */
+    if ((now >= swept + CGI_CACHE_SWEEP || (full && now > swept)) &&
+        __atomic_compare_exchange_n(&CGICacheShared->swept, &swept, now, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        cgi_cache_sweep(false);
+        full = __atomic_load_n(&CGICacheShared->size, __ATOMIC_RELAXED) + c->offset > CGI_CACHE_MAXSIZ;
+    }
+
+    /* Store output, or else remember that it was not cacheable */
+    CGICacheHeader header = {
+        .magic   = CGI_CACHE_MAGIC,
+        .keylen  = c->keylen,
+        .expires = now + lifetime,
+    };
+    if (lifetime <= 0 || full) {
+        header.magic   = CGI_CACHE_PASS;
+        header.expires = now + CGI_CACHE_PASSTTL;
+        c->offset      = sizeof(header) + c->keylen;
+        if (ftruncate(c->fd, c->offset) < 0) {
+            cgi_cache_abort(c);
+            return;
+        }
+    }
+    if (pwrite(c->fd, &header, sizeof(header), 0) == sizeof(header) && rename(c->temp, c->path) == 0) {
+        debug("CGI CACHE %s: %s (%ld seconds)", header.magic == CGI_CACHE_MAGIC ? "STORE" : "PASS",
+              c->path, (long)(header.expires - now));
+        __atomic_add_fetch(&CGICacheShared->size, c->offset, __ATOMIC_RELAXED);
+        close(c->fd);
+        c->fd = -1;
+    }
+
+    cgi_cache_abort(c);
+}
+
+/**
+ * Discard pending cache entry (if any) and release lock.
+ *
+ * @param   c           CGICache state.
+ **/
+void cgi_cache_abort(CGICache *c) {
+    for (int i = 0; i < 2; i++) {
+        if (c->pipe[i] >= 0) {
+            close(c->pipe[i]);
+            c->pipe[i] = -1;
+        }
+    }
+    if (c->fd >= 0) {
+        close(c->fd);
+        unlink(c->temp);
+        c->fd = -1;
+    }
+    if (c->lock_fd >= 0) {
+        flock(c->lock_fd, LOCK_UN);
+        close(c->lock_fd);
+        c->lock_fd = -1;
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,198 @@
+/* executor.c: Per-Class Request Executors */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Executor Structures */
+
+typedef struct {
+    RequestClass    class;              /*< Class of requests served */
+    Request       **queue;              /*< Circular queue of pending requests */
+    size_t          head;               /*< Index of oldest pending request */
+    size_t          count;              /*< Number of pending requests */
+    size_t          active;             /*< Number of requests being handled */
+    pthread_mutex_t lock;               /*< Protects queue */
+    pthread_cond_t  ready;              /*< Signalled when a request is queued */
+    pthread_cond_t  idle;               /*< Signalled when the queue runs empty */
+    bool            running;            /*< Whether worker threads were started */
+} Executor;
+
+/* Globals */
+
+ExecutorOptions ExecutorConfig[REQUEST_CLASSES] = {
+    [REQUEST_CGI]  = {.threads = 4, .depth = 64, .nice = 0},
+    [REQUEST_COLD] = {.threads = 2, .depth = 64, .nice = 0},
+};
+
+static Executor Executors[REQUEST_CLASSES];
+
+/**
+ * Parse executor option of the form class=threads[:depth[:nice]].
+ *
+ * @param   option      Option string.
+ * @return  true if option was recognized, false otherwise.
+ *
+ * A class with zero threads is handled inline by the accepting worker.  The
+ * depth bounds how many requests may wait for a thread before new ones are
+ * rejected, and nice lowers (or raises) the scheduling priority of the
+ * class's threads relative to the accepting worker.
+ *
+ * Examples:
+ *
+ *  cgi=8:128:10    Eight CGI threads, 128 queued requests, nice 10
+ *  file=0          Serve static files inline (the default)
+ **/
+bool parse_executor_option(const char *option) {
+    const char *value = strchr(option, '=');
+
+    if (!value) {
+        return false;
+    }
+
+    for (RequestClass class = 0; class < REQUEST_CLASSES; class++) {
+        const char *name = request_class_name(class);
+        if (strlen(name) != (size_t)(value - option) || strncmp(option, name, value - option) != 0) {
+            continue;
+        }
+
+        ExecutorOptions o = {.depth = 64};
+        if (sscanf(value + 1, "%d:%d:%d", &o.threads, &o.depth, &o.nice) < 1 || o.threads < 0 || o.depth < 1) {
+            return false;
+        }
+        ExecutorConfig[class] = o;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Worker thread: handle queued requests of one class.
+ **/
+static void * executor_thread(void *arg) {
+    Executor *e = arg;
+
+    if (ExecutorConfig[e->class].nice) {
+        setpriority(PRIO_PROCESS, syscall(SYS_gettid), ExecutorConfig[e->class].nice);
+    }
+
+    while (true) {
+        pthread_mutex_lock(&e->lock);
+        while (e->count == 0) {
+            pthread_cond_wait(&e->ready, &e->lock);
+        }
+        Request *r = e->queue[e->head];
+        e->head = (e->head + 1) % ExecutorConfig[e->class].depth;
+        e->count--;
+        e->active++;
+        pthread_mutex_unlock(&e->lock);
+
+        handle_dispatch(r);
+        free_request(r);
+
+        pthread_mutex_lock(&e->lock);
+        if (--e->active == 0 && e->count == 0) {
+            pthread_cond_broadcast(&e->idle);
+        }
+        pthread_mutex_unlock(&e->lock);
+    }
+    return NULL;
+}
+
+/**
+ * Start worker threads for every class configured with threads.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * This must only be called in servers whose workers outlive the request
+ * (i.e. not in forking children), since queued requests are finished
+ * asynchronously.  Prefork workers call it after fork, so each worker has
+ * its own threads, and must executor_drain before they exit.
+ **/
+int executor_start(void) {
+    for (RequestClass class = 0; class < REQUEST_CLASSES; class++) {
+        ExecutorOptions *o = &ExecutorConfig[class];
+        Executor        *e = &Executors[class];
+
+        if (o->threads == 0) {
+            continue;
+        }
+
+        e->class = class;
+        if (!(e->queue = calloc(o->depth, sizeof(Request *)))) {
+            fprintf(stderr, "Unable to allocate executor queue: %s\n", strerror(errno));
+            return -1;
+        }
+        pthread_mutex_init(&e->lock, NULL);
+        pthread_cond_init(&e->ready, NULL);
+        pthread_cond_init(&e->idle, NULL);
+
+        for (int i = 0; i < o->threads; i++) {
+            pthread_t thread;
+            int status = pthread_create(&thread, NULL, executor_thread, e);
+            if (status != 0) {
+                fprintf(stderr, "Unable to create executor thread: %s\n", strerror(status));
+                return -1;
+            }
+            pthread_detach(thread);
+        }
+        e->running = true;
+
+        log("Executor %s: threads=%d depth=%d nice=%d", request_class_name(class), o->threads, o->depth, o->nice);
+    }
+    return 0;
+}
+
+/**
+ * Hand classified request to its class's executor.
+ *
+ * @param   r           Classified HTTP Request structure.
+ * @return  EXECUTOR_QUEUED if a worker thread now owns (and will free) the
+ *          request, EXECUTOR_FULL if the queue is at its depth limit, or
+ *          EXECUTOR_INLINE if the caller must handle the request itself.
+ **/
+ExecutorStatus executor_submit(Request *r) {
+    Executor *e = &Executors[r->type];
+
+    if (!e->running) {
+        return EXECUTOR_INLINE;
+    }
+
+    pthread_mutex_lock(&e->lock);
+    if (e->count == (size_t)ExecutorConfig[r->type].depth) {
+        pthread_mutex_unlock(&e->lock);
+        return EXECUTOR_FULL;
+    }
+    e->queue[(e->head + e->count) % ExecutorConfig[r->type].depth] = r;
+    e->count++;
+    pthread_cond_signal(&e->ready);
+    pthread_mutex_unlock(&e->lock);
+    return EXECUTOR_QUEUED;
+}
+
+/**
+ * Wait until every executor has finished the requests queued to it.
+ **/
+void executor_drain(void) {
+    for (RequestClass class = 0; class < REQUEST_CLASSES; class++) {
+        Executor *e = &Executors[class];
+
+        if (!e->running) {
+            continue;
+        }
+
+        pthread_mutex_lock(&e->lock);
+        while (e->count || e->active) {
+            pthread_cond_wait(&e->idle, &e->lock);
+        }
+        pthread_mutex_unlock(&e->lock);
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,272 @@
+/* filecache.c: In-Memory Static File Response Cache */
+
+#include "spidey.h"
+
+#include <pthread.h>
+#include <string.h>
+
+/* Constants */
+
+#define FILE_CACHE_BUCKETS      4096        /* Hash table buckets (power of 2) */
+#define FILE_CACHE_SKETCH_WIDTH 4096        /* Counters per sketch row (power of 2) */
+#define FILE_CACHE_SKETCH_DEPTH 4           /* Sketch rows */
+#define FILE_CACHE_SKETCH_MAX   15          /* Saturation value of counters */
+#define FILE_CACHE_SAMPLES      (10 * FILE_CACHE_SKETCH_WIDTH)  /* Aging period */
+
+/* Globals */
+
+static FileCacheEntry  *FileCacheBuckets[FILE_CACHE_BUCKETS];   /*< Hash chains */
+static FileCacheEntry  *FileCacheHand;                          /*< CLOCK hand */
+static size_t           FileCacheUsed;                          /*< Bytes charged to budget */
+static uint8_t          FileCacheSketch[FILE_CACHE_SKETCH_DEPTH][FILE_CACHE_SKETCH_WIDTH];
+static size_t           FileCacheSamples;                       /*< Accesses since aging */
+static pthread_mutex_t  FileCacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Compute FNV-1a hash of path.
+ **/
+static uint64_t file_cache_hash(const char *path) {
+    uint64_t h = 14695981039346656037ull;
+    for (; *path; path++) {
+        h ^= (unsigned char)*path;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+/* Frequency Sketch (TinyLFU) */
+
+static inline size_t file_cache_sketch_index(uint64_t hash, int row) {
+    return (uint32_t)(hash + row * (hash >> 32)) & (FILE_CACHE_SKETCH_WIDTH - 1);
+}
+
+/**
+ * Estimate access frequency of key (minimum over rows).
+ **/
+static int file_cache_frequency(uint64_t hash) {
+    int frequency = FILE_CACHE_SKETCH_MAX;
+    for (int row = 0; row < FILE_CACHE_SKETCH_DEPTH; row++) {
+        int count = FileCacheSketch[row][file_cache_sketch_index(hash, row)];
+        frequency = count < frequency ? count : frequency;
+    }
+    return frequency;
+}
+
+/**
+ * Record access to key.
+ *
+ * Only the smallest counters are incremented (conservative update), and all
+ * counters are halved periodically so that popularity decays over time.
+ **/
+static void file_cache_record(uint64_t hash) {
+    int frequency = file_cache_frequency(hash);
+
+    if (frequency < FILE_CACHE_SKETCH_MAX) {
+        for (int row = 0; row < FILE_CACHE_SKETCH_DEPTH; row++) {
+            uint8_t *count = &FileCacheSketch[row][file_cache_sketch_index(hash, row)];
+            if (*count == frequency) {
+                (*count)++;
+            }
+        }
+    }
+
+    if (++FileCacheSamples == FILE_CACHE_SAMPLES) {
+        for (int row = 0; row < FILE_CACHE_SKETCH_DEPTH; row++) {
+            for (size_t i = 0; i < FILE_CACHE_SKETCH_WIDTH; i++) {
+                FileCacheSketch[row][i] >>= 1;
+            }
+        }
+        FileCacheSamples /= 2;
+    }
+}
+
+/* Entries */
+
+static size_t file_cache_cost(FileCacheEntry *e) {
+    return sizeof(FileCacheEntry) + strlen(e->path) + 1 + e->length;
+}
+
+static void file_cache_free(FileCacheEntry *e) {
+    free(e->path);
+    free(e->data);
+    free(e);
+}
+
+/**
+ * Remove entry from hash table and CLOCK ring (caller holds lock).
+ *
+ * The entry is freed once no request still references it.
+ **/
+static void file_cache_unlink(FileCacheEntry *e) {
+    FileCacheEntry **pp = &FileCacheBuckets[e->hash & (FILE_CACHE_BUCKETS - 1)];
+    while (*pp != e) {
+        pp = &(*pp)->next;
+    }
+    *pp = e->next;
+
+    if (e->clock_next == e) {
+        FileCacheHand = NULL;
+    } else {
+        e->clock_prev->clock_next = e->clock_next;
+        e->clock_next->clock_prev = e->clock_prev;
+        if (FileCacheHand == e) {
+            FileCacheHand = e->clock_next;
+        }
+    }
+
+    FileCacheUsed -= file_cache_cost(e);
+    e->linked = false;
+    if (e->refs == 0) {
+        file_cache_free(e);
+    }
+}
+
+/**
+ * Advance CLOCK hand to the next entry without its reference bit set.
+ **/
+static FileCacheEntry * file_cache_victim(void) {
+    while (FileCacheHand && FileCacheHand->referenced) {
+        FileCacheHand->referenced = false;
+        FileCacheHand = FileCacheHand->clock_next;
+    }
+    return FileCacheHand;
+}
+
+/**
+ * Determine whether cached entry still matches file.
+ **/
+static bool file_cache_valid(FileCacheEntry *e, const struct stat *s) {
+    return e->ino == s->st_ino && e->size == s->st_size &&
+           e->mtime.tv_sec == s->st_mtim.tv_sec && e->mtime.tv_nsec == s->st_mtim.tv_nsec &&
+           e->ctime.tv_sec == s->st_ctim.tv_sec && e->ctime.tv_nsec == s->st_ctim.tv_nsec;
+}
+
+/**
+ * Lookup complete response for file.
+ *
+ * @param   path        Resolved path of file.
+ * @param   s           Current status of file.
+ * @return  Referenced entry (release with file_cache_release) or NULL.
+ *
+ * Every lookup also counts towards the file's popularity, which decides
+ * whether it is admitted into a full cache later.  Entries whose file has
+ * changed since they were stored are dropped.
+ **/
+FileCacheEntry * file_cache_lookup(const char *path, const struct stat *s) {
+    uint64_t        hash = file_cache_hash(path);
+    FileCacheEntry *e;
+
+    if (!FileCacheBudget) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&FileCacheLock);
+    file_cache_record(hash);
+    for (e = FileCacheBuckets[hash & (FILE_CACHE_BUCKETS - 1)]; e; e = e->next) {
+        if (e->hash == hash && streq(e->path, path)) {
+            break;
+        }
+    }
+    if (e && !file_cache_valid(e, s)) {
+        file_cache_unlink(e);
+        e = NULL;
+    }
+    if (e) {
+        e->referenced = true;
+        e->refs++;
+    }
+    pthread_mutex_unlock(&FileCacheLock);
+    return e;
+}
+
+/**
+ * Release entry returned by file_cache_lookup.
+ **/
+void file_cache_release(FileCacheEntry *e) {
+    pthread_mutex_lock(&FileCacheLock);
+    if (--e->refs == 0 && !e->linked) {
+        file_cache_free(e);
+    }
+    pthread_mutex_unlock(&FileCacheLock);
+}
+
+/**
+ * Offer complete response for file to cache.
+ *
+ * @param   path        Resolved path of file.
+ * @param   s           Status of file when it was read.
+ * @param   data        Complete response (allocated; ownership is taken).
+ * @param   length      Length of response.
+ *
+ * While the cache is within budget every response is admitted.  Once full,
+ * the CLOCK hand picks an eviction victim and the newcomer only replaces it
+ * if the frequency sketch says it is more popular (TinyLFU).  One-off
+ * requests, such as a crawler walking the tree, therefore cannot flush the
+ * hot set.
+ **/
+void file_cache_insert(const char *path, const struct stat *s, char *data, size_t length) {
+    FileCacheEntry *e = calloc(1, sizeof(FileCacheEntry));
+
+    if (!e || !(e->path = strdup(path))) {
+        free(e);
+        free(data);
+        return;
+    }
+    *e = (FileCacheEntry){
+        .hash   = file_cache_hash(path),
+        .path   = e->path,
+        .data   = data,
+        .length = length,
+        .ino    = s->st_ino,
+        .size   = s->st_size,
+        .mtime  = s->st_mtim,
+        .ctime  = s->st_ctim,
+        .linked = true,
+    };
+    size_t cost = file_cache_cost(e);
+
+    pthread_mutex_lock(&FileCacheLock);
+
+    /* Another worker may have stored the same file first */
+    for (FileCacheEntry *o = FileCacheBuckets[e->hash & (FILE_CACHE_BUCKETS - 1)]; o; o = o->next) {
+        if (o->hash == e->hash && streq(o->path, path)) {
+            goto reject;
+        }
+    }
+
+    /* Make room, but only for something more popular than what it evicts */
+    while (cost <= FileCacheBudget && FileCacheUsed + cost > FileCacheBudget) {
+        FileCacheEntry *victim = file_cache_victim();
+        if (!victim || file_cache_frequency(e->hash) <= file_cache_frequency(victim->hash)) {
+            goto reject;
+        }
+        debug("FILE CACHE EVICT: %s", victim->path);
+        file_cache_unlink(victim);
+    }
+    if (FileCacheUsed + cost > FileCacheBudget) {
+        goto reject;
+    }
+
+    /* Link into hash chain and behind the CLOCK hand */
+    FileCacheEntry **bucket = &FileCacheBuckets[e->hash & (FILE_CACHE_BUCKETS - 1)];
+    e->next = *bucket;
+    *bucket = e;
+    if (FileCacheHand) {
+        e->clock_next = FileCacheHand;
+        e->clock_prev = FileCacheHand->clock_prev;
+        e->clock_prev->clock_next = e;
+        FileCacheHand->clock_prev = e;
+    } else {
+        e->clock_next = e->clock_prev = FileCacheHand = e;
+    }
+    FileCacheUsed += cost;
+    debug("FILE CACHE STORE: %s (%zu bytes, %zu used)", path, length, FileCacheUsed);
+    pthread_mutex_unlock(&FileCacheLock);
+    return;
+
+reject:
+    pthread_mutex_unlock(&FileCacheLock);
+    file_cache_free(e);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
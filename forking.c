@@ -36,12 +36,14 @@ int forking_server(int sfd) {
             continue;
         }
         else if(pid == 0){
-            close(sfd);
+            signal(SIGCHLD, SIG_DFL);   /* So waitpid can reap CGI scripts */
+            socket_close_listeners();
             handle_request(request);
             free_request(request);
             exit(EXIT_SUCCESS);
         }
         else{
+            request->phases |= 1u << TRACE_DONE;    /* Child traces completion */
             free_request(request);
         }
 
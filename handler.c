@@ -1,20 +1,45 @@
 /* handler.c: HTTP Request Handlers */
 
+#define _GNU_SOURCE
+
 #include "spidey.h"
 
 #include <errno.h>
 #include <limits.h>
 #include <string.h>
+#include <strings.h>
 
 #include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+/* Constants */
+
+#define BROWSE_DENTSIZ  65536           /* getdents64 batch buffer size */
+#define BROWSE_FLUSHSIZ 16384           /* Flush listing once this much is pending */
+#define CGI_SPLICESIZ   65536           /* Maximum CGI output moved per splice */
+
+/* Kernel directory entry (see getdents64(2)) */
+struct linux_dirent64 {
+    uint64_t        d_ino;
+    int64_t         d_off;
+    unsigned short  d_reclen;
+    unsigned char   d_type;
+    char            d_name[];
+};
+
 /* Internal Declarations */
 HTTPStatus handle_browse_request(Request *request);
 HTTPStatus handle_file_request(Request *request);
 HTTPStatus handle_cgi_request(Request *request);
-HTTPStatus handle_error(Request *request, HTTPStatus status);
+HTTPStatus handle_pack_request(Request *request, const PackEntry *entry);
+HTTPStatus handle_unavailable(Request *request);
 
 /**
  * Handle HTTP Request.
@@ -22,53 +47,289 @@ HTTPStatus handle_error(Request *request, HTTPStatus status);
  * @param   r           HTTP Request structure
  * @return  Status of the HTTP request.
  *
- * This parses a request, determines the request path, determines the request
- * type, and then dispatches to the appropriate handler type.
+ * This parses a request and either switches the connection to HTTP/2 (for
+ * the prior knowledge preface or an h2c upgrade) or dispatches it.  If the
+ * request's class has an executor, the request is queued there and
+ * HTTP_STATUS_DEFERRED is returned: the executor then owns the request and
+ * the caller must not free it.
+ *
+ * Requests that waited too long to be started, or whose class already has
+ * too many requests in flight, are shed with handle_unavailable before any
+ * filesystem work is done.
  *
  * On error, handle_error should be used with an appropriate HTTP status code.
  **/
 
 HTTPStatus  handle_request(Request *r) {
-    HTTPStatus result;
+    /* Complete TLS handshake */
+    if (TLSCertPath && !r->local && tls_accept(r) < 0) {
+        return HTTP_STATUS_BAD_REQUEST;
+    }
 
     /* Parse request */
-    if(parse_request(r)==-1){
+    ProfileSample sample;
+    profile_begin(&sample);
+    int parsed = parse_request(r);
+    profile_end(r, PROFILE_PARSE, &sample);
+    if(parsed==-1){
         fprintf(stderr, "Could not parse... %s\n", strerror(errno));
         return handle_error(r, HTTP_STATUS_BAD_REQUEST);
     }
 
+    /* Switch to HTTP/2 on connection preface or upgrade without a body */
+    if (streq(r->method, "PRI") && streq(r->uri, "*")) {
+        return http2_serve(r, false);
+    }
+    const char *upgrade = r->headers[HEADER_UPGRADE];
+    if (upgrade && strstr(upgrade, "h2c") && r->headers[HEADER_HTTP2_SETTINGS] &&
+        !r->headers[HEADER_CONTENT_LENGTH] && !r->headers[HEADER_TRANSFER_ENCODING]) {
+        return http2_serve(r, true);
+    }
+
+    /* Shed request if it already waited too long */
+    if (!shed_admit(r)) {
+        log("HTTP REQUEST SHED: %s queueing delay", r->uri);
+        return handle_unavailable(r);
+    }
+
+    /* Classify request and hand it to its class's executor (if any) */
+    classify_request(r);
+    if (!shed_enter(r)) {
+        log("HTTP REQUEST SHED: %s too many in flight", request_class_name(r->type));
+        return handle_unavailable(r);
+    }
+    switch (executor_submit(r)) {
+        case EXECUTOR_QUEUED:
+            return HTTP_STATUS_DEFERRED;
+        case EXECUTOR_FULL:
+            log("HTTP REQUEST REJECTED: %s queue full", request_class_name(r->type));
+            return handle_unavailable(r);
+        default:
+            return handle_dispatch(r);
+    }
+}
+
+/**
+ * Format shared cache value identifying one version of a file.
+ **/
+static void file_version(const struct stat *s, char *buffer, size_t size) {
+    snprintf(buffer, size, "%lu:%ld:%ld.%ld", (unsigned long)s->st_ino, (long)s->st_size,
+             (long)s->st_mtim.tv_sec, s->st_mtim.tv_nsec);
+}
+
+/**
+ * Determine whether file data is likely in the page cache.
+ *
+ * @param   path        Path to regular file.
+ * @param   s           Status of file.
+ * @return  true if this version of the file was recently read in full.
+ *
+ * This only consults the shared lookup cache, so classification never
+ * opens or reads the file on the accepting thread.  Files that were not
+ * served recently (by any worker) are of unknown page-cache state and are
+ * treated as cold, so their first read happens on an I/O thread.
+ **/
+static bool file_is_warm(const char *path, const struct stat *s) {
+    char expected[SHM_CACHE_VERSIZ];
+    char version[SHM_CACHE_VERSIZ];
+
+    file_version(s, expected, sizeof(expected));
+    return shm_cache_lookup(SHM_CACHE_WARM, path, version, sizeof(version)) && streq(version, expected);
+}
+
+/**
+ * Record that file data was just read in full (and so is in the page cache).
+ *
+ * @param   path        Path to regular file.
+ * @param   s           Status of file.
+ **/
+static void file_mark_warm(const char *path, const struct stat *s) {
+    char version[SHM_CACHE_VERSIZ];
+
+    file_version(s, version, sizeof(version));
+    shm_cache_store(SHM_CACHE_WARM, path, version);
+}
+
+/**
+ * Classify parsed HTTP Request.
+ *
+ * @param   r           HTTP Request structure
+ * @return  Class of the request (also stored in the request).
+ *
+ * This determines the request path and the request type from the file it
+ * names, without handling the request.
+ **/
+RequestClass classify_request(Request *r) {
+    ProfileSample resolve, sample;
+    struct stat s;
+
+    profile_begin(&resolve);
+
+    /* Serve directly from static content pack if possible */
+    if (pack_lookup(r->uri)) {
+        TRACE(r, RESOLVED, r->uri);
+        profile_end(r, PROFILE_RESOLVE, &resolve);
+        return r->type = REQUEST_PACK;
+    }
+
     /* Determine request path */
+    profile_begin(&sample);
     r->path = determine_request_path(r->uri);
+    profile_end(r, PROFILE_REALPATH, &sample);
     debug("HTTP REQUEST PATH: %s", r->path);
 
-    /* Dispatch to appropriate request handler type based on file type */
-    struct stat s;
-    if(stat(r->path, &s) != 0){
-        result = handle_error(r, HTTP_STATUS_BAD_REQUEST);
-        goto done;
+    /* Determine request type based on file type */
+    if(!r->path || stat(r->path, &s) != 0){
+        r->type = REQUEST_ERROR;
     }
-    puts(r->path);
-    if((s.st_mode & S_IFMT) == S_IFDIR){
-        result = handle_browse_request(r);
-        debug("HTTP REQUEST TYPE: BROWSE");
+    else if(S_ISREG(s.st_mode) && (r->cached = file_cache_lookup(r->path, &s))){
+        r->type = REQUEST_FILE;
+    }
+    else if((s.st_mode & S_IFMT) == S_IFDIR){
+        r->type = REQUEST_BROWSE;
     }
     else if(access(r->path, X_OK) == 0){
-        result = handle_cgi_request(r);
-        debug("HTTP REQUEST TYPE: CGI");
+        r->type = REQUEST_CGI;
     }
     else if(access(r->path, R_OK) == 0){
-        result = handle_file_request(r);
-        debug("HTTP REQUEST TYPE: FILE");
+        r->type = file_is_warm(r->path, &s) ? REQUEST_FILE : REQUEST_COLD;
     }
     else{
-        result = handle_error(r, HTTP_STATUS_BAD_REQUEST);
+        r->type = REQUEST_ERROR;
     }
+    TRACE(r, RESOLVED, r->path);
+    profile_end(r, PROFILE_RESOLVE, &resolve);
+    return r->type;
+}
 
-done:
+/**
+ * Dispatch parsed HTTP Request.
+ *
+ * @param   r           HTTP Request structure
+ * @return  Status of the HTTP request.
+ *
+ * This classifies the request (unless that was already done) and then
+ * dispatches to the appropriate handler type.  HTTP/2 streams and executor
+ * threads call this directly.
+ **/
+HTTPStatus  handle_dispatch(Request *r) {
+    ProfileSample sample;
+    HTTPStatus result;
+
+    if (r->type == REQUEST_UNKNOWN) {
+        classify_request(r);
+    }
+    TRACE(r, DISPATCH, r->type);
+    profile_begin(&sample);
+
+    /* Cork socket so headers and body leave in full segments */
+    socket_cork(r->fd, true);
+
+    /* Dispatch to appropriate request handler type */
+    switch (r->type) {
+        case REQUEST_PACK:
+            result = handle_pack_request(r, pack_lookup(r->uri));
+            break;
+        case REQUEST_BROWSE:
+            result = handle_browse_request(r);
+            break;
+        case REQUEST_CGI:
+            result = handle_cgi_request(r);
+            break;
+        case REQUEST_FILE:
+        case REQUEST_COLD:
+            result = handle_file_request(r);
+            break;
+        default:
+            result = handle_error(r, HTTP_STATUS_BAD_REQUEST);
+            break;
+    }
+    debug("HTTP REQUEST TYPE: %s", request_class_name(r->type));
+
+    socket_cork(r->fd, false);
+    profile_end(r, PROFILE_HANDLE, &sample);
     log("HTTP REQUEST STATUS: %s", http_status_string(result));
     return result;
 }
 
+/**
+ * Emit HTML list item for directory entry.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   name        Name of directory entry.
+ **/
+static void browse_entry(Request *r, const char *name) {
+    if (streq(r->uri, "/")){
+        response_printf(r, "<li><a href=\"/%s%s\">%s</a></li>\n", r->uri+1, name, name);
+    }
+    else{
+        response_printf(r, "<li><a href=\"/%s/%s\">%s</a></li>\n", r->uri+1, name, name);
+    }
+
+    /* Keep memory bounded by sending large listings as they are generated */
+    if (r->response.length >= BROWSE_FLUSHSIZ) {
+        response_flush(r);
+    }
+}
+
+/**
+ * Emit link to next page of a paginated listing.
+ **/
+static void browse_next(Request *r, long offset, long limit, bool sorted) {
+    response_printf(r, "<a href=\"?offset=%ld&limit=%ld%s\">Next</a>\r\n", offset + limit, limit, sorted ? "" : "&sort=none");
+}
+
+/**
+ * Stream directory entries in on-disk order using getdents64.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   offset      Number of entries to skip.
+ * @param   limit       Maximum number of entries to emit (0 = unlimited).
+ * @return  -1 if directory cannot be opened, 0 otherwise.
+ *
+ * Entries are read in large batches and written as soon as each batch is
+ * formatted, so memory use is independent of the size of the directory.
+ **/
+static int browse_stream(Request *r, long offset, long limit) {
+    char buffer[BROWSE_DENTSIZ];
+    long index   = 0;
+    long emitted = 0;
+    int  fd      = open(r->path, O_RDONLY | O_DIRECTORY);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    /* Write HTTP Header with OK Status and text/html Content-Type */
+    response_printf(r, "HTTP/1.0 200 OK\r\nContent-Type: text/html\r\n\r\n");
+    response_printf(r, "<ul>\r\n");
+
+    long nread;
+    while ((nread = syscall(SYS_getdents64, fd, buffer, sizeof(buffer))) > 0) {
+        for (long position = 0; position < nread; ) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(buffer + position);
+            position += d->d_reclen;
+
+            if (streq(d->d_name, ".") || index++ < offset) {
+                continue;
+            }
+            if (limit && emitted == limit) {
+                goto done;
+            }
+            browse_entry(r, d->d_name);
+            emitted++;
+        }
+    }
+
+done:
+    close(fd);
+    response_printf(r, "</ul>\r\n");
+    if (limit && emitted == limit) {
+        browse_next(r, offset, limit, false);
+    }
+    return 0;
+}
+
 /**
  * Handle browse request.
  *
@@ -77,13 +338,32 @@ done:
  *
  * This lists the contents of a directory in HTML.
  *
+ * The query string may contain offset= and limit= to paginate the listing
+ * and sort=none to stream entries unsorted (the default if BrowseStream is
+ * set).  Streaming listings use bounded memory regardless of directory size.
+ *
  * If the path cannot be opened or scanned as a directory, then handle error
  * with HTTP_STATUS_NOT_FOUND.
  **/
 HTTPStatus  handle_browse_request(Request *r) {
-    //puts("handle browse");
     struct dirent **entries;
     int n;
+    long offset = query_number(r->query, "offset", 0);
+    long limit  = query_number(r->query, "limit", 0);
+    char sort[8];
+
+    if (offset < 0 || limit < 0) {
+        return handle_error(r, HTTP_STATUS_BAD_REQUEST);
+    }
+
+    /* Stream unsorted listing if requested */
+    if (query_string(r->query, "sort", sort, sizeof(sort)) ? streq(sort, "none") : BrowseStream) {
+        if (browse_stream(r, offset, limit) < 0) {
+            return handle_error(r, HTTP_STATUS_NOT_FOUND);
+        }
+        response_flush(r);
+        return HTTP_STATUS_OK;
+    }
 
     /* Open a directory for reading or scanning */
     if((n=scandir(r->path, &entries, NULL, alphasort)) < 0){
@@ -91,29 +371,67 @@ HTTPStatus  handle_browse_request(Request *r) {
     }
 
     /* Write HTTP Header with OK Status and text/html Content-Type */
-    fputs("HTTP/1.0 200 OK\r\nContent-Type: text/html\r\n\r\n", r->file);
+    response_printf(r, "HTTP/1.0 200 OK\r\nContent-Type: text/html\r\n\r\n");
 
-    /* For each entry in directory, emit HTML list item */
-    fputs("<ul>\r\n", r->file);
+    /* For each entry in requested page of directory, emit HTML list item */
+    response_printf(r, "<ul>\r\n");
     for (size_t i = 1; i < n; i++) {
-        if (streq(r->uri, "/")){
-            fprintf(r->file, "<li><a href=\"/%s%s\">%s</a></li>\n", r->uri+1, entries[i]->d_name, entries[i]->d_name);
-        }
-        else{
-            fprintf(r->file, "<li><a href=\"/%s/%s\">%s</a></li>\n", r->uri+1, entries[i]->d_name, entries[i]->d_name);
+        if (i > offset && (!limit || i <= offset + limit)) {
+            browse_entry(r, entries[i]->d_name);
         }
 
         free(entries[i]);
     }
     free(entries[0]);
     free(entries);
-    fputs("</ul>\r\n", r->file);
+    response_printf(r, "</ul>\r\n");
+    if (limit && n - 1 > offset + limit) {
+        browse_next(r, offset, limit, true);
+    }
 
     /* Flush socket, return OK */
-    fflush(r->file);
+    response_flush(r);
     return HTTP_STATUS_OK;
 }
 
+/**
+ * Send small file as one buffer and offer it to the response cache.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   fd          Open file descriptor.
+ * @param   s           Status of open file.
+ * @param   mimetype    Mimetype of file.
+ * @return  -1 if the file could not be read whole (nothing was sent) and 0
+ *          on success.
+ **/
+static int file_send_cacheable(Request *r, int fd, const struct stat *s, const char *mimetype) {
+    int    hlength = snprintf(NULL, 0, "HTTP/1.0 200 OK\r\nContent-Type: %s\r\n\r\n", mimetype);
+    char  *data    = malloc(hlength + s->st_size + 1);
+    size_t length  = hlength;
+
+    if (!data) {
+        return -1;
+    }
+    snprintf(data, hlength + 1, "HTTP/1.0 200 OK\r\nContent-Type: %s\r\n\r\n", mimetype);
+
+    while (length < hlength + (size_t)s->st_size) {
+        ssize_t nread = pread(fd, data + length, hlength + s->st_size - length, length - hlength);
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nread <= 0) {
+            free(data);
+            return -1;
+        }
+        length += nread;
+    }
+
+    response_write(r, data, length);
+    response_flush(r);
+    file_cache_insert(r->path, s, data, length);
+    return 0;
+}
+
 /**
  * Handle file request.
  *
@@ -122,143 +440,563 @@ HTTPStatus  handle_browse_request(Request *r) {
  *
  * This opens and streams the contents of the specified file to the socket.
  *
+ * If classification found a cached response, it is sent with a single
+ * write instead.  Small files are read whole so that their complete
+ * response can be cached.
+ *
  * If the path cannot be opened for reading, then handle error with
  * HTTP_STATUS_NOT_FOUND.
  **/
 
 HTTPStatus  handle_file_request(Request *r) {
-    FILE *fs;
+    int fd;
     char buffer[BUFSIZ];
     char *mimetype = NULL;
-    size_t nread;
+    ssize_t nread;
+    ProfileSample sample;
+    struct stat s;
+
+    /* Send cached response if present */
+    if (r->cached) {
+        response_write(r, r->cached->data, r->cached->length);
+        response_flush(r);
+        file_cache_release(r->cached);
+        r->cached = NULL;
+        return HTTP_STATUS_OK;
+    }
 
     /* Open file for reading */
-    puts(r->path);
-    if(!(fs = fopen(r->path, "r"))){
-        puts("not opening");
+    if((fd = open(r->path, O_RDONLY)) < 0){
         return handle_error(r, HTTP_STATUS_NOT_FOUND);
-        goto fail;
     }
+    /* Hint that the file is read once from start to end */
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
     /* Determine mimetype */
+    profile_begin(&sample);
     mimetype = determine_mimetype(r->path);
+    profile_end(r, PROFILE_MIMETYPE, &sample);
+    /* Send small files whole so they can be cached */
+    if(FileCacheBudget && fstat(fd, &s) == 0 && S_ISREG(s.st_mode) && s.st_size <= FILE_CACHE_OBJSIZ &&
+       file_send_cacheable(r, fd, &s, mimetype) == 0){
+        file_mark_warm(r->path, &s);
+        close(fd);
+        free(mimetype);
+        return HTTP_STATUS_OK;
+    }
     /* Write HTTP Headers with OK status and determined Content-Type */
-    fprintf(r->file, "HTTP/1.0 200 OK\r\nContent-Type: %s\r\n\r\n", mimetype);
-    /* Read from file and write to socket in chunks */
-    while((nread = fread(buffer, 1, BUFSIZ, fs)) > 0){
-        fwrite(buffer, 1, nread, r->file);
+    response_printf(r, "HTTP/1.0 200 OK\r\nContent-Type: %s\r\n\r\n", mimetype);
+    /* Read from file and write to socket in chunks (first chunk goes out with headers) */
+    while((nread = read(fd, buffer, BUFSIZ)) > 0){
+        response_write(r, buffer, nread);
+        if(response_flush(r) < 0){
+            break;
+        }
+    }
+    /* Remember the file as warm once all of it was read */
+    if(nread == 0 && fstat(fd, &s) == 0){
+        file_mark_warm(r->path, &s);
     }
     /* Close file, flush socket, deallocate mimetype, return OK */
-    fclose(fs);
-    fflush(r->file);
+    close(fd);
+    response_flush(r);
     free(mimetype);
     return HTTP_STATUS_OK;
+}
 
-fail:
-    /* Close file, free mimetype, return INTERNAL_SERVER_ERROR */
-    fclose(fs);
-    free(mimetype);
-    return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+/**
+ * Determine whether Accept-Encoding value accepts content coding.
+ *
+ * @param   header      Value of Accept-Encoding header (may be NULL).
+ * @param   coding      Content coding to look for (ie. "gzip").
+ * @return  Whether the coding is acceptable (has a non-zero q-value).
+ *
+ * An exact match takes precedence over the "*" wildcard, and a coding that
+ * is not listed at all is not acceptable.
+ **/
+static bool accepts_encoding(const char *header, const char *coding) {
+    size_t length   = strlen(coding);
+    int    exact    = -1;
+    int    wildcard = -1;
+
+    while (header && *header) {
+        /* Extract token and optional q-value up to the next comma */
+        header += strspn(header, " \t,");
+        const char *token = header;
+        size_t      size  = strcspn(header, " \t;,");
+        const char *end   = header + strcspn(header, ",");
+        const char *q     = header;
+        bool        accepted = true;
+
+        if (size == 0) {
+            break;
+        }
+
+        while ((q = memchr(q, ';', end - q))) {
+            q += 1 + strspn(q + 1, " \t");
+            if (strncasecmp(q, "q=", 2) == 0) {
+                accepted = strtod(q + 2, NULL) > 0;
+            }
+        }
+
+        if (size == length && strncasecmp(token, coding, length) == 0) {
+            exact = accepted;
+        } else if (size == 1 && *token == '*') {
+            wildcard = accepted;
+        }
+        header = end;
+    }
+
+    return exact >= 0 ? exact : wildcard > 0;
 }
 
 /**
- * Handle CGI request
+ * Handle pack request.
  *
  * @param   r           HTTP Request structure.
- * @return  Status of the HTTP file request.
+ * @param   e           Matching static content pack entry.
+ * @return  Status of the HTTP pack request.
  *
- * This popens and streams the results of the specified executables to the
- * socket.
+ * This writes the precomputed headers and streams the file (or its gzip
+ * variant if the client accepts it) directly from the mapped pack.  If the
+ * client already has the current entity, then respond with Not Modified.
+ **/
+HTTPStatus  handle_pack_request(Request *r, const PackEntry *e) {
+    const char *etag     = r->headers[HEADER_IF_NONE_MATCH];
+    const char *encoding = r->headers[HEADER_ACCEPT_ENCODING];
+
+    /* Write HTTP Headers with Not Modified status if entity matches */
+    if (etag && strstr(etag, e->etag)) {
+        response_printf(r, "HTTP/1.0 %s\r\nETag: %s\r\n\r\n", http_status_string(HTTP_STATUS_NOT_MODIFIED), e->etag);
+        response_flush(r);
+        return HTTP_STATUS_NOT_MODIFIED;
+    }
+
+    /* Write HTTP Headers with OK status and precomputed metadata */
+    bool     gzip   = e->gzip_length && accepts_encoding(encoding, "gzip");
+    uint64_t offset = gzip ? e->gzip_offset : e->offset;
+    uint64_t length = gzip ? e->gzip_length : e->length;
+
+    response_printf(r, "HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Length: %lu\r\nETag: %s\r\n%s%s\r\n",
+        pack_data(e->mimetype), (unsigned long)length, e->etag,
+        gzip ? "Content-Encoding: gzip\r\n" : "",
+        e->gzip_length ? "Vary: Accept-Encoding\r\n" : "");
+
+    /* Write data directly from mapping, flush socket, return OK */
+    response_write(r, pack_data(offset), length);
+    response_flush(r);
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Known headers exported to CGI scripts as environment variables.
+ */
+static const struct {
+    HeaderID    id;
+    const char *variable;
+} CGIHeaders[] = {
+    {HEADER_ACCEPT,             "HTTP_ACCEPT"},
+    {HEADER_ACCEPT_ENCODING,    "HTTP_ACCEPT_ENCODING"},
+    {HEADER_ACCEPT_LANGUAGE,    "HTTP_ACCEPT_LANGUAGE"},
+    {HEADER_CONNECTION,         "HTTP_CONNECTION"},
+    {HEADER_CONTENT_LENGTH,     "CONTENT_LENGTH"},
+    {HEADER_CONTENT_TYPE,       "CONTENT_TYPE"},
+    {HEADER_COOKIE,             "HTTP_COOKIE"},
+    {HEADER_REFERER,            "HTTP_REFERER"},
+    {HEADER_USER_AGENT,         "HTTP_USER_AGENT"},
+};
+
+/**
+ * CGI script environment (inherited environment plus CGI variables).
+ */
+typedef struct {
+    char  **envp;                       /*< NULL-terminated environment */
+    size_t  count;                      /*< Number of variables */
+    size_t  inherited;                  /*< Number of variables from environ */
+} CGIEnvironment;
+
+/**
+ * Set variable in CGI environment, replacing any previous value.
+ **/
+static void cgi_setenv(CGIEnvironment *env, const char *name, const char *value) {
+    size_t length = strlen(name);
+    char  *entry;
+
+    if (asprintf(&entry, "%s=%s", name, value) < 0) {
+        return;
+    }
+
+    for (size_t i = 0; i < env->count; i++) {
+        if (strncmp(env->envp[i], name, length) == 0 && env->envp[i][length] == '=') {
+            if (i >= env->inherited || env->envp[i] != environ[i]) {
+                free(env->envp[i]);
+            }
+            env->envp[i] = entry;
+            return;
+        }
+    }
+    env->envp[env->count++] = entry;
+}
+
+/**
+ * Build CGI environment for request.
  *
- * If the path cannot be popened, then handle error with
- * HTTP_STATUS_INTERNAL_SERVER_ERROR.
+ * @return  -1 on error and 0 on success.
+ *
+ * The environment is built per request instead of with setenv(3), which
+ * is not safe while other threads spawn scripts.
  **/
-HTTPStatus handle_cgi_request(Request *r) {
-    //puts("handle cgi");
-    FILE *pfs;
-    char buffer[BUFSIZ];
+static int cgi_environment(Request *r, CGIEnvironment *env) {
+    size_t inherited = 0;
+
+    while (environ[inherited]) {
+        inherited++;
+    }
+
+    env->envp = calloc(inherited + 16 + sizeof(CGIHeaders) / sizeof(CGIHeaders[0]), sizeof(char *));
+    if (!env->envp) {
+        return -1;
+    }
+    memcpy(env->envp, environ, inherited * sizeof(char *));
+    env->count = env->inherited = inherited;
 
     /* Export CGI environment variables from request structure:
      * http://en.wikipedia.org/wiki/Common_Gateway_Interface */
 
-    setenv("QUERY_STRING", r->query, 1);
-    setenv("REQUEST_METHOD", r->method, 1);
-    setenv("REQUEST_URI", r->uri, 1);
-    setenv("REMOTE_ADDR", r->host, 1);
-    //setenv("SERVER_PORT", Port, 1);
-    setenv("REMOTE_PORT", r->port, 1);
-    setenv("SCRIPT_FILENAME", r->path, 1);
+    cgi_setenv(env, "QUERY_STRING", r->query);
+    cgi_setenv(env, "REQUEST_METHOD", r->method);
+    cgi_setenv(env, "REQUEST_URI", r->uri);
+    cgi_setenv(env, "REMOTE_ADDR", r->cold->host);
+    cgi_setenv(env, "REMOTE_PORT", r->cold->port);
+    cgi_setenv(env, "SCRIPT_FILENAME", r->path);
+    cgi_setenv(env, "DOCUMENT_ROOT", RootPath);
+    if (r->secure) {
+        cgi_setenv(env, "HTTPS", "on");
+    }
 
-    //puts("before setnve");
     /* Export CGI environment variables from request headers */
-    setenv("DOCUMENT_ROOT", RootPath, 1);
-    Header *header = r->headers;
-
-    while(header){
-
-        //puts("top while");
-        if(header->name && streq(header->name, "Host")){
-            //puts("0");
-            char *port = strchr(header->value, ':')+1;
-            char *host = strtok(header->value, ":");
-            //puts("mid1");
-            setenv("HTTP_HOST", host, 1);
-            setenv("SERVER_PORT", port, 1);
-            //puts("2");
+    const char *host = r->headers[HEADER_HOST];
+    if (host) {
+        const char *port = strchr(host, ':');
+        char hostname[NI_MAXHOST];
+        snprintf(hostname, sizeof(hostname), "%.*s", port ? (int)(port - host) : (int)strlen(host), host);
+        cgi_setenv(env, "HTTP_HOST", hostname);
+        if (port) {
+            cgi_setenv(env, "SERVER_PORT", port + 1);
         }
+    }
+    if (r->headers[HEADER_PORT]) {
+        cgi_setenv(env, "HTTP_HOST", r->headers[HEADER_PORT]);
+    }
 
-        else if(header->name && streq(header->name, "Accept-Language")){
-            //puts("3");
-            setenv("HTTP_ACCEPT_LANGUAGE", header->value, 1);
+    for (size_t i = 0; i < sizeof(CGIHeaders) / sizeof(CGIHeaders[0]); i++) {
+        const char *value = r->headers[CGIHeaders[i].id];
+        if (value) {
+            cgi_setenv(env, CGIHeaders[i].variable, value);
         }
+    }
+    return 0;
+}
 
-        else if(header->name && streq(header->name, "Port")){
-            //puts("4");
-            setenv("HTTP_HOST", header->value, 1);
+/**
+ * Release CGI environment.
+ **/
+static void cgi_environment_free(CGIEnvironment *env) {
+    for (size_t i = 0; i < env->count; i++) {
+        if (i >= env->inherited || env->envp[i] != environ[i]) {
+            free(env->envp[i]);
         }
+    }
+    free(env->envp);
+}
 
-        else if(header->name && streq(header->name, "Accept-Encoding")){
-            //puts("5");
-            setenv("HTTP_ACCEPT_ENCODING", header->value, 1);
-        }
+/**
+ * Spawn CGI script with its output (and optionally input) connected to pipes.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   envp        Script environment.
+ * @param   input       Pointer to store (non-blocking) write end of input
+ *                      pipe, or NULL if the script reads /dev/null.
+ * @param   output      Pointer to store read end of output pipe.
+ * @return  Process ID of script or -1 on error.
+ **/
+static pid_t cgi_spawn(Request *r, char **envp, int *input, int *output) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t          attr;
+    sigset_t                   signals;
+    char                      *argv[] = {r->path, NULL};
+    int                        ofds[2];
+    int                        ifds[2] = {-1, -1};
+    pid_t                      pid;
+
+    /* Close-on-exec keeps the pipes out of concurrently spawned scripts */
+    if (pipe2(ofds, O_CLOEXEC) < 0) {
+        return -1;
+    }
+    if (input && pipe2(ifds, O_CLOEXEC) < 0) {
+        close(ofds[0]);
+        close(ofds[1]);
+        return -1;
+    }
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, ofds[1], STDOUT_FILENO);
+    if (input) {
+        posix_spawn_file_actions_adddup2(&actions, ifds[0], STDIN_FILENO);
+    } else {
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    }
 
-        else if(header->name && streq(header->name, "User-Agent")){
-            //puts("6");
-            setenv("HTTP_USER_AGENT", header->value, 1);
+    /* Scripts should not inherit the server's ignored SIGPIPE or blocked signals */
+    posix_spawnattr_init(&attr);
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &signals);
+    sigemptyset(&signals);
+    posix_spawnattr_setsigmask(&attr, &signals);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+
+    int status = posix_spawn(&pid, r->path, &actions, &attr, argv, envp);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    close(ofds[1]);
+    if (input) {
+        close(ifds[0]);
+    }
+
+    if (status != 0) {
+        fprintf(stderr, "Unable to spawn %s: %s\n", r->path, strerror(status));
+        close(ofds[0]);
+        if (input) {
+            close(ifds[1]);
         }
+        return -1;
+    }
+
+    *output = ofds[0];
+    if (input) {
+        /* The server must never block feeding a script that is not reading */
+        fcntl(ifds[1], F_SETFL, O_NONBLOCK);
+        *input = ifds[1];
+    }
+    return pid;
+}
+
+/**
+ * Forward available script output to client (and pending cache entry).
+ *
+ * @param   r           HTTP Request structure.
+ * @param   output      Read end of script output pipe.
+ * @param   cache       CGICache state.
+ * @param   splicing    Whether output can still be spliced to r->fd.
+ * @param   client      Whether the client is still accepting data.
+ * @return  Number of bytes forwarded, 0 at end of output, or -1 on error.
+ *
+ * Output is moved from the pipe to the socket with splice(2), after
+ * tee(2) has copied it into the cache entry, so it is never copied
+ * through user space.  If r->fd cannot be spliced to, or the client goes
+ * away, this falls back to read(2) so a pending cache entry can still be
+ * completed.
+ **/
+static ssize_t cgi_forward(Request *r, int output, CGICache *cache, bool *splicing, bool *client) {
+    char    buffer[BUFSIZ];
+    ssize_t nread;
+
+    if (*splicing) {
+        ssize_t teed  = cgi_cache_tee(cache, output, CGI_SPLICESIZ);
+        ssize_t moved = 0;
+        ssize_t n;
 
-        else if(header->name && streq(header->name, "Connection")){
-            //puts("7");
-            setenv("HTTP_CONNECTION", header->value, 1);
+        do {
+            n = splice(output, NULL, r->fd, NULL, (teed > 0 ? teed : CGI_SPLICESIZ) - moved, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n > 0) {
+                moved += n;
+            }
+        } while ((n > 0 && moved < teed) || (n < 0 && errno == EINTR));
+        if (n >= 0) {
+            if (moved > 0) {
+                TRACE(r, FIRST_BYTE, moved);
+            }
+            return moved;
         }
 
-        else if(header->name && streq(header->name, "Accept")){
-            //puts("8");
-            setenv("HTTP_ACCEPT", header->value, 1);
+        *client   = *client && errno == EINVAL;
+        *splicing = false;
+
+        /* Bytes already teed into the cache entry must not be stored twice */
+        for (ssize_t left = teed - moved; left > 0; left -= nread) {
+            if ((nread = read(output, buffer, left < BUFSIZ ? left : BUFSIZ)) <= 0) {
+                return -1;
+            }
+            if (*client) {
+                response_write(r, buffer, nread);
+                *client = response_flush(r) == 0;
+            }
+        }
+        if (teed > 0) {
+            return teed;
         }
+    }
 
-        //puts("beofre next");
-        header = header->next;
-        //puts("end while");
+    if ((nread = read(output, buffer, BUFSIZ)) <= 0) {
+        return nread;
+    }
+    cgi_cache_write(cache, buffer, nread);
+    if (*client) {
+        response_write(r, buffer, nread);
+        *client = response_flush(r) == 0;
     }
+    return nread;
+}
 
+/**
+ * Handle CGI request
+ *
+ * @param   r           HTTP Request structure.
+ * @return  Status of the HTTP file request.
+ *
+ * This spawns and streams the results of the specified executables to the
+ * socket.
+ *
+ * If the request has a body (Content-Length or chunked), it is decoded and
+ * streamed to the script's stdin while its output is forwarded, so neither
+ * direction has to be buffered whole.
+ *
+ * If the script cannot be spawned, then handle error with
+ * HTTP_STATUS_INTERNAL_SERVER_ERROR.
+ **/
+HTTPStatus handle_cgi_request(Request *r) {
+    CGIEnvironment env;
+    RequestBody body;
+    char buffer[BUFSIZ];
+    char *pending = NULL;
+    size_t npending = 0;
+    int input = -1;
+    int output;
+    int status;
 
-    /* POpen CGI Script */
-    pfs = popen(r->path, "r");
-    if(!pfs){
+    /* Determine request body framing */
+    int has_body = request_body_init(r, &body);
+    if(has_body < 0){
+        return handle_error(r, HTTP_STATUS_BAD_REQUEST);
+    }
+
+    /* Serve from CGI cache or wait for concurrent identical request */
+    CGICache cache;
+    CGICacheStatus cached = cgi_cache_lookup(r, &cache);
+    if(cached == CGI_CACHE_HIT){
+        return HTTP_STATUS_OK;
+    }
+
+    /* Spawn CGI Script */
+    if(cgi_environment(r, &env) < 0){
+        cgi_cache_abort(&cache);
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+    pid_t pid = cgi_spawn(r, env.envp, has_body ? &input : NULL, &output);
+    cgi_environment_free(&env);
+    if(pid < 0){
+        cgi_cache_abort(&cache);
         return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
     }
 
-    /* Copy data from popen to socket */
-    while(fgets(buffer, BUFSIZ, pfs)){
-        fputs(buffer, r->file);
+    /* Body bytes that arrived with the headers come first */
+    if(has_body){
+        const char *expect = r->headers[HEADER_EXPECT];
+        if(expect && strcasecmp(expect, "100-continue") == 0){
+            response_printf(r, "HTTP/1.1 100 Continue\r\n\r\n");
+            response_flush(r);
+        }
+
+        ssize_t n = request_body_decode(&body, r->buffer + r->offset, r->nbuffer - r->offset);
+        pending   = r->buffer + r->offset;
+        npending  = n > 0 ? n : 0;
+        r->offset = r->nbuffer;
+        if(n < 0){
+            close(input);
+            input = -1;
+        }
     }
 
-    /* Close popen, flush socket, return OK */
-    if(pclose(pfs)==-1){
-        fprintf(stderr, "Failed to close stream... %s\n", strerror(errno));
+    /* Feed request body to script while forwarding its output (only as
+     * fast as the client drains it: the script's output is read only once
+     * the socket is writable, so a slow reader leaves it blocked on its
+     * pipe instead of growing any buffer) */
+    bool splicing = true;
+    bool client   = true;
+    bool writable = false;
+    while(true){
+        if(input >= 0 && !npending && body.state == BODY_DONE){
+            close(input);
+            input = -1;
+        }
+
+        bool waiting = client && !writable;
+        struct pollfd pfds[2] = {waiting ? (struct pollfd){r->fd, POLLOUT, 0} : (struct pollfd){output, POLLIN, 0}};
+        nfds_t nfds = 1;
+        bool buffered = input >= 0 && !npending && tls_pending(r);
+        if(input >= 0){
+            pfds[nfds++] = npending ? (struct pollfd){input, POLLOUT, 0} : (struct pollfd){r->fd, POLLIN, 0};
+        }
+        int ready = poll(pfds, nfds, buffered ? 0 : waiting ? WriteConfig.timeout * 1000 : -1);
+        if(ready < 0){
+            if(errno == EINTR) continue;
+            break;
+        }
+        if(ready == 0 && !buffered){
+            log("Client %s:%s stopped reading for %d seconds", r->cold->host, r->cold->port, WriteConfig.timeout);
+            break;
+        }
+        if(buffered){
+            pfds[1].revents |= POLLIN;  /* Body already decrypted by OpenSSL */
+        }
+
+        if(pfds[0].revents && waiting){
+            writable = true;
+        } else if(pfds[0].revents){
+            ssize_t n = cgi_forward(r, output, &cache, &splicing, &client);
+            writable = false;
+            if(n <= 0 || (!client && cached != CGI_CACHE_MISS)){
+                break;
+            }
+        }
+
+        if(nfds == 2 && pfds[1].revents){
+            ssize_t n;
+            if(npending){
+                if((n = write(input, pending, npending)) > 0){
+                    pending  += n;
+                    npending -= n;
+                } else if(n < 0 && errno != EINTR && errno != EAGAIN){
+                    close(input);       /* Script stopped reading */
+                    input = -1;
+                }
+            } else if((n = request_recv(r, buffer, sizeof(buffer))) <= 0 ||
+                      (n = request_body_decode(&body, buffer, n)) < 0){
+                if(n < 0 && errno == EINTR) continue;
+                close(input);           /* Client closed or sent malformed body */
+                input = -1;
+            } else {
+                pending  = buffer;
+                npending = n;
+            }
+        }
+    }
+
+    /* Reap script, publish cache entry, flush socket, return OK */
+    if(input >= 0){
+        close(input);
+    }
+    close(output);
+    while(waitpid(pid, &status, 0) < 0){
+        if(errno != EINTR){
+            fprintf(stderr, "Failed to wait for script... %s\n", strerror(errno));
+            status = -1;
+            break;
+        }
     }
-    //fclose(pfs);
-    fflush(r->file);
+    cgi_cache_commit(&cache, status == 0);
+    response_flush(r);
     return HTTP_STATUS_OK;
 }
 
@@ -275,13 +1013,32 @@ HTTPStatus  handle_error(Request *r, HTTPStatus status) {
     const char *status_string = http_status_string(status);
 
     /* Write HTTP Header */
-    fprintf(r->file, "HTTP/1.0 %s\r\nContent-Type: text/html\r\n\r\n", status_string);
+    response_printf(r, "HTTP/1.0 %s\r\nContent-Type: text/html\r\n\r\n", status_string);
     /* Write HTML Description of Error*/
-    fprintf(r->file, "<html>\n<h1>%s</h1>\n", status_string);
-    fprintf(r->file, "<h2> Did you ever hear the tragedy of Darth Plagueis The Wise? I thought not. It’s not a story the Jedi would tell you. It’s a Sith legend. Darth Plagueis was a Dark Lord of the Sith, so powerful and so wise he could use the Force to influence the midichlorians to create life… He had such a knowledge of the dark side that he could even keep the ones he cared about from dying. The dark side of the Force is a pathway to many abilities some consider to be unnatural. He became so powerful… the only thing he was afraid of was losing his power, which eventually, of course, he did. Unfortunately, he taught his apprentice everything he knew, then his apprentice killed him in his sleep. Ironic. He could save others from death, but not himself.</h2>\r\n</html>\r\n");
- fprintf(r->file, "<center><img src=\"https://i.pinimg.com/736x/4f/bc/25/4fbc2592546f47baf823e95eaf2fc93a--error-star-wars-costumes.jpg\"></center>");
-    /* Return specified status */
+    response_printf(r, "<html>\n<h1>%s</h1>\n", status_string);
+    response_printf(r, "<h2> Did you ever hear the tragedy of Darth Plagueis The Wise? I thought not. It’s not a story the Jedi would tell you. It’s a Sith legend. Darth Plagueis was a Dark Lord of the Sith, so powerful and so wise he could use the Force to influence the midichlorians to create life… He had such a knowledge of the dark side that he could even keep the ones he cared about from dying. The dark side of the Force is a pathway to many abilities some consider to be unnatural. He became so powerful… the only thing he was afraid of was losing his power, which eventually, of course, he did. Unfortunately, he taught his apprentice everything he knew, then his apprentice killed him in his sleep. Ironic. He could save others from death, but not himself.</h2>\r\n</html>\r\n");
+ response_printf(r, "<center><img src=\"https://i.pinimg.com/736x/4f/bc/25/4fbc2592546f47baf823e95eaf2fc93a--error-star-wars-costumes.jpg\"></center>");
+    /* Flush socket, return specified status */
+    response_flush(r);
     return status;
 }
 
+/**
+ * Handle request that is shed under overload.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  HTTP_STATUS_SERVICE_UNAVAILABLE.
+ *
+ * Unlike handle_error, this sends a minimal response in a single write, so
+ * refusing work costs far less than doing it.  Retry-After tells well
+ * behaved clients when to come back.
+ **/
+HTTPStatus  handle_unavailable(Request *r) {
+    response_printf(r, "HTTP/1.0 %s\r\nRetry-After: %d\r\nContent-Type: text/plain\r\n\r\n%s\n",
+                    http_status_string(HTTP_STATUS_SERVICE_UNAVAILABLE), ShedConfig.retry,
+                    http_status_string(HTTP_STATUS_SERVICE_UNAVAILABLE));
+    response_flush(r);
+    return HTTP_STATUS_SERVICE_UNAVAILABLE;
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,123 @@
+/* header.c: Known HTTP Header Table */
+
+#include "spidey.h"
+
+#include <string.h>
+#include <strings.h>
+
+/* Constants */
+
+#define HEADER_HASH_SIZE    32
+
+/**
+ * Canonical names of known headers (indexed by HeaderID).
+ */
+static const char *HeaderNames[HEADER_COUNT] = {
+    [HEADER_ACCEPT]             = "Accept",
+    [HEADER_ACCEPT_ENCODING]    = "Accept-Encoding",
+    [HEADER_ACCEPT_LANGUAGE]    = "Accept-Language",
+    [HEADER_AUTHORIZATION]      = "Authorization",
+    [HEADER_CACHE_CONTROL]      = "Cache-Control",
+    [HEADER_CONNECTION]         = "Connection",
+    [HEADER_CONTENT_LENGTH]     = "Content-Length",
+    [HEADER_CONTENT_TYPE]       = "Content-Type",
+    [HEADER_COOKIE]             = "Cookie",
+    [HEADER_EXPECT]             = "Expect",
+    [HEADER_HOST]               = "Host",
+    [HEADER_HTTP2_SETTINGS]     = "HTTP2-Settings",
+    [HEADER_IF_MODIFIED_SINCE]  = "If-Modified-Since",
+    [HEADER_IF_NONE_MATCH]      = "If-None-Match",
+    [HEADER_PORT]               = "Port",
+    [HEADER_RANGE]              = "Range",
+    [HEADER_REFERER]            = "Referer",
+    [HEADER_TRANSFER_ENCODING]  = "Transfer-Encoding",
+    [HEADER_UPGRADE]            = "Upgrade",
+    [HEADER_USER_AGENT]         = "User-Agent",
+    [HEADER_X_FORWARDED_FOR]    = "X-Forwarded-For",
+    [HEADER_X_FORWARDED_PORT]   = "X-Forwarded-Port",
+};
+
+/**
+ * Perfect hash table of known headers.
+ *
+ * Generated offline so that header_hash maps every name in HeaderNames to a
+ * distinct slot.  Regenerate it whenever a header is added.
+ */
+static const HeaderID HeaderTable[HEADER_HASH_SIZE] = {
+    HEADER_UNKNOWN, HEADER_UPGRADE, HEADER_IF_MODIFIED_SINCE, HEADER_HOST,
+    HEADER_UNKNOWN, HEADER_TRANSFER_ENCODING, HEADER_ACCEPT, HEADER_IF_NONE_MATCH,
+    HEADER_X_FORWARDED_PORT, HEADER_COOKIE, HEADER_USER_AGENT, HEADER_UNKNOWN,
+    HEADER_CONNECTION, HEADER_X_FORWARDED_FOR, HEADER_RANGE, HEADER_CACHE_CONTROL,
+    HEADER_UNKNOWN, HEADER_UNKNOWN, HEADER_EXPECT, HEADER_UNKNOWN,
+    HEADER_CONTENT_TYPE, HEADER_UNKNOWN, HEADER_REFERER, HEADER_ACCEPT_LANGUAGE,
+    HEADER_CONTENT_LENGTH, HEADER_UNKNOWN, HEADER_PORT, HEADER_UNKNOWN,
+    HEADER_HTTP2_SETTINGS, HEADER_AUTHORIZATION, HEADER_ACCEPT_ENCODING, HEADER_UNKNOWN,
+};
+
+/**
+ * Case-insensitive perfect hash of header name.
+ *
+ * Uses only the length and the first, middle and last characters, all
+ * folded to lowercase.
+ **/
+static inline unsigned header_hash(const char *name, size_t length) {
+    return (length * 27 + (name[0] | 0x20) * 19 + (name[length - 1] | 0x20) * 7 + (name[length / 2] | 0x20)) % HEADER_HASH_SIZE;
+}
+
+/**
+ * Map header name to known header identifier.
+ *
+ * @param   name        Header name (need not be NUL-terminated).
+ * @param   length      Length of header name.
+ * @return  HeaderID of known header or HEADER_UNKNOWN.
+ **/
+HeaderID header_lookup(const char *name, size_t length) {
+    if (length == 0) {
+        return HEADER_UNKNOWN;
+    }
+
+    HeaderID id = HeaderTable[header_hash(name, length)];
+    if (id == HEADER_UNKNOWN || strncasecmp(HeaderNames[id], name, length) != 0 || HeaderNames[id][length]) {
+        return HEADER_UNKNOWN;
+    }
+    return id;
+}
+
+/**
+ * Return canonical name of known header.
+ *
+ * @param   id          Known header identifier.
+ * @return  Static header name string.
+ **/
+const char * header_name(HeaderID id) {
+    return id < HEADER_COUNT ? HeaderNames[id] : NULL;
+}
+
+/**
+ * Record header in request.
+ *
+ * @param   r           Request structure.
+ * @param   name        Header name (NUL-terminated).
+ * @param   value       Header value (NUL-terminated).
+ * @return  -1 on error and 0 on success.
+ *
+ * Known headers are stored in their direct slot; unknown (or repeated)
+ * headers are appended to the overflow array.  Neither string is copied, so
+ * both must live as long as the request (typically in its receive buffer).
+ **/
+int request_add_header(Request *r, char *name, char *value) {
+    HeaderID id = header_lookup(name, strlen(name));
+
+    if (id != HEADER_UNKNOWN && !r->headers[id]) {
+        r->headers[id] = value;
+        return 0;
+    }
+
+    if (r->nextra == REQUEST_HEADERS_MAX) {
+        return -1;
+    }
+    r->extra[r->nextra++] = (Header){name, value};
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
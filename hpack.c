@@ -0,0 +1,527 @@
+/* hpack.c: HPACK Header Compression (RFC 7541) */
+
+#include "spidey.h"
+
+#include <string.h>
+
+/* Constants */
+
+#define HPACK_ENTRY_OVERHEAD    32      /* Per-entry size overhead (RFC 7541 4.1) */
+#define HPACK_STATIC_COUNT      61      /* Number of static table entries */
+#define HPACK_STRING_MAX        8192    /* Maximum decoded string length */
+
+/**
+ * Static table (RFC 7541 Appendix A).
+ */
+static const struct {
+    const char *name;
+    const char *value;
+} HPACKStatic[HPACK_STATIC_COUNT + 1] = {
+    {NULL, NULL},
+    {":authority", ""},             {":method", "GET"},             {":method", "POST"},
+    {":path", "/"},                 {":path", "/index.html"},       {":scheme", "http"},
+    {":scheme", "https"},           {":status", "200"},             {":status", "204"},
+    {":status", "206"},             {":status", "304"},             {":status", "400"},
+    {":status", "404"},             {":status", "500"},             {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"}, {"accept-language", ""},  {"accept-ranges", ""},
+    {"accept", ""},                 {"access-control-allow-origin", ""}, {"age", ""},
+    {"allow", ""},                  {"authorization", ""},          {"cache-control", ""},
+    {"content-disposition", ""},    {"content-encoding", ""},       {"content-language", ""},
+    {"content-length", ""},         {"content-location", ""},       {"content-range", ""},
+    {"content-type", ""},           {"cookie", ""},                 {"date", ""},
+    {"etag", ""},                   {"expect", ""},                 {"expires", ""},
+    {"from", ""},                   {"host", ""},                   {"if-match", ""},
+    {"if-modified-since", ""},      {"if-none-match", ""},          {"if-range", ""},
+    {"if-unmodified-since", ""},    {"last-modified", ""},          {"link", ""},
+    {"location", ""},               {"max-forwards", ""},           {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},    {"range", ""},                  {"referer", ""},
+    {"refresh", ""},                {"retry-after", ""},            {"server", ""},
+    {"set-cookie", ""},             {"strict-transport-security", ""}, {"transfer-encoding", ""},
+    {"user-agent", ""},             {"vary", ""},                   {"via", ""},
+    {"www-authenticate", ""},
+};
+
+/**
+ * Huffman code (RFC 7541 Appendix B).
+ */
+static const uint32_t HuffmanCodes[256] = {
+    0x00001ff8, 0x007fffd8, 0x0fffffe2, 0x0fffffe3, 0x0fffffe4, 0x0fffffe5, 0x0fffffe6, 0x0fffffe7,
+    0x0fffffe8, 0x00ffffea, 0x3ffffffc, 0x0fffffe9, 0x0fffffea, 0x3ffffffd, 0x0fffffeb, 0x0fffffec,
+    0x0fffffed, 0x0fffffee, 0x0fffffef, 0x0ffffff0, 0x0ffffff1, 0x0ffffff2, 0x3ffffffe, 0x0ffffff3,
+    0x0ffffff4, 0x0ffffff5, 0x0ffffff6, 0x0ffffff7, 0x0ffffff8, 0x0ffffff9, 0x0ffffffa, 0x0ffffffb,
+    0x00000014, 0x000003f8, 0x000003f9, 0x00000ffa, 0x00001ff9, 0x00000015, 0x000000f8, 0x000007fa,
+    0x000003fa, 0x000003fb, 0x000000f9, 0x000007fb, 0x000000fa, 0x00000016, 0x00000017, 0x00000018,
+    0x00000000, 0x00000001, 0x00000002, 0x00000019, 0x0000001a, 0x0000001b, 0x0000001c, 0x0000001d,
+    0x0000001e, 0x0000001f, 0x0000005c, 0x000000fb, 0x00007ffc, 0x00000020, 0x00000ffb, 0x000003fc,
+    0x00001ffa, 0x00000021, 0x0000005d, 0x0000005e, 0x0000005f, 0x00000060, 0x00000061, 0x00000062,
+    0x00000063, 0x00000064, 0x00000065, 0x00000066, 0x00000067, 0x00000068, 0x00000069, 0x0000006a,
+    0x0000006b, 0x0000006c, 0x0000006d, 0x0000006e, 0x0000006f, 0x00000070, 0x00000071, 0x00000072,
+    0x000000fc, 0x00000073, 0x000000fd, 0x00001ffb, 0x0007fff0, 0x00001ffc, 0x00003ffc, 0x00000022,
+    0x00007ffd, 0x00000003, 0x00000023, 0x00000004, 0x00000024, 0x00000005, 0x00000025, 0x00000026,
+    0x00000027, 0x00000006, 0x00000074, 0x00000075, 0x00000028, 0x00000029, 0x0000002a, 0x00000007,
+    0x0000002b, 0x00000076, 0x0000002c, 0x00000008, 0x00000009, 0x0000002d, 0x00000077, 0x00000078,
+    0x00000079, 0x0000007a, 0x0000007b, 0x00007ffe, 0x000007fc, 0x00003ffd, 0x00001ffd, 0x0ffffffc,
+    0x000fffe6, 0x003fffd2, 0x000fffe7, 0x000fffe8, 0x003fffd3, 0x003fffd4, 0x003fffd5, 0x007fffd9,
+    0x003fffd6, 0x007fffda, 0x007fffdb, 0x007fffdc, 0x007fffdd, 0x007fffde, 0x00ffffeb, 0x007fffdf,
+    0x00ffffec, 0x00ffffed, 0x003fffd7, 0x007fffe0, 0x00ffffee, 0x007fffe1, 0x007fffe2, 0x007fffe3,
+    0x007fffe4, 0x001fffdc, 0x003fffd8, 0x007fffe5, 0x003fffd9, 0x007fffe6, 0x007fffe7, 0x00ffffef,
+    0x003fffda, 0x001fffdd, 0x000fffe9, 0x003fffdb, 0x003fffdc, 0x007fffe8, 0x007fffe9, 0x001fffde,
+    0x007fffea, 0x003fffdd, 0x003fffde, 0x00fffff0, 0x001fffdf, 0x003fffdf, 0x007fffeb, 0x007fffec,
+    0x001fffe0, 0x001fffe1, 0x003fffe0, 0x001fffe2, 0x007fffed, 0x003fffe1, 0x007fffee, 0x007fffef,
+    0x000fffea, 0x003fffe2, 0x003fffe3, 0x003fffe4, 0x007ffff0, 0x003fffe5, 0x003fffe6, 0x007ffff1,
+    0x03ffffe0, 0x03ffffe1, 0x000fffeb, 0x0007fff1, 0x003fffe7, 0x007ffff2, 0x003fffe8, 0x01ffffec,
+    0x03ffffe2, 0x03ffffe3, 0x03ffffe4, 0x07ffffde, 0x07ffffdf, 0x03ffffe5, 0x00fffff1, 0x01ffffed,
+    0x0007fff2, 0x001fffe3, 0x03ffffe6, 0x07ffffe0, 0x07ffffe1, 0x03ffffe7, 0x07ffffe2, 0x00fffff2,
+    0x001fffe4, 0x001fffe5, 0x03ffffe8, 0x03ffffe9, 0x0ffffffd, 0x07ffffe3, 0x07ffffe4, 0x07ffffe5,
+    0x000fffec, 0x00fffff3, 0x000fffed, 0x001fffe6, 0x003fffe9, 0x001fffe7, 0x001fffe8, 0x007ffff3,
+    0x003fffea, 0x003fffeb, 0x01ffffee, 0x01ffffef, 0x00fffff4, 0x00fffff5, 0x03ffffea, 0x007ffff4,
+    0x03ffffeb, 0x07ffffe6, 0x03ffffec, 0x03ffffed, 0x07ffffe7, 0x07ffffe8, 0x07ffffe9, 0x07ffffea,
+    0x07ffffeb, 0x0ffffffe, 0x07ffffec, 0x07ffffed, 0x07ffffee, 0x07ffffef, 0x07fffff0, 0x03ffffee,
+};
+
+static const uint8_t HuffmanLengths[256] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+     6, 10, 10, 12, 13,  6,  8, 11, 10, 10,  8, 11,  8,  6,  6,  6,
+     5,  5,  5,  6,  6,  6,  6,  6,  6,  6,  7,  8, 15,  6, 12, 10,
+    13,  6,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,
+     7,  7,  7,  7,  7,  7,  7,  7,  8,  7,  8, 13, 19, 13, 14,  6,
+    15,  5,  6,  5,  6,  5,  6,  6,  6,  5,  7,  7,  6,  6,  6,  5,
+     6,  7,  6,  5,  5,  6,  7,  7,  7,  7,  7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+
+/* Huffman Decoding Tree */
+
+static int16_t HuffmanTree[512][2];     /*< Child node (>0) or -(symbol + 1) leaf */
+static int     HuffmanNodes = 0;        /*< Number of nodes (0 = not built) */
+
+/**
+ * Build binary decoding tree from Huffman code table.
+ **/
+static void huffman_build(void) {
+    memset(HuffmanTree, 0, sizeof(HuffmanTree));
+    HuffmanNodes = 1;
+
+    for (int symbol = 0; symbol < 256; symbol++) {
+        int node = 0;
+        for (int bit = HuffmanLengths[symbol] - 1; bit >= 0; bit--) {
+            int b = (HuffmanCodes[symbol] >> bit) & 1;
+            if (bit == 0) {
+                HuffmanTree[node][b] = -(symbol + 1);
+            } else {
+                if (HuffmanTree[node][b] == 0) {
+                    HuffmanTree[node][b] = HuffmanNodes++;
+                }
+                node = HuffmanTree[node][b];
+            }
+        }
+    }
+}
+
+/**
+ * Decode Huffman-encoded string.
+ *
+ * @return  Length of decoded string or -1 on error.
+ **/
+static ssize_t huffman_decode(const uint8_t *src, size_t length, char *dst, size_t size) {
+    size_t  n     = 0;
+    int     node  = 0;
+    int     depth = 0;
+    bool    ones  = true;
+
+    for (size_t i = 0; i < length; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            int b    = (src[i] >> bit) & 1;
+            int next = HuffmanTree[node][b];
+
+            ones = ones && b;
+            depth++;
+            if (next < 0) {
+                if (n == size) {
+                    return -1;
+                }
+                dst[n++] = -next - 1;
+                node  = 0;
+                depth = 0;
+                ones  = true;
+            } else if (next == 0) {
+                return -1;
+            } else {
+                node = next;
+            }
+        }
+    }
+
+    /* Padding must be a prefix of EOS (all ones) and shorter than 8 bits */
+    if (depth > 7 || !ones) {
+        return -1;
+    }
+    return n;
+}
+
+/* Dynamic Table */
+
+/**
+ * Return entry at 1-based dynamic index (1 is the newest entry).
+ **/
+static HPACKEntry * hpack_entry(HPACKTable *t, size_t index) {
+    if (index == 0 || index > t->count) {
+        return NULL;
+    }
+    return &t->entries[(t->head + t->capacity - index) % t->capacity];
+}
+
+/**
+ * Evict oldest entries until table fits within size.
+ **/
+static void hpack_evict(HPACKTable *t, size_t size) {
+    while (t->count > 0 && t->size > size) {
+        HPACKEntry *e = hpack_entry(t, t->count);
+        t->size -= e->size;
+        free(e->name);
+        t->count--;
+    }
+}
+
+/**
+ * Add entry to dynamic table, evicting as necessary.
+ **/
+static int hpack_insert(HPACKTable *t, const char *name, size_t nlen, const char *value, size_t vlen) {
+    size_t size = nlen + vlen + HPACK_ENTRY_OVERHEAD;
+
+    if (size > t->max_size) {
+        hpack_evict(t, 0);
+        return 0;
+    }
+    hpack_evict(t, t->max_size - size);
+
+    if (t->count == t->capacity) {
+        size_t      capacity = t->capacity ? t->capacity * 2 : 16;
+        HPACKEntry *entries  = calloc(capacity, sizeof(HPACKEntry));
+        if (!entries) {
+            return -1;
+        }
+        for (size_t i = 0; i < t->count; i++) {
+            entries[i] = *hpack_entry(t, t->count - i);
+        }
+        free(t->entries);
+        t->entries  = entries;
+        t->capacity = capacity;
+        t->head     = t->count;
+    }
+
+    /* Name and value share one allocation */
+    char *storage = malloc(nlen + vlen + 2);
+    if (!storage) {
+        return -1;
+    }
+    memcpy(storage, name, nlen);
+    storage[nlen] = 0;
+    memcpy(storage + nlen + 1, value, vlen);
+    storage[nlen + 1 + vlen] = 0;
+
+    t->entries[t->head] = (HPACKEntry){storage, storage + nlen + 1, nlen, vlen, size};
+    t->head = (t->head + 1) % t->capacity;
+    t->count++;
+    t->size += size;
+    return 0;
+}
+
+/**
+ * Initialize HPACK table with maximum size.
+ **/
+void hpack_init(HPACKTable *t, size_t max_size) {
+    memset(t, 0, sizeof(*t));
+    t->max_size = max_size;
+    t->limit    = max_size;
+    if (!HuffmanNodes) {
+        huffman_build();
+    }
+}
+
+/**
+ * Change maximum size of HPACK table.
+ **/
+void hpack_resize(HPACKTable *t, size_t max_size) {
+    t->max_size = max_size;
+    t->update   = true;
+    hpack_evict(t, max_size);
+}
+
+/**
+ * Release HPACK table entries.
+ **/
+void hpack_free(HPACKTable *t) {
+    hpack_evict(t, 0);
+    free(t->entries);
+    memset(t, 0, sizeof(*t));
+}
+
+/* Decoding */
+
+/**
+ * Decode HPACK integer with N-bit prefix.
+ **/
+static int hpack_integer(const uint8_t **p, const uint8_t *end, int prefix, size_t *value) {
+    size_t max = (1 << prefix) - 1;
+
+    if (*p >= end) {
+        return -1;
+    }
+    *value = *(*p)++ & max;
+    if (*value < max) {
+        return 0;
+    }
+
+    for (int shift = 0; *p < end && shift < 28; shift += 7) {
+        uint8_t b = *(*p)++;
+        *value += (size_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Decode HPACK string literal into buffer.
+ **/
+static ssize_t hpack_string(const uint8_t **p, const uint8_t *end, char *dst, size_t size) {
+    size_t length;
+    bool   huffman;
+
+    if (*p >= end) {
+        return -1;
+    }
+    huffman = **p & 0x80;
+    if (hpack_integer(p, end, 7, &length) < 0 || length > (size_t)(end - *p)) {
+        return -1;
+    }
+
+    const uint8_t *src = *p;
+    *p += length;
+    if (huffman) {
+        return huffman_decode(src, length, dst, size);
+    }
+    if (length > size) {
+        return -1;
+    }
+    memcpy(dst, src, length);
+    return length;
+}
+
+/**
+ * Lookup name and value by combined (static + dynamic) index.
+ **/
+static int hpack_lookup(HPACKTable *t, size_t index, const char **name, size_t *nlen, const char **value, size_t *vlen) {
+    if (index >= 1 && index <= HPACK_STATIC_COUNT) {
+        *name  = HPACKStatic[index].name;
+        *nlen  = strlen(*name);
+        *value = HPACKStatic[index].value;
+        *vlen  = strlen(*value);
+        return 0;
+    }
+
+    HPACKEntry *e = hpack_entry(t, index - HPACK_STATIC_COUNT);
+    if (!e) {
+        return -1;
+    }
+    *name  = e->name;
+    *nlen  = e->nlen;
+    *value = e->value;
+    *vlen  = e->vlen;
+    return 0;
+}
+
+/**
+ * Decode HPACK header block.
+ *
+ * @param   t           Decoder dynamic table.
+ * @param   block       Header block fragment(s).
+ * @param   length      Length of header block.
+ * @param   callback    Function called for each decoded header.
+ * @param   arg         Argument passed to callback.
+ * @return  -1 on error (COMPRESSION_ERROR) and 0 on success.
+ **/
+int hpack_decode(HPACKTable *t, const uint8_t *block, size_t length, HPACKCallback callback, void *arg) {
+    const uint8_t *p   = block;
+    const uint8_t *end = block + length;
+    char  *nbuffer = malloc(HPACK_STRING_MAX);
+    char  *vbuffer = malloc(HPACK_STRING_MAX);
+    int    status  = -1;
+
+    if (!nbuffer || !vbuffer) {
+        goto done;
+    }
+
+    while (p < end) {
+        const char *name, *value;
+        size_t      nlen, vlen, index;
+        ssize_t     n;
+        bool        indexing = false;
+
+        if (*p & 0x80) {
+            /* Indexed header field */
+            if (hpack_integer(&p, end, 7, &index) < 0 || index == 0 ||
+                hpack_lookup(t, index, &name, &nlen, &value, &vlen) < 0) {
+                goto done;
+            }
+        } else if ((*p & 0xe0) == 0x20) {
+            /* Dynamic table size update */
+            if (hpack_integer(&p, end, 5, &index) < 0 || index > t->limit) {
+                goto done;
+            }
+            hpack_resize(t, index);
+            continue;
+        } else {
+            /* Literal with incremental indexing (6-bit) or without (4-bit) */
+            indexing = (*p & 0xc0) == 0x40;
+            if (hpack_integer(&p, end, indexing ? 6 : 4, &index) < 0) {
+                goto done;
+            }
+
+            if (index) {
+                const char *ignored;
+                size_t      ilen;
+                if (hpack_lookup(t, index, &name, &nlen, &ignored, &ilen) < 0) {
+                    goto done;
+                }
+                /* Name may be evicted by insert below, so copy it first */
+                memcpy(nbuffer, name, nlen);
+            } else if ((n = hpack_string(&p, end, nbuffer, HPACK_STRING_MAX)) < 0) {
+                goto done;
+            } else {
+                nlen = n;
+            }
+            name = nbuffer;
+
+            if ((n = hpack_string(&p, end, vbuffer, HPACK_STRING_MAX)) < 0) {
+                goto done;
+            }
+            value = vbuffer;
+            vlen  = n;
+        }
+
+        if (callback(arg, name, nlen, value, vlen) < 0) {
+            goto done;
+        }
+        if (indexing && hpack_insert(t, name, nlen, value, vlen) < 0) {
+            goto done;
+        }
+    }
+    status = 0;
+
+done:
+    free(nbuffer);
+    free(vbuffer);
+    return status;
+}
+
+/* Encoding */
+
+/**
+ * Encode HPACK integer with N-bit prefix and leading flag bits.
+ **/
+static size_t hpack_put_integer(uint8_t *dst, uint8_t flags, int prefix, size_t value) {
+    size_t max = (1 << prefix) - 1;
+    size_t n   = 0;
+
+    if (value < max) {
+        dst[n++] = flags | value;
+        return n;
+    }
+
+    dst[n++] = flags | max;
+    value -= max;
+    while (value >= 128) {
+        dst[n++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    dst[n++] = value;
+    return n;
+}
+
+/**
+ * Encode raw (non-Huffman) HPACK string literal.
+ **/
+static size_t hpack_put_string(uint8_t *dst, const char *s, size_t length) {
+    size_t n = hpack_put_integer(dst, 0x00, 7, length);
+    memcpy(dst + n, s, length);
+    return n + length;
+}
+
+/**
+ * Encode header field.
+ *
+ * @param   t           Encoder dynamic table (mirrors the peer's decoder).
+ * @param   dst         Output buffer.
+ * @param   size        Size of output buffer.
+ * @param   name        Lowercase header name.
+ * @param   value       Header value.
+ * @return  Number of bytes written or -1 if the buffer is too small.
+ *
+ * Exact matches in the static or dynamic table are emitted as a single
+ * index.  Otherwise the field is emitted as a literal with incremental
+ * indexing (reusing an indexed name if possible) so repeated headers on
+ * later streams compress to one byte.
+ **/
+ssize_t hpack_encode(HPACKTable *t, uint8_t *dst, size_t size, const char *name, const char *value) {
+    size_t nlen       = strlen(name);
+    size_t vlen       = strlen(value);
+    size_t name_index = 0;
+    size_t n          = 0;
+
+    if (size < nlen + vlen + 24) {
+        return -1;
+    }
+
+    /* Signal table size change at the start of the next header block */
+    if (t->update) {
+        n += hpack_put_integer(dst, 0x20, 5, t->max_size);
+        t->update = false;
+    }
+
+    for (size_t i = 1; i <= HPACK_STATIC_COUNT; i++) {
+        if (streq(HPACKStatic[i].name, name)) {
+            if (streq(HPACKStatic[i].value, value)) {
+                return n + hpack_put_integer(dst + n, 0x80, 7, i);
+            }
+            if (!name_index) {
+                name_index = i;
+            }
+        }
+    }
+
+    for (size_t i = 1; i <= t->count; i++) {
+        HPACKEntry *e = hpack_entry(t, i);
+        if (streq(e->name, name)) {
+            if (streq(e->value, value)) {
+                return n + hpack_put_integer(dst + n, 0x80, 7, HPACK_STATIC_COUNT + i);
+            }
+            if (!name_index) {
+                name_index = HPACK_STATIC_COUNT + i;
+            }
+        }
+    }
+
+    n += hpack_put_integer(dst + n, 0x40, 6, name_index);
+    if (!name_index) {
+        n += hpack_put_string(dst + n, name, nlen);
+    }
+    n += hpack_put_string(dst + n, value, vlen);
+
+    if (hpack_insert(t, name, nlen, value, vlen) < 0) {
+        return -1;
+    }
+    return n;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,963 @@
+/* http2.c: Cleartext HTTP/2 (h2c) Connections */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <string.h>
+
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define H2_PREFACE              "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_FRAME_HEADER         9           /* Size of frame header */
+#define H2_FRAME_MAX            16384       /* Largest frame we accept */
+#define H2_INPUT_BUFSIZ         (2 * (H2_FRAME_HEADER + H2_FRAME_MAX))
+#define H2_HEADER_BLOCKSIZ      65536       /* Largest header block we accept */
+#define H2_STREAMS_MAX          32          /* SETTINGS_MAX_CONCURRENT_STREAMS */
+#define H2_WINDOW_DEFAULT       65535       /* Initial flow control window */
+#define H2_TABLE_SIZE           4096        /* HPACK dynamic table size */
+#define H2_IDLE_TIMEOUT         10000       /* Idle connection timeout (ms) */
+
+/* Frame types */
+enum {
+    H2_DATA = 0, H2_HEADERS, H2_PRIORITY, H2_RST_STREAM, H2_SETTINGS,
+    H2_PUSH_PROMISE, H2_PING, H2_GOAWAY, H2_WINDOW_UPDATE, H2_CONTINUATION,
+};
+
+/* Frame flags */
+#define H2_FLAG_ACK             0x01
+#define H2_FLAG_END_STREAM      0x01
+#define H2_FLAG_END_HEADERS     0x04
+#define H2_FLAG_PADDED          0x08
+#define H2_FLAG_PRIORITY        0x20
+
+/* Settings */
+enum {
+    H2_SETTINGS_HEADER_TABLE_SIZE = 1, H2_SETTINGS_ENABLE_PUSH, H2_SETTINGS_MAX_CONCURRENT_STREAMS,
+    H2_SETTINGS_INITIAL_WINDOW_SIZE, H2_SETTINGS_MAX_FRAME_SIZE, H2_SETTINGS_MAX_HEADER_LIST_SIZE,
+};
+
+/* Error codes */
+enum {
+    H2_NO_ERROR = 0, H2_PROTOCOL_ERROR, H2_INTERNAL_ERROR, H2_FLOW_CONTROL_ERROR,
+    H2_SETTINGS_TIMEOUT, H2_STREAM_CLOSED, H2_FRAME_SIZE_ERROR, H2_REFUSED_STREAM,
+    H2_CANCEL, H2_COMPRESSION_ERROR,
+};
+
+/* Connection Structures */
+
+typedef enum {
+    H2_STREAM_IDLE = 0,                 /*< Slot is unused */
+    H2_STREAM_OPEN,                     /*< Receiving request */
+    H2_STREAM_SENDING,                  /*< Sending buffered response body */
+} H2StreamState;
+
+typedef struct {
+    uint32_t      id;                   /*< Stream identifier */
+    H2StreamState state;                /*< Stream state */
+    Request      *request;              /*< Request (response goes to a memfd) */
+    int64_t       window;               /*< Peer's receive window for stream */
+    char         *map;                  /*< Mapping of buffered response */
+    size_t        mapped;               /*< Length of mapping */
+    const char   *body;                 /*< Unsent response body */
+    size_t        remaining;            /*< Length of unsent response body */
+    bool          upload;               /*< Request carried a body (DATA) */
+} H2Stream;
+
+typedef struct {
+    Request   *conn;                    /*< Connection (the initial HTTP/1 request) */
+    uint8_t    input[H2_INPUT_BUFSIZ];  /*< Receive buffer */
+    size_t     ninput;                  /*< Number of bytes in receive buffer */
+    HPACKTable decoder;                 /*< Request header decompression */
+    HPACKTable encoder;                 /*< Response header compression */
+    H2Stream   streams[H2_STREAMS_MAX]; /*< Active streams */
+    size_t     nstreams;                /*< Number of active streams */
+    uint32_t   last_stream;             /*< Highest client stream identifier */
+    int64_t    window;                  /*< Peer's connection receive window */
+    uint32_t   initial_window;          /*< Peer's SETTINGS_INITIAL_WINDOW_SIZE */
+    uint32_t   max_frame;               /*< Peer's SETTINGS_MAX_FRAME_SIZE */
+    uint8_t   *block;                   /*< Header block awaiting CONTINUATION */
+    size_t     nblock;                  /*< Length of pending header block */
+    uint32_t   block_stream;            /*< Stream of pending header block */
+    uint8_t    block_flags;             /*< Flags of HEADERS frame that began block */
+    bool       goaway;                  /*< Peer sent GOAWAY */
+    size_t     next;                    /*< Round-robin position for DATA */
+} H2Connection;
+
+/* Byte Order Helpers */
+
+static inline uint32_t get24(const uint8_t *p) { return (p[0] << 16) | (p[1] << 8) | p[2]; }
+static inline uint32_t get32(const uint8_t *p) { return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]; }
+static inline void     put32(uint8_t *p, uint32_t v) { p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v; }
+
+/* Frame Output */
+
+/**
+ * Send frame on connection.
+ *
+ * @return  -1 on error and 0 on success.
+ **/
+static int h2_send_frame(H2Connection *c, uint8_t type, uint8_t flags, uint32_t stream, const void *payload, size_t length) {
+    uint8_t header[H2_FRAME_HEADER] = {length >> 16, length >> 8, length, type, flags};
+
+    put32(header + 5, stream & 0x7fffffff);
+    response_write(c->conn, header, sizeof(header));
+    response_write(c->conn, payload, length);
+    return response_flush(c->conn);
+}
+
+static int h2_send_rst_stream(H2Connection *c, uint32_t stream, uint32_t error) {
+    uint8_t payload[4];
+    put32(payload, error);
+    return h2_send_frame(c, H2_RST_STREAM, 0, stream, payload, sizeof(payload));
+}
+
+static int h2_send_goaway(H2Connection *c, uint32_t error) {
+    uint8_t payload[8];
+    put32(payload, c->last_stream);
+    put32(payload + 4, error);
+    return h2_send_frame(c, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+}
+
+static int h2_send_window_update(H2Connection *c, uint32_t stream, uint32_t increment) {
+    uint8_t payload[4];
+    put32(payload, increment);
+    return h2_send_frame(c, H2_WINDOW_UPDATE, 0, stream, payload, sizeof(payload));
+}
+
+static int h2_send_settings(H2Connection *c) {
+    uint8_t payload[12] = {
+        0, H2_SETTINGS_MAX_CONCURRENT_STREAMS, 0, 0, 0, H2_STREAMS_MAX,
+        0, H2_SETTINGS_ENABLE_PUSH,            0, 0, 0, 0,
+    };
+    return h2_send_frame(c, H2_SETTINGS, 0, 0, payload, sizeof(payload));
+}
+
+/* Streams */
+
+/**
+ * Find active stream by identifier.
+ **/
+static H2Stream * h2_stream_find(H2Connection *c, uint32_t id) {
+    for (size_t i = 0; i < H2_STREAMS_MAX; i++) {
+        if (c->streams[i].state != H2_STREAM_IDLE && c->streams[i].id == id) {
+            return &c->streams[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Allocate stream and its request.
+ *
+ * The request's file descriptor is an anonymous memory file: handlers write
+ * a complete HTTP/1 response into it, which is then reframed for HTTP/2.
+ **/
+static H2Stream * h2_stream_open(H2Connection *c, uint32_t id) {
+    if (c->nstreams == H2_STREAMS_MAX) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < H2_STREAMS_MAX; i++) {
+        H2Stream *s = &c->streams[i];
+        if (s->state != H2_STREAM_IDLE) {
+            continue;
+        }
+
+        Request *r = request_pool_get(false);
+        if (!r) {
+            return NULL;
+        }
+        if ((r->fd = memfd_create("spidey-h2", MFD_CLOEXEC)) < 0) {
+            request_pool_put(r);
+            return NULL;
+        }
+        memcpy(r->cold->host, c->conn->cold->host, sizeof(r->cold->host));
+        memcpy(r->cold->port, c->conn->cold->port, sizeof(r->cold->port));
+
+        *s = (H2Stream){.id = id, .state = H2_STREAM_OPEN, .request = r, .window = c->initial_window};
+        c->nstreams++;
+        return s;
+    }
+    return NULL;
+}
+
+/**
+ * Release stream and its request.
+ **/
+static void h2_stream_close(H2Connection *c, H2Stream *s) {
+    if (s->map) {
+        munmap(s->map, s->mapped);
+    }
+    free_request(s->request);
+    *s = (H2Stream){0};
+    c->nstreams--;
+}
+
+/**
+ * Copy header into stream request.
+ *
+ * Names and values are stored in the request's receive buffer, which is
+ * otherwise unused for HTTP/2 streams.  Repeated cookie fields are joined
+ * with "; " (RFC 7540 8.1.2.5) so CGI scripts see a single HTTP_COOKIE.
+ *
+ * @return  -1 on error and 0 on success.
+ **/
+static int h2_stream_header(Request *r, const char *name, size_t nlen, const char *value, size_t vlen) {
+    const char *cookie = NULL;
+    size_t      clen   = 0;
+
+    if (nlen == 6 && memcmp(name, "cookie", 6) == 0 && (cookie = r->headers[HEADER_COOKIE])) {
+        clen = strlen(cookie) + 2;
+    }
+
+    if (r->nbuffer + nlen + clen + vlen + 2 > REQUEST_BUFSIZ) {
+        return -1;
+    }
+
+    char *n = r->buffer + r->nbuffer;
+    memcpy(n, name, nlen);
+    n[nlen] = 0;
+    char *v = n + nlen + 1;
+    if (cookie) {
+        memcpy(v, cookie, clen - 2);
+        memcpy(v + clen - 2, "; ", 2);
+    }
+    memcpy(v + clen, value, vlen);
+    v[clen + vlen] = 0;
+    r->nbuffer += nlen + clen + vlen + 2;
+
+    if (cookie) {
+        r->headers[HEADER_COOKIE] = v;
+        return 0;
+    }
+    return request_add_header(r, n, v);
+}
+
+/**
+ * Set uri and query of stream request from request target.
+ **/
+static int h2_stream_target(Request *r, const char *path, size_t length) {
+    const char *query = memchr(path, '?', length);
+    size_t      ulen  = query ? (size_t)(query - path) : length;
+
+    free(r->uri);
+    free(r->query);
+    r->uri   = strndup(path, ulen);
+    r->query = query ? strndup(query + 1, length - ulen - 1) : strdup("");
+    return (r->uri && r->query) ? 0 : -1;
+}
+
+/**
+ * HPACK callback: record decoded header field in stream request.
+ **/
+static int h2_decode_header(void *arg, const char *name, size_t nlen, const char *value, size_t vlen) {
+    Request *r = arg;
+
+    if (!r) {
+        return 0;   /* Decoding only to keep HPACK state in sync */
+    }
+
+    if (nlen == 7 && memcmp(name, ":method", 7) == 0) {
+        free(r->method);
+        r->method = strndup(value, vlen);
+        return r->method ? 0 : -1;
+    }
+    if (nlen == 5 && memcmp(name, ":path", 5) == 0) {
+        return h2_stream_target(r, value, vlen);
+    }
+    if (nlen == 10 && memcmp(name, ":authority", 10) == 0) {
+        return h2_stream_header(r, "host", 4, value, vlen);
+    }
+    if (nlen && name[0] == ':') {
+        return 0;
+    }
+    return h2_stream_header(r, name, nlen, value, vlen);
+}
+
+/**
+ * Headers that are meaningless (and forbidden) in HTTP/2 responses.
+ */
+static const char *H2ConnectionHeaders[] = {
+    "connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade",
+};
+
+/**
+ * Parse next line of HTTP/1 response head as header field.
+ *
+ * @return  false at end of head.  Lines that are not header fields (or do
+ *          not fit) are returned with an empty name.
+ **/
+static bool h2_next_field(const char **head, const char *end, char *name, size_t nsize, char *value, size_t vsize) {
+    if (*head >= end) {
+        return false;
+    }
+
+    const char *eol  = memchr(*head, '\n', end - *head);
+    const char *line = *head;
+    size_t      llen = (eol ? eol : end) - line;
+    *head = eol ? eol + 1 : end;
+    if (llen && line[llen - 1] == '\r') {
+        llen--;
+    }
+
+    name[0] = 0;
+    const char *colon = memchr(line, ':', llen);
+    if (!colon || (size_t)(colon - line) >= nsize) {
+        return true;
+    }
+
+    const char *v = colon + 1;
+    while (v < line + llen && (*v == ' ' || *v == '\t')) {
+        v++;
+    }
+    if ((size_t)(line + llen - v) >= vsize) {
+        return true;
+    }
+    snprintf(value, vsize, "%.*s", (int)(line + llen - v), v);
+
+    size_t nlen = colon - line;
+    for (size_t i = 0; i < nlen; i++) {
+        name[i] = tolower((unsigned char)line[i]);
+    }
+    name[nlen] = 0;
+    return true;
+}
+
+/**
+ * Encode HTTP/1 response head as HPACK header block.
+ *
+ * @return  Length of header block.
+ *
+ * Every field is encoded straight into the block in the order it is sent,
+ * since the peer's decoder adds literals to its dynamic table in exactly
+ * that order.  Fields that do not fit are dropped before they reach the
+ * encoder's table, so both tables stay in step.
+ **/
+static size_t h2_encode_head(H2Connection *c, const char *head, size_t length, size_t body, uint8_t *block, size_t size) {
+    const char *end = head + length;
+    const char *p;
+    char   status[4] = "200";
+    char   name[64];
+    char   value[4096];
+    size_t n = 0;
+    bool   has_length = false;
+
+    /* Status line is optional (CGI scripts may only emit headers) */
+    if (length > 5 && memcmp(head, "HTTP/", 5) == 0) {
+        const char *code = memchr(head, ' ', length);
+        if (code && end - code > 3) {
+            memcpy(status, code + 1, 3);
+        }
+        head = memchr(head, '\n', length);
+        head = head ? head + 1 : end;
+    }
+
+    /* :status must come first, so look for a Status field before encoding */
+    for (p = head; h2_next_field(&p, end, name, sizeof(name), value, sizeof(value));) {
+        if (streq(name, "status")) {
+            snprintf(status, sizeof(status), "%.3s", value);
+        }
+        has_length = has_length || streq(name, "content-length");
+    }
+
+    ssize_t encoded = hpack_encode(&c->encoder, block, size, ":status", status);
+    n = encoded > 0 ? encoded : 0;
+    if (!has_length) {
+        snprintf(value, sizeof(value), "%zu", body);
+        encoded = hpack_encode(&c->encoder, block + n, size - n, "content-length", value);
+        n += encoded > 0 ? encoded : 0;
+    }
+
+    /* Translate remaining header lines to lowercase HTTP/2 fields */
+    for (p = head; h2_next_field(&p, end, name, sizeof(name), value, sizeof(value));) {
+        bool skip = !name[0] || streq(name, "status");
+        for (size_t i = 0; i < sizeof(H2ConnectionHeaders) / sizeof(H2ConnectionHeaders[0]); i++) {
+            skip = skip || streq(name, H2ConnectionHeaders[i]);
+        }
+        if (skip) {
+            continue;
+        }
+
+        encoded = hpack_encode(&c->encoder, block + n, size - n, name, value);
+        n += encoded > 0 ? encoded : 0;
+    }
+    return n;
+}
+
+/**
+ * Run handler for stream and send response headers.
+ *
+ * @return  -1 on connection error and 0 on success.
+ *
+ * The handler writes into the stream's memfd, so the response is fully
+ * buffered before any of it is sent.  The body is then sent from a mapping
+ * of the memfd as flow control permits (see h2_send_data).
+ *
+ * Handlers run on the connection's thread, one stream at a time, so a slow
+ * stream (e.g. a long-running CGI script) holds up frames for every other
+ * stream on the connection until its response is complete.  Clients that
+ * mix slow and fast requests are better served by separate connections.
+ **/
+static int h2_stream_dispatch(H2Connection *c, H2Stream *s) {
+    Request    *r = s->request;
+    struct stat st;
+
+    if (!r->method || !r->uri || !r->query) {
+        h2_send_rst_stream(c, s->id, H2_PROTOCOL_ERROR);
+        h2_stream_close(c, s);
+        return 0;
+    }
+
+    /* Request bodies are not forwarded: the receive buffer holds decoded
+     * header fields rather than body bytes, and DATA is discarded */
+    const char *declared = r->headers[HEADER_CONTENT_LENGTH];
+    r->offset = r->nbuffer;
+
+    debug("HTTP/2 STREAM %u: %s %s", s->id, r->method, r->uri);
+    if (s->upload || r->headers[HEADER_TRANSFER_ENCODING] || (declared && !streq(declared, "0"))) {
+        handle_error(r, HTTP_STATUS_NOT_IMPLEMENTED);
+    } else {
+        handle_dispatch(r);
+    }
+    response_flush(r);
+
+    if (fstat(r->fd, &st) < 0) {
+        return -1;
+    }
+    s->mapped = st.st_size;
+    if (s->mapped && (s->map = mmap(NULL, s->mapped, PROT_READ, MAP_PRIVATE, r->fd, 0)) == MAP_FAILED) {
+        s->map = NULL;
+        return -1;
+    }
+
+    /* Split buffered response into head and body */
+    const char *head   = s->map ? s->map : "";
+    size_t      length = s->mapped;
+    const char *lf     = memmem(head, length, "\n\n", 2);
+    const char *crlf   = memmem(head, length, "\r\n\r\n", 4);
+    const char *body   = head + length;
+    if (crlf && (!lf || crlf < lf)) {
+        length = crlf - head;
+        body   = crlf + 4;
+    } else if (lf) {
+        length = lf - head;
+        body   = lf + 2;
+    }
+    s->body      = body;
+    s->remaining = s->map ? s->map + s->mapped - body : 0;
+
+    /* Send header block, split into CONTINUATION frames if necessary */
+    uint8_t block[H2_FRAME_MAX];
+    size_t  nblock = h2_encode_head(c, head, length, s->remaining, block, sizeof(block));
+    size_t offset = 0;
+    do {
+        size_t  chunk = nblock - offset < c->max_frame ? nblock - offset : c->max_frame;
+        uint8_t flags = offset + chunk == nblock ? H2_FLAG_END_HEADERS : 0;
+        if (offset == 0 && !s->remaining) {
+            flags |= H2_FLAG_END_STREAM;
+        }
+        if (h2_send_frame(c, offset ? H2_CONTINUATION : H2_HEADERS, flags, s->id, block + offset, chunk) < 0) {
+            return -1;
+        }
+        offset += chunk;
+    } while (offset < nblock);
+
+    if (!s->remaining) {
+        h2_stream_close(c, s);
+    } else {
+        s->state = H2_STREAM_SENDING;
+    }
+    return 0;
+}
+
+/**
+ * Send pending response bodies as flow control windows permit.
+ *
+ * Streams take turns sending one frame at a time, so a large response does
+ * not starve the others on the same connection.
+ *
+ * @return  -1 on error and 0 on success.
+ **/
+static int h2_send_data(H2Connection *c) {
+    bool progress = true;
+
+    while (progress && c->window > 0) {
+        progress = false;
+        for (size_t i = 0; i < H2_STREAMS_MAX && c->window > 0; i++) {
+            H2Stream *s = &c->streams[(c->next + i) % H2_STREAMS_MAX];
+            if (s->state != H2_STREAM_SENDING || s->window <= 0) {
+                continue;
+            }
+
+            size_t chunk = s->remaining;
+            chunk = chunk < c->max_frame ? chunk : c->max_frame;
+            chunk = (int64_t)chunk < s->window ? chunk : (size_t)s->window;
+            chunk = (int64_t)chunk < c->window ? chunk : (size_t)c->window;
+
+            uint8_t flags = chunk == s->remaining ? H2_FLAG_END_STREAM : 0;
+            if (h2_send_frame(c, H2_DATA, flags, s->id, s->body, chunk) < 0) {
+                return -1;
+            }
+            s->body      += chunk;
+            s->remaining -= chunk;
+            s->window    -= chunk;
+            c->window    -= chunk;
+            progress      = true;
+
+            if (!s->remaining) {
+                h2_stream_close(c, s);
+            }
+        }
+        c->next = (c->next + 1) % H2_STREAMS_MAX;
+    }
+    return 0;
+}
+
+/* Frame Input */
+
+/**
+ * Apply SETTINGS parameters from peer.
+ *
+ * @return  HTTP/2 error code.
+ **/
+static int h2_apply_settings(H2Connection *c, const uint8_t *p, size_t length) {
+    if (length % 6) {
+        return H2_FRAME_SIZE_ERROR;
+    }
+
+    for (; length; p += 6, length -= 6) {
+        uint16_t id    = (p[0] << 8) | p[1];
+        uint32_t value = get32(p + 2);
+
+        switch (id) {
+            case H2_SETTINGS_HEADER_TABLE_SIZE:
+                hpack_resize(&c->encoder, value < H2_TABLE_SIZE ? value : H2_TABLE_SIZE);
+                break;
+            case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+                if (value > 0x7fffffff) {
+                    return H2_FLOW_CONTROL_ERROR;
+                }
+                for (size_t i = 0; i < H2_STREAMS_MAX; i++) {
+                    c->streams[i].window += (int64_t)value - c->initial_window;
+                }
+                c->initial_window = value;
+                break;
+            case H2_SETTINGS_MAX_FRAME_SIZE:
+                if (value < 16384 || value > 16777215) {
+                    return H2_PROTOCOL_ERROR;
+                }
+                c->max_frame = value;
+                break;
+        }
+    }
+    return H2_NO_ERROR;
+}
+
+/**
+ * Decode complete header block and open (or continue) stream.
+ *
+ * @return  HTTP/2 error code.
+ **/
+static int h2_headers(H2Connection *c, uint32_t id, uint8_t flags, const uint8_t *block, size_t length) {
+    H2Stream *s = h2_stream_find(c, id);
+
+    if (!s && (id % 2 == 0 || id <= c->last_stream)) {
+        return H2_PROTOCOL_ERROR;
+    }
+
+    if (!s) {
+        c->last_stream = id;
+        if (!c->goaway) {
+            s = h2_stream_open(c, id);
+        }
+        if (!s) {
+            /* Refused streams must still be decoded to keep HPACK in sync */
+            if (hpack_decode(&c->decoder, block, length, h2_decode_header, NULL) < 0) {
+                return H2_COMPRESSION_ERROR;
+            }
+            return h2_send_rst_stream(c, id, H2_REFUSED_STREAM) < 0 ? H2_INTERNAL_ERROR : H2_NO_ERROR;
+        }
+    }
+
+    /* Trailers are decoded but not passed to handlers */
+    Request *r = s->state == H2_STREAM_OPEN && !s->request->method ? s->request : NULL;
+    if (hpack_decode(&c->decoder, block, length, h2_decode_header, r) < 0) {
+        return H2_COMPRESSION_ERROR;
+    }
+
+    /* Once the request is complete the stream is half-closed, and trailers
+     * must end the stream (RFC 7540 5.1 and 8.1) */
+    if (s->state != H2_STREAM_OPEN || (!r && !(flags & H2_FLAG_END_STREAM))) {
+        uint32_t error = s->state != H2_STREAM_OPEN ? H2_STREAM_CLOSED : H2_PROTOCOL_ERROR;
+        h2_stream_close(c, s);
+        return h2_send_rst_stream(c, id, error) < 0 ? H2_INTERNAL_ERROR : H2_NO_ERROR;
+    }
+
+    if (flags & H2_FLAG_END_STREAM) {
+        return h2_stream_dispatch(c, s) < 0 ? H2_INTERNAL_ERROR : H2_NO_ERROR;
+    }
+    return H2_NO_ERROR;
+}
+
+/**
+ * Strip padding (and priority) from frame payload.
+ *
+ * @return  -1 if padding is invalid and 0 on success.
+ **/
+static int h2_unpad(uint8_t flags, const uint8_t **payload, size_t *length, size_t skip) {
+    size_t pad = 0;
+
+    if (flags & H2_FLAG_PADDED) {
+        if (*length < 1) {
+            return -1;
+        }
+        pad = **payload;
+        (*payload)++;
+        (*length)--;
+    }
+    if (*length < skip + pad) {
+        return -1;
+    }
+    *payload += skip;
+    *length  -= skip + pad;
+    return 0;
+}
+
+/**
+ * Process one frame from peer.
+ *
+ * @return  HTTP/2 error code (anything other than H2_NO_ERROR is fatal).
+ **/
+static int h2_frame(H2Connection *c, uint8_t type, uint8_t flags, uint32_t id, const uint8_t *payload, size_t length) {
+    H2Stream *s;
+
+    /* Header blocks may only be interrupted by their own CONTINUATION */
+    if (c->block && (type != H2_CONTINUATION || id != c->block_stream)) {
+        return H2_PROTOCOL_ERROR;
+    }
+
+    switch (type) {
+        case H2_DATA:
+            if (!id) {
+                return H2_PROTOCOL_ERROR;
+            }
+            /* Replenish windows immediately: bodies are not buffered */
+            if (length && (h2_send_window_update(c, 0, length) < 0)) {
+                return H2_INTERNAL_ERROR;
+            }
+            if (!(s = h2_stream_find(c, id)) || s->state != H2_STREAM_OPEN) {
+                return h2_send_rst_stream(c, id, H2_STREAM_CLOSED) < 0 ? H2_INTERNAL_ERROR : H2_NO_ERROR;
+            }
+            s->upload = s->upload || length;
+            if (flags & H2_FLAG_END_STREAM) {
+                return h2_stream_dispatch(c, s) < 0 ? H2_INTERNAL_ERROR : H2_NO_ERROR;
+            }
+            if (length && h2_send_window_update(c, id, length) < 0) {
+                return H2_INTERNAL_ERROR;
+            }
+            return H2_NO_ERROR;
+
+        case H2_HEADERS:
+            if (!id || h2_unpad(flags, &payload, &length, (flags & H2_FLAG_PRIORITY) ? 5 : 0) < 0) {
+                return H2_PROTOCOL_ERROR;
+            }
+            if (flags & H2_FLAG_END_HEADERS) {
+                return h2_headers(c, id, flags, payload, length);
+            }
+            if (!(c->block = malloc(H2_HEADER_BLOCKSIZ))) {
+                return H2_INTERNAL_ERROR;
+            }
+            memcpy(c->block, payload, length);
+            c->nblock       = length;
+            c->block_stream = id;
+            c->block_flags  = flags;
+            return H2_NO_ERROR;
+
+        case H2_CONTINUATION: {
+            if (!c->block || c->nblock + length > H2_HEADER_BLOCKSIZ) {
+                return H2_PROTOCOL_ERROR;
+            }
+            memcpy(c->block + c->nblock, payload, length);
+            c->nblock += length;
+            if (!(flags & H2_FLAG_END_HEADERS)) {
+                return H2_NO_ERROR;
+            }
+            uint8_t *block = c->block;
+            c->block = NULL;
+            int error = h2_headers(c, c->block_stream, c->block_flags, block, c->nblock);
+            free(block);
+            return error;
+        }
+
+        case H2_RST_STREAM:
+            if (!id || length != 4) {
+                return H2_PROTOCOL_ERROR;
+            }
+            if ((s = h2_stream_find(c, id))) {
+                h2_stream_close(c, s);
+            }
+            return H2_NO_ERROR;
+
+        case H2_SETTINGS: {
+            if (id) {
+                return H2_PROTOCOL_ERROR;
+            }
+            if (flags & H2_FLAG_ACK) {
+                return H2_NO_ERROR;
+            }
+            int error = h2_apply_settings(c, payload, length);
+            if (error == H2_NO_ERROR && h2_send_frame(c, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0) < 0) {
+                return H2_INTERNAL_ERROR;
+            }
+            return error;
+        }
+
+        case H2_PING:
+            if (id || length != 8) {
+                return H2_PROTOCOL_ERROR;
+            }
+            if (!(flags & H2_FLAG_ACK) && h2_send_frame(c, H2_PING, H2_FLAG_ACK, 0, payload, length) < 0) {
+                return H2_INTERNAL_ERROR;
+            }
+            return H2_NO_ERROR;
+
+        case H2_GOAWAY:
+            c->goaway = true;
+            return H2_NO_ERROR;
+
+        case H2_WINDOW_UPDATE: {
+            if (length != 4) {
+                return H2_FRAME_SIZE_ERROR;
+            }
+            uint32_t increment = get32(payload) & 0x7fffffff;
+            if (!increment) {
+                return id ? H2_NO_ERROR : H2_PROTOCOL_ERROR;
+            }
+            if (!id) {
+                c->window += increment;
+                return c->window > 0x7fffffff ? H2_FLOW_CONTROL_ERROR : H2_NO_ERROR;
+            }
+            if ((s = h2_stream_find(c, id))) {
+                s->window += increment;
+            }
+            return H2_NO_ERROR;
+        }
+
+        case H2_PUSH_PROMISE:
+            return H2_PROTOCOL_ERROR;
+
+        default:
+            return H2_NO_ERROR;   /* Unknown and PRIORITY frames are ignored */
+    }
+}
+
+/**
+ * Receive more data into connection input buffer.
+ *
+ * @return  -1 on error or timeout, 0 on end of stream, or bytes received.
+ **/
+static ssize_t h2_receive(H2Connection *c) {
+    struct pollfd pfd = {c->conn->fd, POLLIN, 0};
+    int ready = 1;
+
+    if (!tls_pending(c->conn)) {
+        while ((ready = poll(&pfd, 1, H2_IDLE_TIMEOUT)) < 0 && errno == EINTR);
+    }
+    if (ready <= 0) {
+        return -1;
+    }
+
+    ssize_t nread;
+    while ((nread = request_recv(c->conn, c->input + c->ninput, sizeof(c->input) - c->ninput)) < 0 && errno == EINTR);
+    if (nread > 0) {
+        c->ninput += nread;
+    }
+    return nread;
+}
+
+/**
+ * Decode base64url (RFC 4648 5) without padding.
+ *
+ * @return  Decoded length or -1 on invalid input.
+ **/
+static ssize_t base64url_decode(const char *s, uint8_t *dst, size_t size) {
+    uint32_t bits = 0;
+    int      nbits = 0;
+    size_t   n = 0;
+
+    for (; *s && *s != '='; s++) {
+        const char *alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+        const char *p = strchr(alphabet, *s);
+        if (!p) {
+            return -1;
+        }
+        bits   = (bits << 6) | (p - alphabet);
+        nbits += 6;
+        if (nbits >= 8) {
+            nbits -= 8;
+            if (n == size) {
+                return -1;
+            }
+            dst[n++] = bits >> nbits;
+        }
+    }
+    return n;
+}
+
+/**
+ * Turn upgraded HTTP/1 request into stream 1.
+ *
+ * @return  -1 on error and 0 on success.
+ **/
+static int h2_upgrade(H2Connection *c) {
+    Request *conn = c->conn;
+    uint8_t  settings[256];
+    ssize_t  nsettings = base64url_decode(conn->headers[HEADER_HTTP2_SETTINGS], settings, sizeof(settings));
+
+    if (nsettings < 0 || h2_apply_settings(c, settings, nsettings) != H2_NO_ERROR) {
+        return -1;
+    }
+
+    c->last_stream = 1;
+    H2Stream *s = h2_stream_open(c, 1);
+    if (!s) {
+        return -1;
+    }
+    s->request->method = strdup(conn->method);
+    s->request->uri    = strdup(conn->uri);
+    s->request->query  = strdup(conn->query);
+
+    for (HeaderID id = 0; id < HEADER_COUNT; id++) {
+        const char *name = header_name(id);
+        if (conn->headers[id] && id != HEADER_CONNECTION && id != HEADER_UPGRADE && id != HEADER_HTTP2_SETTINGS) {
+            h2_stream_header(s->request, name, strlen(name), conn->headers[id], strlen(conn->headers[id]));
+        }
+    }
+    for (size_t i = 0; i < conn->nextra; i++) {
+        Header *h = &conn->extra[i];
+        h2_stream_header(s->request, h->name, strlen(h->name), h->value, strlen(h->value));
+    }
+    return 0;
+}
+
+/**
+ * Serve HTTP/2 connection.
+ *
+ * @param   conn        HTTP Request structure that started the connection.
+ * @param   upgrade     Whether the request asked to upgrade from HTTP/1.1
+ *                      (otherwise it was the start of the prior knowledge
+ *                      connection preface).
+ * @return  Status of the connection.
+ *
+ * This sends the server preface, validates the client preface, and then
+ * processes frames until the peer closes the connection, sends GOAWAY, or
+ * goes idle.  Requests on each stream are handled in turn by
+ * handle_dispatch (see h2_stream_dispatch for the head-of-line limit this
+ * implies); their responses are interleaved on the wire subject to
+ * per-stream and connection flow control.
+ **/
+HTTPStatus http2_serve(Request *conn, bool upgrade) {
+    H2Connection *c = calloc(1, sizeof(H2Connection));
+    const char   *preface = upgrade ? H2_PREFACE : H2_PREFACE + 18;
+    size_t        npreface = strlen(preface);
+    int           error = H2_NO_ERROR;
+
+    if (!c) {
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+    c->conn           = conn;
+    c->window         = H2_WINDOW_DEFAULT;
+    c->initial_window = H2_WINDOW_DEFAULT;
+    c->max_frame      = H2_FRAME_MAX;
+    hpack_init(&c->decoder, H2_TABLE_SIZE);
+    hpack_init(&c->encoder, H2_TABLE_SIZE);
+
+    log("HTTP/2 connection from %s:%s (%s)", conn->cold->host, conn->cold->port, upgrade ? "upgrade" : "prior knowledge");
+
+    /* Switch protocols and send server preface */
+    if (upgrade) {
+        response_printf(conn, "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n");
+    }
+    if ((upgrade && h2_upgrade(c) < 0) || h2_send_settings(c) < 0) {
+        goto done;
+    }
+
+    /* Anything read past the HTTP/1 request head belongs to the connection */
+    c->ninput = conn->nbuffer - conn->offset;
+    memcpy(c->input, conn->buffer + conn->offset, c->ninput);
+
+    /* Validate client preface */
+    while (c->ninput < npreface) {
+        if (h2_receive(c) <= 0) {
+            goto done;
+        }
+    }
+    if (memcmp(c->input, preface, npreface) != 0) {
+        error = H2_PROTOCOL_ERROR;
+        goto done;
+    }
+    c->ninput -= npreface;
+    memmove(c->input, c->input + npreface, c->ninput);
+
+    /* Respond to upgraded request on stream 1 */
+    if (upgrade && h2_stream_dispatch(c, h2_stream_find(c, 1)) < 0) {
+        goto done;
+    }
+
+    while (error == H2_NO_ERROR) {
+        /* Process all complete frames */
+        size_t offset = 0;
+        while (error == H2_NO_ERROR && c->ninput - offset >= H2_FRAME_HEADER) {
+            const uint8_t *frame  = c->input + offset;
+            size_t         length = get24(frame);
+            if (length > H2_FRAME_MAX) {
+                error = H2_FRAME_SIZE_ERROR;
+                break;
+            }
+            if (c->ninput - offset < H2_FRAME_HEADER + length) {
+                break;
+            }
+            error   = h2_frame(c, frame[3], frame[4], get32(frame + 5) & 0x7fffffff, frame + H2_FRAME_HEADER, length);
+            offset += H2_FRAME_HEADER + length;
+        }
+        c->ninput -= offset;
+        memmove(c->input, c->input + offset, c->ninput);
+
+        if (error != H2_NO_ERROR || h2_send_data(c) < 0) {
+            break;
+        }
+        if (c->goaway && !c->nstreams) {
+            break;
+        }
+        if (h2_receive(c) <= 0) {
+            break;
+        }
+    }
+
+done:
+    if (error != H2_NO_ERROR) {
+        debug("HTTP/2 connection error: %d", error);
+    }
+    h2_send_goaway(c, error);
+    for (size_t i = 0; i < H2_STREAMS_MAX; i++) {
+        if (c->streams[i].state != H2_STREAM_IDLE) {
+            h2_stream_close(c, &c->streams[i]);
+        }
+    }
+    free(c->block);
+    hpack_free(&c->decoder);
+    hpack_free(&c->encoder);
+    free(c);
+    return error == H2_NO_ERROR ? HTTP_STATUS_OK : HTTP_STATUS_BAD_REQUEST;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,499 @@
+/* pack.c: Memory-mapped Static Content Pack */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+/* Constants */
+
+#define PACK_MAGIC      "SPIDEYPK"
+#define PACK_VERSION    1
+#define PACK_ALIGN      4096
+#define PACK_NO_SLOT    UINT32_MAX
+#define PACK_BUCKET     4               /* Average keys per displacement bucket */
+
+/* On-disk Structures */
+
+typedef struct {
+    char     magic[8];                  /*< PACK_MAGIC */
+    uint32_t version;                   /*< PACK_VERSION */
+    uint32_t count;                     /*< Number of entries */
+    uint32_t nbuckets;                  /*< Number of displacement buckets */
+    uint32_t nslots;                    /*< Number of hash slots */
+    uint64_t entries;                   /*< Offset of PackEntry array */
+    uint64_t displacements;             /*< Offset of uint32_t[nbuckets] */
+    uint64_t slots;                     /*< Offset of uint32_t[nslots] */
+    uint64_t size;                      /*< Total size of pack */
+} PackHeader;
+
+/* Globals */
+
+static char       *PackBase = NULL;     /*< Base of mapped pack */
+static PackHeader *PackHead = NULL;     /*< Mapped pack header */
+
+/* Hashing */
+
+/**
+ * Compute seeded FNV-1a hash of string.
+ *
+ * @param   s           String to hash.
+ * @param   seed        Hash seed (displacement).
+ * @return  32-bit hash value.
+ **/
+static uint32_t pack_hash(const char *s, uint32_t seed) {
+    uint32_t h = 2166136261u ^ (seed * 16777619u);
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    h ^= h >> 15;
+    h *= 0x2c1b3c6d;
+    h ^= h >> 12;
+    return h;
+}
+
+/* Server Functions */
+
+/**
+ * Map pack file into memory.
+ *
+ * @param   path        Path to pack file.
+ * @return  -1 on error and 0 on success.
+ *
+ * The pack is mapped read-only and shared, so every forked worker serves from
+ * the same page cache pages.
+ **/
+int pack_open(const char *path) {
+    struct stat s;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open pack %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (fstat(fd, &s) < 0 || s.st_size < (off_t)sizeof(PackHeader)) {
+        fprintf(stderr, "Unable to stat pack %s\n", path);
+        close(fd);
+        return -1;
+    }
+
+    char *base = mmap(NULL, s.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "Unable to mmap pack %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    PackHeader *head = (PackHeader *)base;
+    if (memcmp(head->magic, PACK_MAGIC, sizeof(head->magic)) != 0 ||
+        head->version != PACK_VERSION || head->size != (uint64_t)s.st_size) {
+        fprintf(stderr, "Invalid pack %s\n", path);
+        munmap(base, s.st_size);
+        return -1;
+    }
+
+    madvise(base, s.st_size, MADV_WILLNEED);
+    PackBase = base;
+    PackHead = head;
+    return 0;
+}
+
+/**
+ * Lookup URI in mapped pack.
+ *
+ * @param   uri         Request URI (without query).
+ * @return  Pointer to PackEntry or NULL if not found (or no pack is mapped).
+ **/
+const PackEntry * pack_lookup(const char *uri) {
+    if (!PackHead || !uri || PackHead->count == 0) {
+        return NULL;
+    }
+
+    const uint32_t  *displacements = (uint32_t *)(PackBase + PackHead->displacements);
+    const uint32_t  *slots         = (uint32_t *)(PackBase + PackHead->slots);
+    const PackEntry *entries       = (PackEntry *)(PackBase + PackHead->entries);
+
+    uint32_t bucket = pack_hash(uri, 0) % PackHead->nbuckets;
+    uint32_t slot   = pack_hash(uri, displacements[bucket]) % PackHead->nslots;
+    uint32_t index  = slots[slot];
+    if (index == PACK_NO_SLOT || !streq(PackBase + entries[index].uri, uri)) {
+        return NULL;
+    }
+    return &entries[index];
+}
+
+/**
+ * Return pointer to data at offset within mapped pack.
+ *
+ * @param   offset      Offset into pack.
+ * @return  Pointer into mapped pack.
+ **/
+const char * pack_data(uint64_t offset) {
+    return PackBase + offset;
+}
+
+/* Builder */
+
+typedef struct {
+    char       *uri;                    /*< Request URI of file */
+    char       *path;                   /*< Filesystem path of file */
+    struct stat st;                     /*< File metadata */
+} PackFile;
+
+static PackFile *PackFiles    = NULL;
+static size_t    PackNFiles   = 0;
+static size_t    PackCapacity = 0;
+static size_t    PackRootLen  = 0;
+
+/**
+ * Collect regular, non-executable files while walking RootPath.
+ *
+ * The walk does not follow symbolic links (FTW_PHYS), so a link cannot pull
+ * files from outside the root into the pack.
+ **/
+static int pack_collect(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    if (type != FTW_F || !S_ISREG(st->st_mode) || access(path, X_OK) == 0) {
+        return 0;
+    }
+
+    if (PackNFiles == PackCapacity) {
+        PackCapacity = PackCapacity ? PackCapacity * 2 : 64;
+        PackFiles    = realloc(PackFiles, PackCapacity * sizeof(PackFile));
+        if (!PackFiles) {
+            return -1;
+        }
+    }
+
+    PackFile *f = &PackFiles[PackNFiles++];
+    f->path = strdup(path);
+    f->uri  = strdup(path + PackRootLen);
+    f->st   = *st;
+    return (f->path && f->uri) ? 0 : -1;
+}
+
+/**
+ * Write buffer to pack at offset.
+ **/
+static int pack_write(int fd, const void *data, size_t length, uint64_t offset) {
+    const char *p = data;
+    while (length > 0) {
+        ssize_t nwritten = pwrite(fd, p, length, offset);
+        if (nwritten < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p      += nwritten;
+        offset += nwritten;
+        length -= nwritten;
+    }
+    return 0;
+}
+
+/**
+ * Append string to pack, returning its offset.
+ **/
+static uint64_t pack_string(int fd, const char *s, uint64_t *end) {
+    uint64_t offset = *end;
+    size_t   length = strlen(s) + 1;
+    if (pack_write(fd, s, length, offset) < 0) {
+        return 0;
+    }
+    *end += length;
+    return offset;
+}
+
+/**
+ * Compress data with gzip framing.
+ *
+ * @return  Allocated compressed buffer (or NULL if it does not save space).
+ **/
+static char * pack_gzip(const char *data, size_t length, size_t *zlength) {
+    z_stream z = {0};
+    if (deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+
+    size_t capacity = deflateBound(&z, length);
+    char  *zdata    = malloc(capacity);
+    if (!zdata) {
+        deflateEnd(&z);
+        return NULL;
+    }
+
+    z.next_in   = (Bytef *)data;
+    z.avail_in  = length;
+    z.next_out  = (Bytef *)zdata;
+    z.avail_out = capacity;
+    if (deflate(&z, Z_FINISH) != Z_STREAM_END || z.total_out + length / 8 >= length) {
+        deflateEnd(&z);
+        free(zdata);
+        return NULL;
+    }
+
+    *zlength = z.total_out;
+    deflateEnd(&z);
+    return zdata;
+}
+
+static const uint32_t *PackStarts = NULL;  /*< Bucket offsets for pack_bucket_compare */
+
+/**
+ * Compare buckets by decreasing size (and then index, for a stable order).
+ **/
+static int pack_bucket_compare(const void *a, const void *b) {
+    uint32_t ba = *(const uint32_t *)a;
+    uint32_t bb = *(const uint32_t *)b;
+    uint32_t sa = PackStarts[ba + 1] - PackStarts[ba];
+    uint32_t sb = PackStarts[bb + 1] - PackStarts[bb];
+
+    if (sa != sb) {
+        return sa < sb ? 1 : -1;
+    }
+    return ba < bb ? -1 : (ba > bb);
+}
+
+/**
+ * Build perfect hash index using hash-and-displace.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * Keys are grouped into buckets by an unseeded hash.  Buckets are then placed
+ * largest first, searching for a displacement seed that sends every key in
+ * the bucket to an unused slot.
+ **/
+static int pack_index(uint32_t nbuckets, uint32_t nslots, uint32_t *displacements, uint32_t *slots) {
+    uint32_t *starts  = calloc(nbuckets + 1, sizeof(uint32_t));
+    uint32_t *members = calloc(PackNFiles + 1, sizeof(uint32_t));
+    uint32_t *order   = calloc(nbuckets, sizeof(uint32_t));
+    uint32_t *trial   = calloc(PackNFiles + 1, sizeof(uint32_t));
+    int       status  = -1;
+
+    if (!starts || !members || !order || !trial) {
+        goto done;
+    }
+
+    for (uint32_t i = 0; i < nslots; i++) {
+        slots[i] = PACK_NO_SLOT;
+    }
+
+    /* Group keys by bucket (counting sort) */
+    for (size_t i = 0; i < PackNFiles; i++) {
+        starts[pack_hash(PackFiles[i].uri, 0) % nbuckets + 1]++;
+    }
+    for (uint32_t b = 0; b < nbuckets; b++) {
+        starts[b + 1] += starts[b];
+    }
+    for (size_t i = 0; i < PackNFiles; i++) {
+        uint32_t bucket = pack_hash(PackFiles[i].uri, 0) % nbuckets;
+        members[starts[bucket] + trial[bucket]++] = i;
+    }
+
+    /* Order non-empty buckets by decreasing size */
+    uint32_t norder = 0;
+    for (uint32_t b = 0; b < nbuckets; b++) {
+        if (starts[b + 1] > starts[b]) {
+            order[norder++] = b;
+        }
+    }
+    PackStarts = starts;
+    qsort(order, norder, sizeof(uint32_t), pack_bucket_compare);
+
+    for (uint32_t o = 0; o < norder; o++) {
+        uint32_t bucket = order[o];
+        uint32_t size   = starts[bucket + 1] - starts[bucket];
+        uint32_t seed;
+
+        for (seed = 1; seed < UINT32_MAX; seed++) {
+            uint32_t placed = 0;
+
+            for (; placed < size; placed++) {
+                uint32_t slot = pack_hash(PackFiles[members[starts[bucket] + placed]].uri, seed) % nslots;
+                if (slots[slot] != PACK_NO_SLOT) {
+                    break;
+                }
+                slots[slot]   = members[starts[bucket] + placed];
+                trial[placed] = slot;
+            }
+
+            if (placed == size) {
+                break;
+            }
+
+            /* Undo partial placement and try next seed */
+            while (placed > 0) {
+                slots[trial[--placed]] = PACK_NO_SLOT;
+            }
+        }
+
+        displacements[bucket] = seed;
+    }
+
+    status = 0;
+
+done:
+    free(starts);
+    free(members);
+    free(order);
+    free(trial);
+    return status;
+}
+
+/**
+ * Walk root directory and write indexed pack file.
+ *
+ * @param   root        Path to root directory.
+ * @param   path        Path to output pack file.
+ * @param   compress    Whether or not to store gzip variants.
+ * @return  -1 on error and 0 on success.
+ *
+ * The pack has the following layout:
+ *
+ *  PackHeader | PackEntry[count] | displacements | slots | strings | data...
+ *
+ * Each file's data (and gzip variant) begins on a page boundary so it can be
+ * served directly from the mapping.  Executable files are skipped since they
+ * are CGI scripts.
+ **/
+int pack_build(const char *root, const char *path, bool compress) {
+    int status = -1;
+    int fd     = -1;
+    PackEntry *entries = NULL;
+    uint32_t  *displacements = NULL;
+    uint32_t  *slots = NULL;
+
+    PackRootLen = strlen(root);
+    if (nftw(root, pack_collect, 16, FTW_PHYS) < 0) {
+        fprintf(stderr, "Unable to walk %s: %s\n", root, strerror(errno));
+        goto done;
+    }
+
+    PackHeader head = {
+        .magic    = PACK_MAGIC,
+        .version  = PACK_VERSION,
+        .count    = PackNFiles,
+        .nbuckets = PackNFiles / PACK_BUCKET + 1,
+        .nslots   = PackNFiles + PackNFiles / 4 + 1,
+    };
+
+    entries       = calloc(head.count + 1, sizeof(PackEntry));
+    displacements = calloc(head.nbuckets, sizeof(uint32_t));
+    slots         = calloc(head.nslots, sizeof(uint32_t));
+    if (!entries || !displacements || !slots || pack_index(head.nbuckets, head.nslots, displacements, slots) < 0) {
+        fprintf(stderr, "Unable to build index: %s\n", strerror(errno));
+        goto done;
+    }
+
+    if ((fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0) {
+        fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+        goto done;
+    }
+
+    head.entries       = sizeof(PackHeader);
+    head.displacements = head.entries + head.count * sizeof(PackEntry);
+    head.slots         = head.displacements + head.nbuckets * sizeof(uint32_t);
+    uint64_t end       = head.slots + head.nslots * sizeof(uint32_t);
+
+    for (size_t i = 0; i < PackNFiles; i++) {
+        PackFile  *f = &PackFiles[i];
+        PackEntry *e = &entries[i];
+        char *mimetype = determine_mimetype(f->path);
+
+        e->uri      = pack_string(fd, f->uri, &end);
+        e->mimetype = pack_string(fd, mimetype, &end);
+        e->mtime    = f->st.st_mtime;
+        snprintf(e->etag, sizeof(e->etag), "\"%lx-%lx\"", (long)f->st.st_mtime, (long)f->st.st_size);
+        free(mimetype);
+    }
+
+    for (size_t i = 0; i < PackNFiles; i++) {
+        PackFile  *f = &PackFiles[i];
+        PackEntry *e = &entries[i];
+        char *data   = NULL;
+        int   ffd    = open(f->path, O_RDONLY | O_NOFOLLOW);
+
+        if (ffd < 0) {
+            fprintf(stderr, "Unable to open %s: %s\n", f->path, strerror(errno));
+            goto done;
+        }
+
+        if (f->st.st_size > 0) {
+            data = mmap(NULL, f->st.st_size, PROT_READ, MAP_PRIVATE, ffd, 0);
+        }
+        close(ffd);
+        if (data == MAP_FAILED) {
+            fprintf(stderr, "Unable to mmap %s: %s\n", f->path, strerror(errno));
+            goto done;
+        }
+
+        end = (end + PACK_ALIGN - 1) & ~(uint64_t)(PACK_ALIGN - 1);
+        e->offset = end;
+        e->length = f->st.st_size;
+        if (data && pack_write(fd, data, e->length, e->offset) < 0) {
+            munmap(data, f->st.st_size);
+            goto done;
+        }
+        end += e->length;
+
+        size_t zlength = 0;
+        char  *zdata   = (compress && data) ? pack_gzip(data, e->length, &zlength) : NULL;
+        if (zdata) {
+            end = (end + PACK_ALIGN - 1) & ~(uint64_t)(PACK_ALIGN - 1);
+            e->gzip_offset = end;
+            e->gzip_length = zlength;
+            if (pack_write(fd, zdata, zlength, end) < 0) {
+                free(zdata);
+                munmap(data, f->st.st_size);
+                goto done;
+            }
+            end += zlength;
+            free(zdata);
+        }
+
+        if (data) {
+            munmap(data, f->st.st_size);
+        }
+        debug("Packed %s (%lu bytes, %lu gzip)", f->uri, (unsigned long)e->length, (unsigned long)e->gzip_length);
+    }
+
+    head.size = end;
+    if (pack_write(fd, &head, sizeof(head), 0) < 0 ||
+        pack_write(fd, entries, head.count * sizeof(PackEntry), head.entries) < 0 ||
+        pack_write(fd, displacements, head.nbuckets * sizeof(uint32_t), head.displacements) < 0 ||
+        pack_write(fd, slots, head.nslots * sizeof(uint32_t), head.slots) < 0 ||
+        ftruncate(fd, end) < 0) {
+        fprintf(stderr, "Unable to write %s: %s\n", path, strerror(errno));
+        goto done;
+    }
+
+    log("Packed %u files from %s into %s (%lu bytes)", head.count, root, path, (unsigned long)end);
+    status = 0;
+
+done:
+    if (fd >= 0) {
+        close(fd);
+    }
+    for (size_t i = 0; i < PackNFiles; i++) {
+        free(PackFiles[i].uri);
+        free(PackFiles[i].path);
+    }
+    free(PackFiles);
+    free(entries);
+    free(displacements);
+    free(slots);
+    PackFiles  = NULL;
+    PackNFiles = PackCapacity = 0;
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,79 @@
+/* packer: Build static content pack for spidey */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <unistd.h>
+
+/* Global Variables */
+char *Port	      = "9898";
+char *MimeTypesPath   = "/etc/mime.types";
+char *DefaultMimeType = "text/plain";
+char *RootPath	      = "www";
+char *PackPath	      = "spidey.pack";
+
+/**
+ * Display usage message and exit with specified status code.
+ *
+ * @param   progname    Program Name
+ * @param   status      Exit status.
+ */
+void usage(const char *progname, int status) {
+    fprintf(stderr, "Usage: %s [hmMrz] pack\n", progname);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -h            Display help message\n");
+    fprintf(stderr, "    -m path       Path to mimetypes file\n");
+    fprintf(stderr, "    -M mimetype   Default mimetype\n");
+    fprintf(stderr, "    -r path       Root directory\n");
+    fprintf(stderr, "    -z            Store gzip variants\n");
+    exit(status);
+}
+
+/**
+ * Parses command line options and writes pack of RootPath.
+ **/
+int main(int argc, char *argv[]) {
+    char *progname = argv[0];
+    bool compress  = false;
+    int  argind    = 1;
+
+    while (argind < argc && strlen(argv[argind]) > 1 && argv[argind][0] == '-') {
+        char *arg = argv[argind++];
+        switch (arg[1]) {
+            case 'h':
+                usage(progname, 0);
+                break;
+            case 'm':
+                MimeTypesPath = argv[argind++];
+                break;
+            case 'M':
+                DefaultMimeType = argv[argind++];
+                break;
+            case 'r':
+                RootPath = argv[argind++];
+                break;
+            case 'z':
+                compress = true;
+                break;
+            default:
+                usage(progname, 1);
+                break;
+        }
+    }
+
+    if (argind < argc) {
+        PackPath = argv[argind++];
+    }
+
+    char buf[BUFSIZ];
+    if (!(RootPath = realpath(RootPath, buf))) {
+        fprintf(stderr, "Unable to resolve root: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    return pack_build(RootPath, PackPath, compress) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,108 @@
+/* pool.c: Request Slab Pool */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+/* Pool Structures */
+
+typedef struct {
+    Request        *requests;           /*< Slab of RequestPoolMax requests */
+    RequestCold    *cold;               /*< Parallel slab of cold fields */
+    uint32_t       *free;               /*< Stack of released slots */
+    size_t          nfree;              /*< Number of released slots */
+    size_t          used;               /*< Slots handed out at least once */
+    pthread_mutex_t lock;
+    pthread_cond_t  released;           /*< Signaled when a slot is released */
+} RequestPool;
+
+/* Globals */
+
+static RequestPool Pool = {
+    .lock     = PTHREAD_MUTEX_INITIALIZER,
+    .released = PTHREAD_COND_INITIALIZER,
+};
+
+/**
+ * Reserve slabs for RequestPoolMax requests.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * The slabs are reserved up front but only backed by memory as slots are
+ * first used, so the pool costs no more than the peak number of requests.
+ **/
+int request_pool_init(void) {
+    size_t size = RequestPoolMax * sizeof(Request);
+    size_t cold = RequestPoolMax * sizeof(RequestCold);
+
+    if (RequestPoolMax == 0 || RequestPoolMax > UINT32_MAX) {
+        fprintf(stderr, "Invalid request pool size: %zu\n", RequestPoolMax);
+        return -1;
+    }
+
+    Pool.requests = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    Pool.cold     = mmap(NULL, cold, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    Pool.free     = calloc(RequestPoolMax, sizeof(uint32_t));
+    if (Pool.requests == MAP_FAILED || Pool.cold == MAP_FAILED || !Pool.free) {
+        fprintf(stderr, "Unable to reserve request pool: %s\n", strerror(errno));
+        return -1;
+    }
+
+    log("Request pool: %zu requests of %zu bytes (+%zu cold)", RequestPoolMax, sizeof(Request), sizeof(RequestCold));
+    return 0;
+}
+
+/**
+ * Take request from pool.
+ *
+ * @param   wait        Whether to wait for a request to be released if the
+ *                      pool is exhausted.
+ * @return  Request with every field cleared, except the receive buffer and
+ *          extra headers in the cold slab (or NULL if the pool is
+ *          exhausted and wait is false).
+ *
+ * The most recently released slot is reused first, since its cache lines
+ * are the most likely to still be in cache.
+ **/
+Request * request_pool_get(bool wait) {
+    size_t slot;
+
+    pthread_mutex_lock(&Pool.lock);
+    while (!Pool.nfree && Pool.used == RequestPoolMax) {
+        if (!wait) {
+            pthread_mutex_unlock(&Pool.lock);
+            return NULL;
+        }
+        pthread_cond_wait(&Pool.released, &Pool.lock);
+    }
+    slot = Pool.nfree ? Pool.free[--Pool.nfree] : Pool.used++;
+    pthread_mutex_unlock(&Pool.lock);
+
+    Request     *r = &Pool.requests[slot];
+    RequestCold *c = &Pool.cold[slot];
+    memset(r, 0, sizeof(Request));
+    memset(c, 0, offsetof(RequestCold, extra));
+    r->cold   = c;
+    r->extra  = c->extra;
+    r->buffer = c->buffer;
+    return r;
+}
+
+/**
+ * Return request to pool.
+ *
+ * @param   r           Request taken with request_pool_get.
+ **/
+void request_pool_put(Request *r) {
+    pthread_mutex_lock(&Pool.lock);
+    Pool.free[Pool.nfree++] = r - Pool.requests;
+    pthread_cond_signal(&Pool.released);
+    pthread_mutex_unlock(&Pool.lock);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
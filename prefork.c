@@ -0,0 +1,384 @@
+/* prefork.c: Self-Tuning Prefork HTTP Server */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define PREFORK_WORKERS_MAX     256     /* Size of scoreboard */
+#define PREFORK_POLL_MS         100     /* How often idle workers check whether to retire */
+#define PREFORK_GROW_AFTER      2       /* Backlogged samples before adding workers */
+#define PREFORK_SHRINK_AFTER    5       /* Idle or thrashing samples before removing one */
+#define PREFORK_COOLDOWN        1       /* Samples to wait after a change */
+
+/* Scoreboard Structures */
+
+typedef enum {
+    WORKER_FREE = 0,                    /* Slot unused */
+    WORKER_IDLE,                        /* Waiting for a connection */
+    WORKER_BUSY,                        /* Handling a request */
+    WORKER_RETIRING,                    /* Exits after its current request */
+} WorkerState;
+
+typedef struct {
+    pid_t    pid;                       /*< Worker process (0 = none) */
+    int      state;                     /*< WorkerState */
+    int      inflight[REQUEST_CLASSES]; /*< Worker's requests counted by shed_enter */
+    size_t   response;                  /*< Worker's response buffer bytes */
+} WorkerSlot;
+
+typedef struct {
+    uint64_t   delay;                   /*< Accept-to-start delay since last sample (ns) */
+    uint64_t   started;                 /*< Requests started since last sample */
+    WorkerSlot slots[PREFORK_WORKERS_MAX];
+} Scoreboard;
+
+typedef struct {
+    uint64_t busy;                      /*< Non-idle CPU time (jiffies) */
+    uint64_t total;                     /*< All CPU time (jiffies) */
+    int      running;                   /*< Runnable tasks */
+} CPUSample;
+
+/* Globals */
+
+WorkerOptions WorkerConfig = {
+    .interval = 1000,
+    .delay    = 5,
+};
+
+static Scoreboard *Board = NULL;        /*< Shared with workers */
+
+/**
+ * Parse worker pool option of the form name=value.
+ *
+ * @param   option      Option string.
+ * @return  true if option was recognized, false otherwise.
+ *
+ * Recognized options:
+ *
+ *  min=N           Minimum worker processes (default 2)
+ *  max=N           Maximum worker processes (default 8 per CPU)
+ *  interval=MS     How often the controller samples load (default 1000)
+ *  delay=MS        Mean accept-to-start delay that adds workers (default 5)
+ **/
+bool parse_worker_option(const char *option) {
+    const char *value  = strchr(option, '=');
+    size_t      length = value ? (size_t)(value - option) : strlen(option);
+    int         number = value ? atoi(value + 1) : -1;
+
+    if (number <= 0) {
+        return false;
+    }
+
+    if (streqn(option, length, "min") && number <= PREFORK_WORKERS_MAX) {
+        WorkerConfig.min = number;
+    } else if (streqn(option, length, "max") && number <= PREFORK_WORKERS_MAX) {
+        WorkerConfig.max = number;
+    } else if (streqn(option, length, "interval")) {
+        WorkerConfig.interval = number;
+    } else if (streqn(option, length, "delay")) {
+        WorkerConfig.delay = number;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Fill in unset pool sizes.
+ **/
+void prefork_defaults(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (!WorkerConfig.min) {
+        WorkerConfig.min = 2;
+    }
+    if (!WorkerConfig.max) {
+        WorkerConfig.max = cpus > 0 && cpus * 8 < PREFORK_WORKERS_MAX ? cpus * 8 : PREFORK_WORKERS_MAX;
+    }
+    if (WorkerConfig.max < WorkerConfig.min) {
+        WorkerConfig.max = WorkerConfig.min;
+    }
+}
+
+/**
+ * Move worker slot from one state to another (unless it is retiring).
+ **/
+static void worker_set(WorkerSlot *slot, int from, int to) {
+    __atomic_compare_exchange_n(&slot->state, &from, to, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/**
+ * Accept and handle requests until retired.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @param   slot        Scoreboard slot of this worker.
+ *
+ * Idle workers wait on the shared listeners with a timeout, so they notice
+ * when the controller retires them (or when the server has gone away).
+ * Each waits in its own exclusive epoll set, so a connection wakes one
+ * idle worker rather than all of them.  Requests handed to the worker's
+ * executors are finished before it returns.
+ **/
+static void worker_loop(int sfd, WorkerSlot *slot) {
+    pid_t parent = getppid();
+
+    socket_watch_listeners();
+
+    while (__atomic_load_n(&slot->state, __ATOMIC_RELAXED) != WORKER_RETIRING && getppid() == parent) {
+        if (!socket_ready(PREFORK_POLL_MS)) {
+            continue;
+        }
+
+        Request *request = accept_request(sfd);
+        if (!request) {
+            continue;
+        }
+
+        worker_set(slot, WORKER_IDLE, WORKER_BUSY);
+        if (handle_request(request) != HTTP_STATUS_DEFERRED) {
+            /* Deferred requests belong to an executor thread now, and wait
+             * in its queue rather than for a worker, so only inline requests
+             * feed the queueing delay */
+            if (request->arrival && request->start > request->arrival) {
+                __atomic_add_fetch(&Board->delay, request->start - request->arrival, __ATOMIC_RELAXED);
+                __atomic_add_fetch(&Board->started, 1, __ATOMIC_RELAXED);
+            }
+            free_request(request);
+        }
+        worker_set(slot, WORKER_BUSY, WORKER_IDLE);
+    }
+
+    /* Finish requests still queued to this worker's executors */
+    executor_drain();
+}
+
+/**
+ * Fork worker into free scoreboard slot.
+ *
+ * @return  -1 on error and 0 on success.
+ **/
+static int worker_spawn(int sfd) {
+    for (int i = 0; i < WorkerConfig.max; i++) {
+        WorkerSlot *slot = &Board->slots[i];
+        if (slot->pid) {
+            continue;
+        }
+
+        slot->state = WORKER_IDLE;
+        pid_t pid = fork();
+        if (pid < 0) {
+            fprintf(stderr, "Unable to fork worker: %s\n", strerror(errno));
+            slot->state = WORKER_FREE;
+            return -1;
+        }
+        if (pid == 0) {
+            prctl(PR_SET_PDEATHSIG, SIGKILL);
+            shed_account(slot->inflight);
+            response_account(&slot->response);
+            if (executor_start() < 0) {
+                exit(EXIT_FAILURE);
+            }
+            worker_loop(sfd, slot);
+            exit(EXIT_SUCCESS);
+        }
+        slot->pid = pid;
+        return 0;
+    }
+    return -1;
+}
+
+/**
+ * Ask one worker to exit once it finishes its current request.
+ *
+ * Idle workers are retired first, highest slot first, so the pool shrinks
+ * from the top and busy workers are left alone.
+ **/
+static void worker_retire(void) {
+    for (int state = WORKER_IDLE; state <= WORKER_BUSY; state++) {
+        for (int i = WorkerConfig.max - 1; i >= 0; i--) {
+            WorkerSlot *slot = &Board->slots[i];
+            int         from = state;
+            if (slot->pid && __atomic_compare_exchange_n(&slot->state, &from, WORKER_RETIRING, false,
+                                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                return;
+            }
+        }
+    }
+}
+
+/**
+ * Free scoreboard slots of workers that exited.
+ *
+ * Requests a worker still had in flight (because it crashed or was killed)
+ * are taken off the shared shedding counts, and its response buffers off
+ * the shared buffering total.
+ **/
+static void worker_reap(void) {
+    pid_t pid;
+    int   status;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (int i = 0; i < PREFORK_WORKERS_MAX; i++) {
+            WorkerSlot *slot = &Board->slots[i];
+            if (slot->pid != pid) {
+                continue;
+            }
+            if (slot->state != WORKER_RETIRING) {
+                log("Worker %d exited unexpectedly (status %d)", pid, status);
+            }
+            shed_release(slot->inflight);
+            response_release(&slot->response);
+            slot->pid   = 0;
+            slot->state = WORKER_FREE;
+        }
+    }
+}
+
+/**
+ * Read CPU time and runnable task count from /proc/stat.
+ **/
+static void cpu_sample(CPUSample *sample) {
+    char  line[BUFSIZ];
+    FILE *fs = fopen("/proc/stat", "r");
+
+    *sample = (CPUSample){0};
+    if (!fs) {
+        return;
+    }
+
+    while (fgets(line, sizeof(line), fs)) {
+        unsigned long long v[8] = {0};
+        if (sscanf(line, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+                   &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]) >= 4) {
+            for (int i = 0; i < 8; i++) {
+                sample->total += v[i];
+            }
+            sample->busy = sample->total - v[3] - v[4];     /* idle and iowait */
+        } else {
+            sscanf(line, "procs_running %d", &sample->running);
+        }
+    }
+    fclose(fs);
+}
+
+/**
+ * Run prefork server: a pool of worker processes sized by a controller.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @return  Exit status of server (EXIT_SUCCESS).
+ *
+ * Workers share the (non-blocking) listeners and each handle one request
+ * at a time.  Every interval the controller samples:
+ *
+ *  - the mean accept-to-start delay (listen queue wait, measured from the
+ *    kernel's receive timestamp of each request's first segment),
+ *  - how many workers are busy and how many connections are queued,
+ *  - CPU utilization and the run queue length (from /proc/stat).
+ *
+ * It adds workers (a quarter more, or up to twice as many while every
+ * worker is busy and connections queue up) when requests wait longer than
+ * the delay target while cores are idle, e.g. because workers block on CGI
+ * scripts.  It removes one when the delay is well below target with
+ * spare idle workers, or when the CPU is saturated with a long run queue,
+ * since more workers then only thrash caches.  Growing takes
+ * PREFORK_GROW_AFTER consecutive samples and shrinking takes
+ * PREFORK_SHRINK_AFTER, with a cooldown after every change, so the pool
+ * does not oscillate.  Every decision is logged.
+ **/
+int prefork_server(int sfd) {
+    long      cpus   = sysconf(_SC_NPROCESSORS_ONLN);
+    int       target = WorkerConfig.min;
+    int       grow   = 0, shrink = 0, cooldown = 0;
+    CPUSample last, now;
+
+    Board = mmap(NULL, sizeof(Scoreboard), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (Board == MAP_FAILED) {
+        fprintf(stderr, "Unable to map scoreboard: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if (socket_share_listeners() < 0) {
+        return EXIT_FAILURE;
+    }
+    cpus = cpus > 0 ? cpus : 1;
+
+    log("Prefork workers: min=%d max=%d interval=%dms delay=%dms",
+        WorkerConfig.min, WorkerConfig.max, WorkerConfig.interval, WorkerConfig.delay);
+    cpu_sample(&last);
+
+    while (true) {
+        /* Keep target number of live workers */
+        worker_reap();
+        int workers = 0, busy = 0;
+        for (int i = 0; i < WorkerConfig.max; i++) {
+            int state = __atomic_load_n(&Board->slots[i].state, __ATOMIC_RELAXED);
+            workers += Board->slots[i].pid && state != WORKER_RETIRING;
+            busy    += state == WORKER_BUSY;
+        }
+        for (; workers < target && worker_spawn(sfd) == 0; workers++);
+        for (; workers > target; workers--) {
+            worker_retire();
+        }
+
+        struct timespec interval = {WorkerConfig.interval / 1000, (WorkerConfig.interval % 1000) * 1000000L};
+        while (nanosleep(&interval, &interval) < 0 && errno == EINTR);
+
+        /* Sample load */
+        cpu_sample(&now);
+        uint64_t delay   = __atomic_exchange_n(&Board->delay, 0, __ATOMIC_RELAXED);
+        uint64_t started = __atomic_exchange_n(&Board->started, 0, __ATOMIC_RELAXED);
+        double   wait    = started ? delay / 1e6 / started : 0.0;
+        double   cpu     = now.total > last.total ? (double)(now.busy - last.busy) / (now.total - last.total) : 0.0;
+        double   runq    = (double)(now.running > 1 ? now.running - 1 : 0) / cpus;  /* Less this process */
+        int      queue   = socket_queue_length(sfd);
+        last = now;
+
+        bool saturated  = cpu > 0.9 && runq > 1.0;
+        bool backlogged = wait > WorkerConfig.delay || (busy >= workers && queue > 0);
+        bool idle       = !backlogged && wait < WorkerConfig.delay / 4.0 && workers - busy >= 2;
+
+        grow   = backlogged && !saturated ? grow + 1 : 0;
+        shrink = idle || (saturated && runq > 2.0) ? shrink + 1 : 0;
+        debug("Workers %d (%d busy): delay %.1fms queue %d cpu %.0f%% runq %.2f/cpu",
+              workers, busy, wait, queue, cpu * 100, runq);
+
+        /* Resize with hysteresis */
+        if (cooldown > 0) {
+            cooldown--;
+            continue;
+        }
+        if (grow >= PREFORK_GROW_AFTER && target < WorkerConfig.max) {
+            int step = target / 4 > 0 ? target / 4 : 1;
+            if (busy >= workers && queue > step) {
+                step = queue < target ? queue : target;
+            }
+            int next = target + step < WorkerConfig.max ? target + step : WorkerConfig.max;
+            log("Workers %d -> %d: delay %.1fms, %d/%d busy, queue %d, cpu %.0f%%, run queue %.2f/cpu",
+                target, next, wait, busy, workers, queue, cpu * 100, runq);
+            target = next;
+        } else if (shrink >= PREFORK_SHRINK_AFTER && target > WorkerConfig.min) {
+            log("Workers %d -> %d: %s (delay %.1fms, %d/%d busy, cpu %.0f%%, run queue %.2f/cpu)",
+                target, target - 1, idle ? "idle" : "cpu saturated", wait, busy, workers, cpu * 100, runq);
+            target--;
+        } else {
+            continue;
+        }
+        grow = shrink = 0;
+        cooldown = PREFORK_COOLDOWN;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,319 @@
+/* profile.c: Hardware Counter Profiling */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define PROFILE_SIGNAL  SIGUSR2         /* Signal that requests a report */
+#define PROFILE_EVENTS  (PROFILE_VALUES - PROFILE_CYCLES)
+
+/* Profile Structures */
+
+typedef struct {
+    uint64_t requests;                              /*< Requests completed */
+    uint64_t calls[PROFILE_SECTIONS];               /*< Requests that ran section */
+    uint64_t values[PROFILE_SECTIONS][PROFILE_VALUES]; /*< Totals by section */
+} ProfileStats;
+
+typedef struct {
+    uint64_t     started;               /*< Time profiling started (ns) */
+    ProfileStats classes[REQUEST_CLASSES];
+} ProfileTable;
+
+/* Globals */
+
+static ProfileTable *Profile = NULL;    /*< Shared with forked workers */
+static int  ProfileCounters  = -1;      /*< -1 = none, 0 = user only, 1 = user and kernel */
+
+static __thread int   ProfileGroup[PROFILE_EVENTS] = {-1, -1, -1, -1};
+static __thread pid_t ProfileOwner = 0; /*< Process that opened this thread's group */
+
+static const uint64_t ProfileEventConfig[PROFILE_EVENTS] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+static const char *ProfileSectionNames[PROFILE_SECTIONS] = {
+    [PROFILE_PARSE]    = "parse",
+    [PROFILE_RESOLVE]  = "resolve",
+    [PROFILE_REALPATH] = " realpath",
+    [PROFILE_HANDLE]   = "handle",
+    [PROFILE_MIMETYPE] = " mimetype",
+};
+
+/**
+ * Open group of hardware counters for calling thread.
+ *
+ * @param   group       Array receiving one descriptor per event (leader first).
+ * @param   kernel      Whether to also count while in the kernel.
+ * @return  -1 on error and 0 on success.
+ *
+ * The counters start enabled and are never reset; sections are measured as
+ * the difference between two reads of the whole group.
+ **/
+static int profile_open(int *group, bool kernel) {
+    for (int i = 0; i < PROFILE_EVENTS; i++) {
+        struct perf_event_attr attr = {
+            .type           = PERF_TYPE_HARDWARE,
+            .size           = sizeof(attr),
+            .config         = ProfileEventConfig[i],
+            .read_format    = PERF_FORMAT_GROUP,
+            .exclude_kernel = !kernel,
+            .exclude_hv     = 1,
+        };
+
+        group[i] = syscall(SYS_perf_event_open, &attr, 0, -1, i ? group[0] : -1, PERF_FLAG_FD_CLOEXEC);
+        if (group[i] < 0) {
+            int saved = errno;
+            while (i-- > 0) {
+                close(group[i]);
+                group[i] = -1;
+            }
+            errno = saved;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Read counters of calling thread into sample.
+ *
+ * Each thread opens its own counter group the first time it reads one.
+ * Forked children inherit the descriptors of the thread that forked, but
+ * those count the parent, so a child opens a fresh group.
+ **/
+static void profile_read(ProfileSample *sample) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    sample->values[PROFILE_WALL] = time_now();
+    sample->values[PROFILE_CPU]  = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+
+    if (ProfileCounters < 0) {
+        return;
+    }
+
+    if (ProfileOwner != getpid()) {
+        for (int i = 0; i < PROFILE_EVENTS && ProfileGroup[i] >= 0; i++) {
+            close(ProfileGroup[i]);
+            ProfileGroup[i] = -1;
+        }
+        ProfileOwner = getpid();
+        profile_open(ProfileGroup, ProfileCounters);
+    }
+
+    struct {
+        uint64_t nr;
+        uint64_t values[PROFILE_EVENTS];
+    } group = {0};
+
+    if (ProfileGroup[0] < 0 || read(ProfileGroup[0], &group, sizeof(group)) != sizeof(group)) {
+        memset(group.values, 0, sizeof(group.values));
+    }
+    memcpy(&sample->values[PROFILE_CYCLES], group.values, sizeof(group.values));
+}
+
+/**
+ * Start measuring section.
+ *
+ * @param   sample      Readings to pass to profile_end.
+ **/
+void profile_begin(ProfileSample *sample) {
+    if (Profile) {
+        profile_read(sample);
+    }
+}
+
+/**
+ * Finish measuring section and charge it to request.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   section     Section being measured.
+ * @param   sample      Readings taken by profile_begin.
+ *
+ * The request's class is usually not known until it is resolved, so the
+ * measurements are kept in the request and added to its class's totals by
+ * profile_finish.
+ **/
+void profile_end(Request *r, ProfileSection section, const ProfileSample *sample) {
+    ProfileSample now;
+
+    if (!Profile) {
+        return;
+    }
+
+    profile_read(&now);
+    for (int v = 0; v < PROFILE_VALUES; v++) {
+        r->cold->profile[section][v] += now.values[v] - sample->values[v];
+    }
+    r->cold->profiled |= 1u << section;
+}
+
+/**
+ * Add request's measurements to the totals of its class.
+ *
+ * @param   r           HTTP Request structure.
+ **/
+void profile_finish(Request *r) {
+    if (!Profile || !r->cold->profiled) {
+        return;
+    }
+
+    ProfileStats *stats = &Profile->classes[r->type < REQUEST_CLASSES ? r->type : REQUEST_UNKNOWN];
+    __atomic_add_fetch(&stats->requests, 1, __ATOMIC_RELAXED);
+    for (int s = 0; s < PROFILE_SECTIONS; s++) {
+        if (!(r->cold->profiled & (1u << s))) {
+            continue;
+        }
+        __atomic_add_fetch(&stats->calls[s], 1, __ATOMIC_RELAXED);
+        for (int v = 0; v < PROFILE_VALUES; v++) {
+            __atomic_add_fetch(&stats->values[s][v], r->cold->profile[s][v], __ATOMIC_RELAXED);
+        }
+    }
+    r->cold->profiled = 0;
+}
+
+/**
+ * Print per-class totals.
+ *
+ * Every section is shown per call, with its share of the wall time of the
+ * class (parse + resolve + handle; realpath and mimetype are part of resolve
+ * and handle).  Time spent queued for an executor is not included.
+ **/
+static void profile_report(void) {
+    static const char *counters[] = {"none", "user only", "user and kernel"};
+    ProfileTable       table;
+
+    for (size_t i = 0; i < sizeof(ProfileTable) / sizeof(uint64_t); i++) {
+        ((uint64_t *)&table)[i] = __atomic_load_n(&((uint64_t *)Profile)[i], __ATOMIC_RELAXED);
+    }
+
+    log("Profile after %.1f seconds (hardware counters: %s)",
+        (time_now() - table.started) / 1e9, counters[ProfileCounters + 1]);
+    fprintf(stderr, "%-7s %-9s %8s %10s %10s %6s %11s %11s %5s %10s %10s\n",
+            "class", "section", "calls", "wall/us", "cpu/us", "wall%",
+            "cycles", "instrs", "ipc", "llc-miss", "br-miss");
+
+    for (int c = 0; c < REQUEST_CLASSES; c++) {
+        ProfileStats *stats = &table.classes[c];
+        if (!stats->requests) {
+            continue;
+        }
+
+        uint64_t wall = stats->values[PROFILE_PARSE][PROFILE_WALL] +
+                        stats->values[PROFILE_RESOLVE][PROFILE_WALL] +
+                        stats->values[PROFILE_HANDLE][PROFILE_WALL];
+
+        for (int s = 0; s < PROFILE_SECTIONS; s++) {
+            uint64_t  calls = stats->calls[s];
+            uint64_t *v     = stats->values[s];
+            if (!calls) {
+                continue;
+            }
+
+            fprintf(stderr, "%-7s %-9s %8llu %10.1f %10.1f %5.1f%%",
+                    request_class_name(c), ProfileSectionNames[s], (unsigned long long)calls,
+                    v[PROFILE_WALL] / 1e3 / calls, v[PROFILE_CPU] / 1e3 / calls,
+                    wall ? 100.0 * v[PROFILE_WALL] / wall : 0.0);
+            if (ProfileCounters >= 0) {
+                fprintf(stderr, " %11.0f %11.0f %5.2f %10.1f %10.1f",
+                        (double)v[PROFILE_CYCLES] / calls, (double)v[PROFILE_INSTRUCTIONS] / calls,
+                        v[PROFILE_CYCLES] ? (double)v[PROFILE_INSTRUCTIONS] / v[PROFILE_CYCLES] : 0.0,
+                        (double)v[PROFILE_CACHE_MISSES] / calls, (double)v[PROFILE_BRANCH_MISSES] / calls);
+            }
+            fputc('\n', stderr);
+        }
+    }
+}
+
+/**
+ * Report on PROFILE_SIGNAL, and report and exit on SIGINT or SIGTERM.
+ **/
+static void * profile_thread(void *arg) {
+    sigset_t *signals = arg;
+    int       signal;
+
+    while (true) {
+        if (sigwait(signals, &signal) != 0) {
+            continue;
+        }
+        profile_report();
+        if (signal != PROFILE_SIGNAL) {
+            exit(EXIT_SUCCESS);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Allocate profile totals, check for counters and start report thread.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * Like trace_init, this must be called before any other thread is started
+ * so that only the report thread receives the signals it waits for.
+ * Counting in the kernel (where realpath(3) spends its time) needs
+ * perf_event_paranoid <= 1; otherwise only user time is counted.  Without
+ * hardware counters (e.g. in most VMs) only wall and CPU time are reported.
+ **/
+int profile_init(void) {
+    static sigset_t signals;
+    pthread_t       thread;
+    int             group[PROFILE_EVENTS];
+
+    if (!ProfileMode) {
+        return 0;
+    }
+
+    Profile = mmap(NULL, sizeof(ProfileTable), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (Profile == MAP_FAILED) {
+        fprintf(stderr, "Unable to map profile: %s\n", strerror(errno));
+        Profile = NULL;
+        return -1;
+    }
+    Profile->started = time_now();
+
+    for (ProfileCounters = 1; ProfileCounters >= 0; ProfileCounters--) {
+        if (profile_open(group, ProfileCounters) == 0) {
+            for (int i = 0; i < PROFILE_EVENTS; i++) {
+                close(group[i]);
+            }
+            break;
+        }
+    }
+    if (ProfileCounters < 0) {
+        log("Hardware counters unavailable: %s", strerror(errno));
+    }
+
+    sigemptyset(&signals);
+    sigaddset(&signals, PROFILE_SIGNAL);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    if ((errno = pthread_sigmask(SIG_BLOCK, &signals, NULL)) != 0 ||
+        (errno = signal_thread(&thread, profile_thread, &signals)) != 0) {
+        fprintf(stderr, "Unable to start profile thread: %s\n", strerror(errno));
+        return -1;
+    }
+    pthread_detach(thread);
+
+    log("Profiling request classes (send SIGUSR2 to %d to report)", getpid());
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
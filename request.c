@@ -1,14 +1,20 @@
 /* request.c: HTTP Request Functions */
 
+#define _GNU_SOURCE
+
 #include "spidey.h"
 
+#include <ctype.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 
+#include <sys/socket.h>
 #include <unistd.h>
 
 int parse_request_method(Request *r);
 int parse_request_headers(Request *r);
+static void request_forwarded(Request *r);
 
 /**
  * Accept request from server socket.
@@ -18,61 +24,73 @@ int parse_request_headers(Request *r);
  *
  * This function does the following:
  *
- *  1. Allocates a request struct initialized to 0.
- *  2. Initializes the headers list in the request struct.
- *  3. Accepts a client connection from the server socket.
- *  4. Looks up the client information and stores it in the request struct.
- *  5. Opens the client socket stream for the request struct.
- *  6. Returns the request struct.
+ *  1. Takes a cleared request struct from the request pool.
+ *  2. Accepts a client connection from whichever listener has one.
+ *  3. Looks up the client information and stores it in the request struct.
+ *  4. Returns the request struct.
+ *
+ * Clients on a Unix domain socket are identified with SO_PEERCRED instead
+ * of getnameinfo(3) (and later by any forwarded headers their proxy adds).
  *
  * The returned request struct must be deallocated using free_request.
  **/
 Request * accept_request(int sfd) {
     Request *r;
-    struct sockaddr raddr;
-    socklen_t rlen = sizeof(struct sockaddr);
+    struct sockaddr_storage raddr;
+    socklen_t rlen = sizeof(raddr);
 
-    /* Allocate request struct (zeroed) */
-    r = calloc(sizeof(Request), 1);
-
-    if(r == NULL)
-    {
-      fprintf(stderr, "Unable to calloc... %s\n",strerror(errno));
-      goto fail;
-    }
-    r->headers = calloc(sizeof(Header), 1);
+    /* Take request struct from pool (waiting for one if all are in use) */
+    r = request_pool_get(true);
 
     /* Accept a client */
 
-    r->fd = accept(sfd, &raddr, &rlen);
+    sfd = socket_wait(sfd);
+    r->fd = accept4(sfd, (struct sockaddr *)&raddr, &rlen, SOCK_CLOEXEC);
 
     if(r->fd  < 0)
     {
-      fprintf(stderr,"Unable to accept... %s\n",strerror(errno));
+      /* Another prefork worker may have won the connection */
+      if (errno != EAGAIN) {
+        fprintf(stderr,"Unable to accept... %s\n",strerror(errno));
+      }
       goto fail;
     }
 
     /* Lookup client information */
 
-    if(getnameinfo(&raddr, rlen, r->host, sizeof(r->host), r->port, sizeof(r->port), (NI_NUMERICHOST | NI_NUMERICSERV)) != 0)
+    if (raddr.ss_family == AF_UNIX)
+    {
+      r->local = true;
+      if (socket_peer(r->fd, r->cold->host, sizeof(r->cold->host), r->cold->port, sizeof(r->cold->port)) < 0)
+      {
+        debug("Unable to get peer credentials: %s", strerror(errno));
+      }
+      socket_tune(r->fd, false);
+    }
+    else if(getnameinfo((struct sockaddr *)&raddr, rlen, r->cold->host, sizeof(r->cold->host), r->cold->port, sizeof(r->cold->port), (NI_NUMERICHOST | NI_NUMERICSERV)) != 0)
     {
       fprintf(stderr, "Unable to getnameinfo... %s\n",strerror(errno));
       goto fail;
     }
-    /* Open socket stream */
-
-    if((r->file = fdopen(r->fd, "w+")) == NULL)
+    else
     {
-      fprintf(stderr, "Unable to fdopen... %s\n", strerror(errno));
-      fclose(r->file);
-      goto fail;
+      /* Apply per-connection socket options */
+      socket_tune(r->fd, true);
     }
 
-    log("Accepted request from %s:%s", r->host, r->port);
+    /* Record load for admission control */
+    r->arrival = time_now();
+    if (ShedConfig.queue) {
+        r->backlog = socket_queue_length(sfd);
+    }
+
+    log("Accepted request from %s:%s", r->cold->host, r->cold->port);
+    TRACE(r, ACCEPT, r->cold->port);
     return r;
 
 fail:
-    /* Deallocate request struct */
+    /* Deallocate request struct (there is nothing to trace) */
+    r->phases |= 1u << TRACE_DONE;
     free_request(r);
     return NULL;
 }
@@ -84,21 +102,19 @@ fail:
  *
  * This function does the following:
  *
- *  1. Closes the request socket stream or file descriptor.
+ *  1. Closes the request socket file descriptor.
  *  2. Frees all allocated strings in request struct.
- *  3. Frees all of the headers (including any allocated fields).
- *  4. Frees request struct.
+ *  3. Frees the response buffer and returns the request struct to the pool.
+ *
+ * Headers point into the receive buffer, so they need no separate cleanup.
  **/
 void free_request(Request *r) {
     if (!r) {
     	return;
     }
-    /* Close socket or fd */
+    /* End TLS session, then close socket or fd */
+    tls_close(r);
 
-        if(r->file)
-        {
-            fclose(r->file);
-        }
         if(r->fd != -1)
         {
             close(r->fd);
@@ -115,20 +131,15 @@ void free_request(Request *r) {
     free(r->query);
     free(r->uri);
 
-    /* Free headers */
-    Header *header = r->headers;
-    Header *n;
-    while (header != NULL){
-        free(header->name);
-        free(header->value);
-        n = header;
-        header = header->next;
-        free(n);
-    }
-
-
     /* Free request */
-    free(r);
+    TRACE(r, DONE, r->type);
+    profile_finish(r);
+    shed_leave(r);
+    if (r->cached) {
+        file_cache_release(r->cached);
+    }
+    response_free(r);
+    request_pool_put(r);
 }
 
 /**
@@ -145,9 +156,38 @@ int parse_request(Request *r) {
     /* Parse HTTP Requet Headers*/
     if (parse_request_method(r) != 0 || parse_request_headers(r) != 0)
         return -1;
+
+    /* Trust forwarded client identity only from co-located proxies */
+    if (r->local)
+        request_forwarded(r);
     return 0;
 }
 
+/**
+ * Take client identity from headers added by a reverse proxy.
+ *
+ * @param   r           Request structure.
+ *
+ * The first (original client) address of X-Forwarded-For replaces the
+ * peer's, along with X-Forwarded-Port if present.
+ **/
+static void request_forwarded(Request *r) {
+    const char *address = r->headers[HEADER_X_FORWARDED_FOR];
+    const char *port    = r->headers[HEADER_X_FORWARDED_PORT];
+
+    if (address) {
+        size_t length = strcspn(address, ", \t");
+        if (length > 0 && length < sizeof(r->cold->host)) {
+            memcpy(r->cold->host, address, length);
+            r->cold->host[length] = 0;
+        }
+    }
+    if (port) {
+        snprintf(r->cold->port, sizeof(r->cold->port), "%.*s", (int)strcspn(port, ", \t"), port);
+    }
+    debug("HTTP CLIENT: %s:%s", r->cold->host, r->cold->port);
+}
+
 /**
  * Parse HTTP Request Method and URI.
  *
@@ -166,26 +206,45 @@ int parse_request(Request *r) {
  * This function extracts the method, uri, and query (if it exists).
  **/
 int parse_request_method(Request *r) {
-    char buffer[BUFSIZ];
+    char *buffer;
     char *method;
     char *uri;
     char *query;
+    char *end;
+    size_t length;
 
     /* Read line from socket */
 
-    if(!(fgets(buffer, BUFSIZ, r->file)) || strlen(buffer)<=2)
+    if(!(buffer = read_request_line(r, &length)) || length == 0)
     {
         goto fail;
     }
+    end = buffer + length;
 
     /* Parse method and uri */
 
-    method = strtok(buffer, WHITESPACE);
-    uri = strtok(NULL, WHITESPACE);
+    method = scan_nonspace(buffer, length);
+    char *method_end = method ? scan_space(method, end - method) : NULL;
+    uri = method_end ? scan_nonspace(method_end, end - method_end) : NULL;
+    if (!method || !uri)
+    {
+        goto fail;
+    }
+    *method_end = 0;
+
+    char *uri_end = scan_space(uri, end - uri);
+    if (uri_end)
+    {
+        *uri_end = 0;
+    }
+    else
+    {
+        uri_end = end;
+    }
 
     /* Parse query from uri */
 
-    if (uri && (query = strchr(uri, '?')))
+    if ((query = scan_char(uri, uri_end - uri, '?')))
     {
         *query = 0;
         ++query;
@@ -198,15 +257,14 @@ int parse_request_method(Request *r) {
     /* Record method, uri, and query in request struct */
 
     r->method = strdup(method);
-    if (uri){
-        r->uri = strdup(uri);
-    }
+    r->uri = strdup(uri);
     r->query = strdup(query);
 
     debug("HTTP METHOD: %s", r->method);
     debug("HTTP URI:    %s", r->uri);
     debug("HTTP QUERY:  %s", r->query);
 
+    TRACE(r, REQUEST_LINE, r->uri);
     return 0;
 
 fail:
@@ -237,45 +295,284 @@ fail:
  *
  *  while (buffer = read_from_socket() and buffer is not empty):
  *      name, value = buffer.split(':')
- *      header      = new Header(name, value)
- *      headers.append(header)
+ *      if name is known:
+ *          headers[id(name)] = value
+ *      else:
+ *          extra.append(Header(name, value))
+ *
+ * Names and values are terminated in place and are not copied.
  **/
 int parse_request_headers(Request *r) {
-    Header *curr = r->headers;
-    char buffer[BUFSIZ];
+    char *buffer;
     char *name;
     char *value;
+    size_t length;
 
     /* Parse headers from socket */
 
-    while (fgets(buffer, BUFSIZ, r->file) && strlen(buffer) > 2){
-        Header *next_h = calloc(sizeof(Header), 1);
-        chomp(buffer);
+    while ((buffer = read_request_line(r, &length)) && length > 0){
+        char *before = scan_char(buffer, length, ':');
+        if (!before){
+            goto fail;
+        }
         name = buffer;
-        char *before = strchr(buffer, ':');
         char *after = before + 1;
-        skip_whitespace(after);
-        value = after;
+        value = scan_nonspace(after, buffer + length - after);
+        if (!value){
+            value = buffer + length;
+        }
         *before = '\0';
-        next_h->name = strdup(name);
-        next_h->value = strdup(value);
-        if (!next_h->name || !next_h->value){
+        if (request_add_header(r, name, value) < 0){
             goto fail;
         }
-        curr->next = next_h;
-        curr = curr->next;
+    }
+
+    if (!buffer){
+        goto fail;
     }
 
 #ifndef NDEBUG
-    for (struct header *header = r->headers; header != NULL; header = header->next)
+    for (HeaderID id = 0; id < HEADER_COUNT; id++)
     {
-    	debug("HTTP HEADER %s = %s", header->name, header->value);
+        if (r->headers[id])
+        {
+            debug("HTTP HEADER %s = %s", header_name(id), r->headers[id]);
+        }
+    }
+    for (size_t i = 0; i < r->nextra; i++)
+    {
+    	debug("HTTP HEADER %s = %s", r->extra[i].name, r->extra[i].value);
     }
 #endif
+    TRACE(r, HEADERS, r->nextra);
     return 0;
 
 fail:
     return -1;
 }
 
+/**
+ * Prepare to decode request body.
+ *
+ * @param   r           Request structure.
+ * @param   b           RequestBody state to initialize.
+ * @return  -1 if the framing headers are invalid, 0 if the request has no
+ *          body, and 1 if it has one.
+ *
+ * Transfer-Encoding: chunked takes precedence over Content-Length, which must
+ * be a plain decimal number that fits in 64 bits.
+ **/
+int request_body_init(Request *r, RequestBody *b) {
+    const char *encoding = r->headers[HEADER_TRANSFER_ENCODING];
+    const char *length   = r->headers[HEADER_CONTENT_LENGTH];
+    char       *end;
+
+    *b = (RequestBody){0};
+    if (encoding) {
+        if (!strstr(encoding, "chunked")) {
+            return -1;
+        }
+        b->chunked = true;
+        b->state   = BODY_CHUNK_SIZE;
+        return 1;
+    }
+    if (length) {
+        /* strtoull accepts a sign (and negates), so require digits only */
+        if (!isdigit((unsigned char)*length)) {
+            return -1;
+        }
+        errno = 0;
+        b->remaining = strtoull(length, &end, 10);
+        if (errno == ERANGE || *end) {
+            return -1;
+        }
+        b->state = b->remaining ? BODY_DATA : BODY_DONE;
+        return b->remaining ? 1 : 0;
+    }
+    return 0;
+}
+
+/**
+ * Decode received request body data in place.
+ *
+ * @param   b           RequestBody state.
+ * @param   data        Received data (replaced by decoded payload).
+ * @param   length      Length of received data.
+ * @return  Length of decoded payload or -1 on malformed chunked framing.
+ *
+ * Chunk sizes, extensions, and trailers are removed; Content-Length bodies
+ * pass through unchanged.  Data past the end of the body is discarded.
+ **/
+ssize_t request_body_decode(RequestBody *b, char *data, size_t length) {
+    size_t in = 0, out = 0;
+
+    while (in < length && b->state != BODY_DONE) {
+        char c = data[in];
+
+        switch (b->state) {
+            case BODY_DATA: {
+                size_t n = length - in < b->remaining ? length - in : b->remaining;
+                memmove(data + out, data + in, n);
+                in += n;
+                out += n;
+                b->remaining -= n;
+                if (!b->remaining) {
+                    b->state = b->chunked ? BODY_CHUNK_END : BODY_DONE;
+                }
+                break;
+            }
+            case BODY_CHUNK_SIZE:
+                in++;
+                if (isxdigit((unsigned char)c) && !b->extension) {
+                    if (b->remaining >> 60) {
+                        return -1;
+                    }
+                    b->remaining = b->remaining * 16 + (isdigit((unsigned char)c) ? c - '0' : (tolower(c) - 'a' + 10));
+                    b->digits++;
+                } else if (c == '\n') {
+                    if (!b->digits) {
+                        return -1;
+                    }
+                    b->state     = b->remaining ? BODY_DATA : BODY_TRAILER;
+                    b->digits    = 0;
+                    b->extension = false;
+                } else if (c == ';' || c == ' ' || c == '\t') {
+                    b->extension = true;
+                } else if (c != '\r' && !b->extension) {
+                    return -1;
+                }
+                break;
+            case BODY_CHUNK_END:
+                in++;
+                if (c == '\n') {
+                    b->state = BODY_CHUNK_SIZE;
+                } else if (c != '\r') {
+                    return -1;
+                }
+                break;
+            case BODY_TRAILER:
+                /* Trailer fields end with an empty line */
+                in++;
+                if (c == '\n') {
+                    if (b->digits == 0) {
+                        b->state = BODY_DONE;
+                    }
+                    b->digits = 0;
+                } else if (c != '\r') {
+                    b->digits++;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    return out;
+}
+
+/**
+ * Receive data from client.
+ *
+ * @param   r           Request structure.
+ * @param   buffer      Buffer to receive into.
+ * @param   size        Size of buffer.
+ * @return  Number of bytes received, 0 on end of stream, or -1 on error.
+ *
+ * Data on TLS connections whose reads were not handed to the kernel is
+ * decrypted by OpenSSL; everything else is a plain recv(2).
+ **/
+ssize_t request_recv(Request *r, void *buffer, size_t size) {
+    if (r->tls) {
+        return tls_recv(r, buffer, size);
+    }
+    return recv(r->fd, buffer, size, 0);
+}
+
+/**
+ * Receive first data of request and note when it arrived.
+ *
+ * @param   r           Request structure.
+ * @param   buffer      Buffer to receive into.
+ * @param   size        Size of buffer.
+ * @return  Number of bytes received or -1 on error.
+ *
+ * The kernel's SO_TIMESTAMPNS timestamp of the first segment replaces the
+ * accept time as arrival time, so time spent in the listen queue counts as
+ * queueing delay.  Handling starts once this data is read.
+ **/
+static ssize_t read_request_first(Request *r, char *buffer, size_t size) {
+    char          control[CMSG_SPACE(sizeof(struct timespec))];
+    struct iovec  iov = {buffer, size};
+    struct msghdr msg = {
+        .msg_iov        = &iov,
+        .msg_iovlen     = 1,
+        .msg_control    = control,
+        .msg_controllen = sizeof(control),
+    };
+
+    ssize_t nread = recvmsg(r->fd, &msg, 0);
+    if (nread <= 0) {
+        return nread;
+    }
+
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+            r->arrival = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+        }
+    }
+    r->start = time_now();
+    return nread;
+}
+
+/**
+ * Read line from request receive buffer.
+ *
+ * @param   r           Request structure.
+ * @param   length      Pointer to store length of line (without CRLF).
+ * @return  Pointer to NUL-terminated line (without CRLF) or NULL on error.
+ *
+ * Lines are terminated in place within the request receive buffer, so the
+ * returned string remains valid for the lifetime of the request.  Data is
+ * read from the socket with recv(2) only when the buffer does not already
+ * contain a complete line.
+ **/
+char * read_request_line(Request *r, size_t *length) {
+    char *line = r->buffer + r->offset;
+    char *eol;
+    size_t scanned = 0;
+
+    /* Only scan newly received bytes for the end of line */
+    while (!(eol = scan_char(line + scanned, r->nbuffer - r->offset - scanned, '\n'))) {
+        scanned = r->nbuffer - r->offset;
+
+        /* Line does not fit in receive buffer */
+        if (r->nbuffer >= REQUEST_BUFSIZ - 1) {
+            return NULL;
+        }
+
+        ssize_t nread;
+        if (SocketConfig.timestamps && !r->start && !r->tls) {
+            nread = read_request_first(r, r->buffer + r->nbuffer, REQUEST_BUFSIZ - 1 - r->nbuffer);
+        } else {
+            nread = request_recv(r, r->buffer + r->nbuffer, REQUEST_BUFSIZ - 1 - r->nbuffer);
+        }
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nread <= 0) {
+            return NULL;
+        }
+        r->nbuffer += nread;
+    }
+
+    r->offset = eol - r->buffer + 1;
+    if (eol > line && eol[-1] == '\r') {
+        eol--;
+    }
+    *eol = '\0';
+    *length = eol - line;
+    return line;
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
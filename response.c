@@ -0,0 +1,294 @@
+/* response.c: HTTP Response Assembly */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* Globals */
+
+WriteOptions WriteConfig = {
+    .high    = 64 * 1024,
+    .notsent = 128 * 1024,
+    .cap     = 64 * 1024 * 1024,
+    .timeout = 30,
+};
+
+static size_t  ResponseLocal  = 0;
+static size_t *ResponseMemory = &ResponseLocal; /*< Bytes allocated for response buffers */
+static size_t *ResponseOwn    = NULL;   /*< This process's share of ResponseMemory */
+
+/**
+ * Parse response buffering option of the form name=value.
+ *
+ * @param   option      Option string.
+ * @return  true if option was recognized, false otherwise.
+ *
+ * Recognized options:
+ *
+ *  high=N          Per-connection buffer flushed at N bytes (default 64K)
+ *  notsent=N       Unsent bytes kept in socket (default 128K, 0 = kernel default)
+ *  cap=N           Buffered bytes of all connections (default 64M)
+ *  timeout=S       Drop client that accepts no data for S seconds (default 30)
+ **/
+bool parse_write_option(const char *option) {
+    const char *value  = strchr(option, '=');
+    size_t      length = value ? (size_t)(value - option) : strlen(option);
+    size_t      number;
+
+    if (!value || !parse_size(value + 1, &number)) {
+        return false;
+    }
+
+    if (streqn(option, length, "high") && number >= RESPONSE_BUFSIZ) {
+        WriteConfig.high = number;
+    } else if (streqn(option, length, "notsent")) {
+        WriteConfig.notsent = number;
+    } else if (streqn(option, length, "cap") && number > 0) {
+        WriteConfig.cap = number;
+    } else if (streqn(option, length, "timeout") && number > 0) {
+        WriteConfig.timeout = number;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Share response buffer accounting with forked workers.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * The counter is mapped MAP_SHARED before any worker is forked, so
+ * WriteConfig.cap bounds the buffers of all connections of all processes.
+ **/
+int response_init(void) {
+    size_t *memory = mmap(NULL, sizeof(size_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        fprintf(stderr, "Unable to map response accounting: %s\n", strerror(errno));
+        return -1;
+    }
+    *memory        = *ResponseMemory;
+    ResponseMemory = memory;
+    return 0;
+}
+
+/**
+ * Also count this process's response buffers in a separate counter.
+ *
+ * @param   bytes       Counter in memory shared with the parent (a prefork
+ *                      worker's scoreboard slot).
+ **/
+void response_account(size_t *bytes) {
+    ResponseOwn = bytes;
+}
+
+/**
+ * Return response buffers of a process that died to the shared total.
+ *
+ * @param   bytes       Counter the process registered with response_account
+ *                      (reset to zero).
+ **/
+void response_release(size_t *bytes) {
+    __atomic_sub_fetch(ResponseMemory, __atomic_exchange_n(bytes, 0, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+}
+
+/**
+ * Resize response text buffer, keeping global accounting.
+ **/
+static int response_resize(Response *s, size_t capacity) {
+    char *buffer = capacity ? realloc(s->buffer, capacity) : (free(s->buffer), NULL);
+    if (capacity && !buffer) {
+        return -1;
+    }
+
+    if (capacity > s->capacity) {
+        __atomic_add_fetch(ResponseMemory, capacity - s->capacity, __ATOMIC_RELAXED);
+        if (ResponseOwn) {
+            __atomic_add_fetch(ResponseOwn, capacity - s->capacity, __ATOMIC_RELAXED);
+        }
+    } else {
+        if (ResponseOwn) {
+            __atomic_sub_fetch(ResponseOwn, s->capacity - capacity, __ATOMIC_RELAXED);
+        }
+        __atomic_sub_fetch(ResponseMemory, s->capacity - capacity, __ATOMIC_RELAXED);
+    }
+    s->buffer   = buffer;
+    s->capacity = capacity;
+    return 0;
+}
+
+/**
+ * Append formatted text to response.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   format      printf-style format string.
+ * @return  -1 on error and 0 on success.
+ *
+ * The text is copied into the response buffer.  Consecutive formatted writes
+ * are merged into a single segment so that a status line and its headers go
+ * out as one iovec.
+ *
+ * The buffer is bounded: pending output is flushed once it reaches the high
+ * watermark, and also before the buffer would grow while all connections
+ * together already hold WriteConfig.cap bytes.  Since flushing blocks until
+ * the client accepts the data, a slow reader stalls only its own handler.
+ **/
+int response_printf(Request *r, const char *format, ...) {
+    Response *s = &r->response;
+    va_list   args;
+    int       length;
+
+    /* Determine formatted length */
+    va_start(args, format);
+    length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if (length < 0) {
+        return -1;
+    }
+
+    /* Send pending output instead of growing past either limit */
+    bool grow = s->length + length + 1 > s->capacity;
+    if (s->nsegments == RESPONSE_SEGMENTS ||
+        (grow && s->length && (s->length + length >= WriteConfig.high ||
+                               __atomic_load_n(ResponseMemory, __ATOMIC_RELAXED) >= WriteConfig.cap))) {
+        if (response_flush(r) < 0) {
+            return -1;
+        }
+    }
+
+    /* Grow buffer to fit formatted text */
+    if (s->length + length + 1 > s->capacity) {
+        size_t capacity = s->capacity ? s->capacity : RESPONSE_BUFSIZ;
+        while (capacity < s->length + length + 1) {
+            capacity *= 2;
+        }
+        if (response_resize(s, capacity) < 0) {
+            return -1;
+        }
+    }
+
+    va_start(args, format);
+    vsnprintf(s->buffer + s->length, length + 1, format, args);
+    va_end(args);
+
+    /* Extend last segment if it is the tail of the buffer, otherwise add one */
+    Segment *last = s->nsegments ? &s->segments[s->nsegments - 1] : NULL;
+    if (last && !last->data && last->offset + last->length == s->length) {
+        last->length += length;
+    } else {
+        s->segments[s->nsegments++] = (Segment){NULL, s->length, length};
+    }
+
+    s->length += length;
+    return s->length >= WriteConfig.high ? response_flush(r) : 0;
+}
+
+/**
+ * Append reference to external data to response.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   data        Data to send.
+ * @param   length      Length of data.
+ * @return  -1 on error and 0 on success.
+ *
+ * The data is not copied, so it must remain valid until the next
+ * response_flush.
+ **/
+int response_write(Request *r, const void *data, size_t length) {
+    Response *s = &r->response;
+
+    if (length == 0) {
+        return 0;
+    }
+
+    if (s->nsegments == RESPONSE_SEGMENTS && response_flush(r) < 0) {
+        return -1;
+    }
+
+    s->segments[s->nsegments++] = (Segment){data, 0, length};
+    return 0;
+}
+
+/**
+ * Send all pending response segments.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  -1 on error and 0 on success.
+ *
+ * All segments are gathered into a single writev(2); additional calls are
+ * only made if the socket accepts a partial write.  A client that accepts
+ * nothing for WriteConfig.timeout seconds (SO_SNDTIMEO) is given up on.
+ *
+ * A text buffer that grew beyond the high watermark is released afterwards,
+ * so idle connections hold no more than RESPONSE_BUFSIZ bytes each.
+ **/
+int response_flush(Request *r) {
+    Response    *s = &r->response;
+    struct iovec iov[RESPONSE_SEGMENTS];
+    int          iovcnt = 0;
+
+    for (size_t i = 0; i < s->nsegments; i++) {
+        Segment *segment = &s->segments[i];
+        iov[iovcnt].iov_base = (void *)(segment->data ? segment->data : s->buffer + segment->offset);
+        iov[iovcnt].iov_len  = segment->length;
+        iovcnt++;
+    }
+
+    s->nsegments = 0;
+    s->length    = 0;
+
+    if (iovcnt > 0) {
+        TRACE(r, FIRST_BYTE, iov[0].iov_len);
+    }
+
+    struct iovec *v = iov;
+    int           status = 0;
+    while (iovcnt > 0) {
+        ssize_t nwritten = writev(r->fd, v, iovcnt);
+        if (nwritten < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                log("Client %s:%s stopped reading for %d seconds", r->cold->host, r->cold->port, WriteConfig.timeout);
+            } else {
+                debug("Unable to writev: %s", strerror(errno));
+            }
+            status = -1;
+            break;
+        }
+
+        /* Skip fully written iovecs and adjust partially written one */
+        while (iovcnt > 0 && (size_t)nwritten >= v->iov_len) {
+            nwritten -= v->iov_len;
+            v++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            v->iov_base  = (char *)v->iov_base + nwritten;
+            v->iov_len  -= nwritten;
+        }
+    }
+
+    if (s->capacity > WriteConfig.high) {
+        response_resize(s, 0);
+    }
+    return status;
+}
+
+/**
+ * Release response buffer.
+ *
+ * @param   r           HTTP Request structure.
+ **/
+void response_free(Request *r) {
+    response_resize(&r->response, 0);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,222 @@
+/* shed.c: Adaptive Load Shedding */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+/* Shared State */
+
+typedef struct {
+    int      inflight[REQUEST_CLASSES]; /*< Requests being handled, by class */
+    uint64_t below;                     /*< Last time queueing delay was below target */
+    uint64_t shed;                      /*< Number of requests shed */
+} ShedState;
+
+/* Globals */
+
+ShedOptions ShedConfig = {
+    .interval = 100,
+    .retry    = 1,
+};
+
+static ShedState *Shed    = NULL;       /*< Shared with forked workers */
+static int       *ShedOwn = NULL;       /*< This process's share of Shed->inflight */
+
+/**
+ * Parse load shedding option of the form name=value.
+ *
+ * @param   option      Option string.
+ * @return  true if option was recognized, false otherwise.
+ *
+ * Recognized options:
+ *
+ *  target=MS       Target queueing delay (enables delay based shedding)
+ *  interval=MS     Window the delay must stay above target (default 100)
+ *  retry=S         Retry-After value sent with 503 (default 1)
+ *  queue=N         Shed while more than N connections wait to be accepted
+ *  <class>=N       Maximum requests of class in flight (e.g. cgi=16)
+ **/
+bool parse_shed_option(const char *option) {
+    const char *value  = strchr(option, '=');
+    size_t      length = value ? (size_t)(value - option) : strlen(option);
+    int         number = value ? atoi(value + 1) : -1;
+
+    if (number < 0) {
+        return false;
+    }
+
+    if (streqn(option, length, "target")) {
+        ShedConfig.target = number;
+    } else if (streqn(option, length, "interval") && number > 0) {
+        ShedConfig.interval = number;
+    } else if (streqn(option, length, "retry")) {
+        ShedConfig.retry = number;
+    } else if (streqn(option, length, "queue")) {
+        ShedConfig.queue = number;
+    } else {
+        for (RequestClass class = 0; class < REQUEST_CLASSES; class++) {
+            if (streqn(option, length, request_class_name(class))) {
+                ShedConfig.inflight[class] = number;
+                return true;
+            }
+        }
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Allocate shedding state shared by all workers.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * Nothing is allocated (and nothing is shed) unless an option enables
+ * shedding.  The state is mapped MAP_SHARED before any worker is forked,
+ * so forking children and executor threads all count against the same
+ * limits.
+ **/
+int shed_init(void) {
+    bool enabled = ShedConfig.target || ShedConfig.queue;
+    for (RequestClass class = 0; class < REQUEST_CLASSES; class++) {
+        enabled |= ShedConfig.inflight[class] > 0;
+    }
+    if (!enabled) {
+        return 0;
+    }
+
+    Shed = mmap(NULL, sizeof(ShedState), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (Shed == MAP_FAILED) {
+        fprintf(stderr, "Unable to map shedding state: %s\n", strerror(errno));
+        Shed = NULL;
+        return -1;
+    }
+    Shed->below = time_now();
+
+    log("Load shedding: target=%dms interval=%dms retry=%ds queue=%d cgi=%d cold=%d",
+        ShedConfig.target, ShedConfig.interval, ShedConfig.retry, ShedConfig.queue,
+        ShedConfig.inflight[REQUEST_CGI], ShedConfig.inflight[REQUEST_COLD]);
+    return 0;
+}
+
+/**
+ * Also count this process's in-flight requests in separate counters.
+ *
+ * @param   counts      REQUEST_CLASSES counters in memory shared with the
+ *                      parent (a prefork worker's scoreboard slot).
+ *
+ * If the process dies with requests in flight, the parent passes the same
+ * counters to shed_release so the class limits do not shrink for good.
+ **/
+void shed_account(int *counts) {
+    ShedOwn = counts;
+}
+
+/**
+ * Return in-flight requests of a process that died to their classes.
+ *
+ * @param   counts      Counters the process registered with shed_account
+ *                      (reset to zero).
+ **/
+void shed_release(int *counts) {
+    for (RequestClass class = 0; class < REQUEST_CLASSES; class++) {
+        int count = __atomic_exchange_n(&counts[class], 0, __ATOMIC_RELAXED);
+        if (Shed && count) {
+            __atomic_sub_fetch(&Shed->inflight[class], count, __ATOMIC_RELAXED);
+            log("Released %d %s request(s) of dead worker", count, request_class_name(class));
+        }
+    }
+}
+
+/**
+ * Decide whether to admit request based on queueing delay.
+ *
+ * @param   r           HTTP Request structure (with arrival and start times).
+ * @return  true if the request should be handled, false to shed it.
+ *
+ * This follows CoDel: a standing queue exists once the delay between
+ * arrival and start has stayed above target for a whole interval.  Normally
+ * only requests that waited longer than an interval are shed; while a
+ * standing queue exists, any request that waited longer than target is
+ * shed, which drains the backlog quickly and keeps latency of the admitted
+ * requests (and therefore goodput) near what an unloaded server delivers.
+ *
+ * The listen queue length sampled at accept is also compared to its limit.
+ **/
+bool shed_admit(Request *r) {
+    if (!Shed) {
+        return true;
+    }
+
+    if (ShedConfig.queue && r->backlog > ShedConfig.queue) {
+        debug("SHED: listen queue %d > %d", r->backlog, ShedConfig.queue);
+        goto shed;
+    }
+
+    if (ShedConfig.target && r->arrival && r->start) {
+        uint64_t delay    = r->start > r->arrival ? r->start - r->arrival : 0;
+        uint64_t target   = ShedConfig.target * 1000000ull;
+        uint64_t interval = ShedConfig.interval * 1000000ull;
+        uint64_t below    = __atomic_load_n(&Shed->below, __ATOMIC_RELAXED);
+
+        if (delay <= target) {
+            __atomic_store_n(&Shed->below, r->start, __ATOMIC_RELAXED);
+            return true;
+        }
+
+        bool standing = r->start > below && r->start - below > interval;
+        if (delay > (standing ? target : interval)) {
+            debug("SHED: queueing delay %.1f ms (%s)", delay / 1e6, standing ? "standing queue" : "above interval");
+            goto shed;
+        }
+    }
+    return true;
+
+shed:
+    __atomic_add_fetch(&Shed->shed, 1, __ATOMIC_RELAXED);
+    return false;
+}
+
+/**
+ * Count request as in flight for its class.
+ *
+ * @param   r           Classified HTTP Request structure.
+ * @return  true if admitted (release with shed_leave), false if the class
+ *          is at its limit.
+ **/
+bool shed_enter(Request *r) {
+    if (!Shed) {
+        return true;
+    }
+
+    int count = __atomic_add_fetch(&Shed->inflight[r->type], 1, __ATOMIC_RELAXED);
+    int limit = ShedConfig.inflight[r->type];
+    if (limit && count > limit) {
+        __atomic_sub_fetch(&Shed->inflight[r->type], 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&Shed->shed, 1, __ATOMIC_RELAXED);
+        debug("SHED: %s in flight %d > %d", request_class_name(r->type), count, limit);
+        return false;
+    }
+    if (ShedOwn) {
+        __atomic_add_fetch(&ShedOwn[r->type], 1, __ATOMIC_RELAXED);
+    }
+    r->admitted = true;
+    return true;
+}
+
+/**
+ * Remove request from in-flight count of its class.
+ **/
+void shed_leave(Request *r) {
+    if (Shed && r->admitted) {
+        if (ShedOwn) {
+            __atomic_sub_fetch(&ShedOwn[r->type], 1, __ATOMIC_RELAXED);
+        }
+        __atomic_sub_fetch(&Shed->inflight[r->type], 1, __ATOMIC_RELAXED);
+        r->admitted = false;
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,177 @@
+/* shmcache.c: Cross-Process Lookup Cache */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+/* Constants */
+
+#define SHM_CACHE_SETS      1024        /* Number of sets (power of two) */
+#define SHM_CACHE_WAYS      4           /* Slots per set */
+#define SHM_CACHE_KEYSIZ    256         /* Largest key stored */
+#define SHM_CACHE_VALSIZ    512         /* Largest value stored */
+
+/**
+ * Lifetime of entries (ns) by kind.
+ */
+static const uint64_t ShmCacheTTL[SHM_CACHE_KINDS] = {
+    [SHM_CACHE_MIMETYPE] = 60 * 1000000000ull,  /* mime.types rarely changes */
+    [SHM_CACHE_PATH]     =  1 * 1000000000ull,  /* Symlinks may be replaced */
+    [SHM_CACHE_WARM]     = 10 * 1000000000ull,  /* Page cache may be reclaimed */
+};
+
+/* Shared Structures */
+
+typedef struct {
+    uint32_t seq;                       /*< Sequence count (odd while being written) */
+    uint32_t kind;                      /*< ShmCacheKind of entry */
+    uint64_t hash;                      /*< Hash of kind and key */
+    uint64_t expires;                   /*< Expiration time (ns, 0 = empty) */
+    uint16_t klen;                      /*< Length of key */
+    uint16_t vlen;                      /*< Length of value */
+    char     key[SHM_CACHE_KEYSIZ];     /*< Key (not NUL-terminated) */
+    char     value[SHM_CACHE_VALSIZ];   /*< Value (not NUL-terminated) */
+} ShmCacheSlot;
+
+/* Globals */
+
+static ShmCacheSlot *ShmCache = NULL;   /*< Shared with forked workers */
+
+/**
+ * Allocate cache shared by all worker processes.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * The region is mapped MAP_SHARED before any worker is forked, so a lookup
+ * done by one child is visible to every other child (and to the next
+ * children forked).  Until this is called, lookups always miss.
+ **/
+int shm_cache_init(void) {
+    ShmCache = mmap(NULL, SHM_CACHE_SETS * SHM_CACHE_WAYS * sizeof(ShmCacheSlot),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (ShmCache == MAP_FAILED) {
+        fprintf(stderr, "Unable to map shared cache: %s\n", strerror(errno));
+        ShmCache = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Compute FNV-1a hash of kind and key.
+ **/
+static uint64_t shm_cache_hash(ShmCacheKind kind, const char *key, size_t length) {
+    uint64_t h = (14695981039346656037ull ^ kind) * 1099511628211ull;
+    for (size_t i = 0; i < length; i++) {
+        h ^= (unsigned char)key[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+/**
+ * Lookup value in shared cache.
+ *
+ * @param   kind        Kind of entry.
+ * @param   key         Key (NUL-terminated).
+ * @param   value       Buffer to store value (NUL-terminated).
+ * @param   size        Size of value buffer.
+ * @return  true if a fresh entry was found, false otherwise.
+ *
+ * Readers never write to the region or take a lock: each slot is copied
+ * and then accepted only if its sequence count was even and unchanged
+ * across the copy (a seqlock), so a concurrent update makes the lookup
+ * miss instead of returning a torn entry.
+ **/
+bool shm_cache_lookup(ShmCacheKind kind, const char *key, char *value, size_t size) {
+    size_t length = strlen(key);
+
+    if (!ShmCache || length > SHM_CACHE_KEYSIZ) {
+        return false;
+    }
+
+    uint64_t      hash = shm_cache_hash(kind, key, length);
+    ShmCacheSlot *set  = ShmCache + (hash & (SHM_CACHE_SETS - 1)) * SHM_CACHE_WAYS;
+    ShmCacheSlot  copy;
+
+    for (int way = 0; way < SHM_CACHE_WAYS; way++) {
+        ShmCacheSlot *slot = &set[way];
+        uint32_t      seq  = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+        if ((seq & 1) || slot->hash != hash || slot->kind != kind) {
+            continue;
+        }
+        memcpy(&copy, slot, sizeof(copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) {
+            continue;
+        }
+
+        if (copy.klen != length || memcmp(copy.key, key, length) != 0 ||
+            copy.vlen >= size || copy.expires <= time_now()) {
+            continue;
+        }
+        memcpy(value, copy.value, copy.vlen);
+        value[copy.vlen] = 0;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Store value in shared cache.
+ *
+ * @param   kind        Kind of entry.
+ * @param   key         Key (NUL-terminated).
+ * @param   value       Value (NUL-terminated).
+ *
+ * The slot holding the same key is replaced, else an expired one, else the
+ * one closest to expiring.  A writer claims the slot by moving its
+ * sequence count from even to odd with compare-and-swap; if another
+ * process is writing that slot, the store is simply skipped.
+ **/
+void shm_cache_store(ShmCacheKind kind, const char *key, const char *value) {
+    size_t klen = strlen(key);
+    size_t vlen = strlen(value);
+
+    if (!ShmCache || klen > SHM_CACHE_KEYSIZ || vlen > SHM_CACHE_VALSIZ) {
+        return;
+    }
+
+    uint64_t      hash   = shm_cache_hash(kind, key, klen);
+    uint64_t      now    = time_now();
+    ShmCacheSlot *set    = ShmCache + (hash & (SHM_CACHE_SETS - 1)) * SHM_CACHE_WAYS;
+    ShmCacheSlot *victim = &set[0];
+
+    for (int way = 0; way < SHM_CACHE_WAYS; way++) {
+        ShmCacheSlot *slot = &set[way];
+        if (slot->hash == hash && slot->kind == kind) {
+            victim = slot;
+            break;
+        }
+        if (slot->expires < victim->expires) {
+            victim = slot;
+        }
+    }
+
+    uint32_t seq = __atomic_load_n(&victim->seq, __ATOMIC_RELAXED);
+    if ((seq & 1) || !__atomic_compare_exchange_n(&victim->seq, &seq, seq + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    victim->kind    = kind;
+    victim->hash    = hash;
+    victim->expires = now + ShmCacheTTL[kind];
+    victim->klen    = klen;
+    victim->vlen    = vlen;
+    memcpy(victim->key, key, klen);
+    memcpy(victim->value, value, vlen);
+
+    __atomic_store_n(&victim->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -26,8 +26,10 @@ int single_server(int sfd) {
         }
 
 
-	/* Handle request */
-        handle_request(request);
+	/* Handle request (unless an executor took it) */
+        if (handle_request(request) == HTTP_STATUS_DEFERRED) {
+            continue;
+        }
 
 	/* Free request */
         free_request(request);
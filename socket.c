@@ -1,5 +1,7 @@
 /* socket.c: Simple Socket Functions */
 
+#define _GNU_SOURCE
+
 #include "spidey.h"
 
 #include <errno.h>
@@ -7,16 +9,210 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+/* Constants */
+
+#define SOCKET_LISTENERS    4           /* Maximum listening sockets */
+
+/* Globals */
+
+static struct pollfd Listeners[SOCKET_LISTENERS];   /*< All listening sockets */
+static nfds_t        NListeners = 0;                /*< Number of listening sockets */
+static nfds_t        NextListener = 0;              /*< First listener checked next */
+static int           ListenerPoll = -1;             /*< This worker's epoll set of listeners */
+static int           ReadyListener = -1;            /*< Listener socket_ready found pending */
+
+/**
+ * Remember listening socket so socket_wait can poll it.
+ **/
+static void socket_register(int fd) {
+    if (NListeners < SOCKET_LISTENERS) {
+        Listeners[NListeners++] = (struct pollfd){fd, POLLIN, 0};
+    }
+}
+
+/**
+ * Parse socket tuning option of the form name[=value].
+ *
+ * @param   option      Option string.
+ * @return  true if option was recognized, false otherwise.
+ *
+ * Recognized options:
+ *
+ *  backlog=N       Listen backlog (default SOMAXCONN)
+ *  defer[=S]       TCP_DEFER_ACCEPT for S seconds (default 1)
+ *  fastopen[=N]    TCP_FASTOPEN with queue length N (default 256)
+ *  nodelay         TCP_NODELAY on client sockets
+ *  cork            TCP_CORK around each response
+ *  sndbuf=N        SO_SNDBUF size
+ *  rcvbuf=N        SO_RCVBUF size
+ *  dualstack       Single IPv6 listener that also accepts IPv4
+ **/
+bool parse_socket_option(const char *option) {
+    const char *value = strchr(option, '=');
+    size_t      length = value ? (size_t)(value - option) : strlen(option);
+    int         number = value ? atoi(value + 1) : -1;
+
+    if (streqn(option, length, "backlog") && number > 0) {
+        SocketConfig.backlog = number;
+    } else if (streqn(option, length, "defer")) {
+        SocketConfig.defer_accept = number > 0 ? number : 1;
+    } else if (streqn(option, length, "fastopen")) {
+        SocketConfig.fastopen = number > 0 ? number : 256;
+    } else if (streqn(option, length, "nodelay")) {
+        SocketConfig.nodelay = true;
+    } else if (streqn(option, length, "cork")) {
+        SocketConfig.cork = true;
+    } else if (streqn(option, length, "sndbuf") && number > 0) {
+        SocketConfig.sndbuf = number;
+    } else if (streqn(option, length, "rcvbuf") && number > 0) {
+        SocketConfig.rcvbuf = number;
+    } else if (streqn(option, length, "dualstack")) {
+        SocketConfig.dualstack = true;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Apply per-connection socket options to client socket.
+ *
+ * @param   fd          Client socket file descriptor.
+ * @param   tcp         Whether socket is TCP (rather than Unix domain).
+ *
+ * Blocking sends give up after WriteConfig.timeout seconds without
+ * progress, so a client that stops reading cannot hold its handler
+ * forever.  TCP sockets also keep at most WriteConfig.notsent bytes unsent
+ * (TCP_NOTSENT_LOWAT): instead of queueing up to the socket buffer's
+ * size per connection, senders wait, and POLLOUT means the client is
+ * actually draining.
+ **/
+void socket_tune(int fd, bool tcp) {
+    struct timeval timeout = {.tv_sec = WriteConfig.timeout};
+    int            on      = 1;
+    int            notsent = WriteConfig.notsent;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0) {
+        debug("Unable to set SO_SNDTIMEO: %s", strerror(errno));
+    }
+    if (!tcp) {
+        return;
+    }
+    if (SocketConfig.nodelay && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0) {
+        debug("Unable to set TCP_NODELAY: %s", strerror(errno));
+    }
+    if (notsent && setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &notsent, sizeof(notsent)) < 0) {
+        debug("Unable to set TCP_NOTSENT_LOWAT: %s", strerror(errno));
+    }
+}
+
+/**
+ * Wait until client socket accepts more data.
+ *
+ * @param   fd          Client socket file descriptor.
+ * @return  true if writable, false if the client did not drain within
+ *          WriteConfig.timeout seconds (or the socket failed).
+ **/
+bool socket_writable(int fd) {
+    struct pollfd pfd = {fd, POLLOUT, 0};
+    int           ready;
+
+    while ((ready = poll(&pfd, 1, WriteConfig.timeout * 1000)) < 0 && errno == EINTR);
+    return ready > 0 && !(pfd.revents & (POLLERR | POLLNVAL));
+}
+
 /**
- * Allocate socket, bind it, and listen to specified port.
+ * Toggle TCP_CORK on client socket (if enabled).
+ *
+ * @param   fd          Client socket file descriptor.
+ * @param   cork        Whether to cork (true) or uncork and push (false).
+ **/
+void socket_cork(int fd, bool cork) {
+    int value = cork;
+
+    if (SocketConfig.cork && setsockopt(fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value)) < 0) {
+        debug("Unable to set TCP_CORK: %s", strerror(errno));
+    }
+}
+
+/**
+ * Apply listener socket options before bind and listen.
+ *
+ * @param   fd          Server socket file descriptor.
+ * @param   family      Address family of socket.
+ **/
+static void socket_configure(int fd, int family) {
+    int v6only = !SocketConfig.dualstack;
+    int on     = 1;
+
+    /* Without dualstack, IPv6 listeners leave IPv4 to their own listener */
+    if (family == AF_INET6 && setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)) < 0) {
+        fprintf(stderr, "Unable to set IPV6_V6ONLY: %s\n", strerror(errno));
+    }
+
+    /* Buffer sizes must be set on the listener so window scaling is negotiated */
+    if (SocketConfig.sndbuf && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &SocketConfig.sndbuf, sizeof(int)) < 0) {
+        fprintf(stderr, "Unable to set SO_SNDBUF: %s\n", strerror(errno));
+    }
+    if (SocketConfig.rcvbuf && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &SocketConfig.rcvbuf, sizeof(int)) < 0) {
+        fprintf(stderr, "Unable to set SO_RCVBUF: %s\n", strerror(errno));
+    }
+
+    if (SocketConfig.defer_accept &&
+        setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &SocketConfig.defer_accept, sizeof(int)) < 0) {
+        fprintf(stderr, "Unable to set TCP_DEFER_ACCEPT: %s\n", strerror(errno));
+    }
+    if (SocketConfig.fastopen &&
+        setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &SocketConfig.fastopen, sizeof(int)) < 0) {
+        fprintf(stderr, "Unable to set TCP_FASTOPEN: %s\n", strerror(errno));
+    }
+
+    /* Receive timestamps measure queueing delay (inherited by accepted sockets) */
+    if (SocketConfig.timestamps && setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0) {
+        fprintf(stderr, "Unable to set SO_TIMESTAMPNS: %s\n", strerror(errno));
+    }
+}
+
+/**
+ * Determine number of connections waiting to be accepted.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @return  Length of listen queue (0 if unknown).
+ *
+ * For a listening socket, TCP_INFO reports the accept queue length in
+ * tcpi_unacked.
+ **/
+int socket_queue_length(int sfd) {
+    struct tcp_info info;
+    socklen_t       length = sizeof(info);
+
+    if (getsockopt(sfd, IPPROTO_TCP, TCP_INFO, &info, &length) < 0) {
+        return 0;
+    }
+    return info.tcpi_unacked;
+}
+
+/**
+ * Allocate sockets, bind them, and listen to specified port.
  *
  * @param   port        Port number to bind to and listen on.
- * @return  Allocated server socket file descriptor.
+ * @return  First allocated server socket file descriptor (or -1 if none).
+ *
+ * By default there is one listener per address family, so both IPv4 and
+ * IPv6 clients are served (the IPv6 one is IPV6_V6ONLY); all of them are
+ * registered for socket_wait.  If dualstack is enabled, IPv6 addresses are
+ * tried first and only the first listener is kept, since it accepts both
+ * IPv6 and (mapped) IPv4 clients.
  **/
 int socket_listen(const char *port) {
     /* Lookup server address information */
@@ -34,35 +230,244 @@ int socket_listen(const char *port) {
       }
 
 
-    /* For each server entry, allocate socket and try to connect */
+    /* Move IPv6 entries to the front if dualstack is enabled */
+    if (SocketConfig.dualstack) {
+        struct addrinfo **tail = &results;
+        for (struct addrinfo **pp = &results; *pp != NULL; ) {
+            struct addrinfo *p = *pp;
+            if (p->ai_family == AF_INET6 && pp != tail) {
+                *pp        = p->ai_next;
+                p->ai_next = *tail;
+                *tail      = p;
+                tail       = &p->ai_next;
+            } else {
+                if (p->ai_family == AF_INET6) {
+                    tail = &p->ai_next;
+                }
+                pp = &p->ai_next;
+            }
+        }
+    }
+
+    /* For each server entry, allocate socket and try to listen */
     int socket_fd = -1;
-    for (struct addrinfo *p = results; p != NULL && socket_fd < 0; p = p->ai_next) {
-        /* Allocate socket */
-        if ((socket_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) {
+    for (struct addrinfo *p = results; p != NULL && !(socket_fd >= 0 && SocketConfig.dualstack); p = p->ai_next) {
+        /* Allocate socket (not inherited by CGI scripts) */
+        int fd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol);
+        if (fd < 0) {
             fprintf(stderr, "Unable to make socket: %s\n", strerror(errno));
             continue;
         }
 
+	/* Configure socket */
+        socket_configure(fd, p->ai_family);
+
 	/* Bind socket */
-        if (bind(socket_fd, p->ai_addr, p->ai_addrlen) < 0) {
+        if (bind(fd, p->ai_addr, p->ai_addrlen) < 0) {
             fprintf(stderr, "Unable to bind: %s\n", strerror(errno));
-            close(socket_fd);
-            socket_fd = -1;
+            close(fd);
             continue;
         }
 
     	/* Listen to socket */
-        if (listen(socket_fd, SOMAXCONN) < 0) {
+        if (listen(fd, SocketConfig.backlog) < 0) {
 	     fprintf(stderr, "Unable to listen: %s\n", strerror(errno));
-	     close(socket_fd);
-	     socket_fd = -1;
+	     close(fd);
 	     continue;
 	}
 
+        socket_register(fd);
+        if (socket_fd < 0) {
+            socket_fd = fd;
+        }
     }
 
     freeaddrinfo(results);
     return socket_fd;
 }
 
+/**
+ * Allocate Unix domain socket, bind it to path, and listen on it.
+ *
+ * @param   path        Filesystem path of socket.
+ * @return  Allocated server socket file descriptor or -1 on error.
+ *
+ * A stale socket left at path by a previous server is removed first (any
+ * other kind of file is left alone and makes bind fail).  Access to the
+ * socket is controlled by its file permissions, which follow the umask.
+ **/
+int socket_listen_unix(const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    struct stat        s;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Unix socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to make socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (lstat(path, &s) == 0 && S_ISSOCK(s.st_mode)) {
+        unlink(path);
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "Unable to bind %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, SocketConfig.backlog) < 0) {
+        fprintf(stderr, "Unable to listen: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    socket_register(fd);
+    return fd;
+}
+
+/**
+ * Wait for a listening socket with a pending connection.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @return  Listening socket to accept from.
+ *
+ * With a single listener this returns sfd without a system call.
+ * Otherwise all listeners are polled and checked in rotating order, so
+ * TCP and Unix domain clients are served fairly.
+ **/
+int socket_wait(int sfd) {
+    if (NListeners <= 1) {
+        return sfd;
+    }
+    if (ReadyListener >= 0) {
+        sfd = ReadyListener;
+        ReadyListener = -1;
+        return sfd;
+    }
+
+    while (poll(Listeners, NListeners, -1) < 0) {
+        if (errno != EINTR) {
+            return sfd;
+        }
+    }
+
+    for (nfds_t i = 0; i < NListeners; i++) {
+        nfds_t index = (NextListener + i) % NListeners;
+        if (Listeners[index].revents) {
+            NextListener = index + 1;
+            return Listeners[index].fd;
+        }
+    }
+    return sfd;
+}
+
+/**
+ * Wait until some listening socket has a pending connection.
+ *
+ * @param   timeout     Maximum time to wait in milliseconds.
+ * @return  true if a connection is pending, false on timeout or signal.
+ *
+ * After socket_watch_listeners this waits on the process's own epoll set,
+ * and the next socket_wait returns the listener that became ready.
+ **/
+bool socket_ready(int timeout) {
+    struct epoll_event event;
+
+    if (ListenerPoll < 0) {
+        return poll(Listeners, NListeners, timeout) > 0;
+    }
+    if (epoll_wait(ListenerPoll, &event, 1, timeout) <= 0) {
+        return false;
+    }
+    ReadyListener = event.data.fd;
+    return true;
+}
+
+/**
+ * Wait for listeners with an exclusive epoll set of this process.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * Each worker calls this after it is forked.  With EPOLLEXCLUSIVE, a new
+ * connection wakes one waiting worker (or a few), instead of every idle
+ * worker waking up to race for it and all but one getting EAGAIN.
+ * Without EPOLLEXCLUSIVE (Linux before 4.5), socket_ready keeps polling.
+ **/
+int socket_watch_listeners(void) {
+    if ((ListenerPoll = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        return -1;
+    }
+
+    for (nfds_t i = 0; i < NListeners; i++) {
+        struct epoll_event event = {.events = EPOLLIN | EPOLLEXCLUSIVE, .data.fd = Listeners[i].fd};
+        if (epoll_ctl(ListenerPoll, EPOLL_CTL_ADD, Listeners[i].fd, &event) < 0) {
+            debug("Unable to add listener to epoll set: %s", strerror(errno));
+            close(ListenerPoll);
+            ListenerPoll = -1;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Make listening sockets non-blocking so several processes can share them.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * A process woken for a connection that another process accepted first
+ * gets EAGAIN instead of blocking until the next connection.
+ **/
+int socket_share_listeners(void) {
+    for (nfds_t i = 0; i < NListeners; i++) {
+        int flags = fcntl(Listeners[i].fd, F_GETFL);
+        if (flags < 0 || fcntl(Listeners[i].fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+            fprintf(stderr, "Unable to make listener non-blocking: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Close every listening socket (in a forked child).
+ **/
+void socket_close_listeners(void) {
+    for (nfds_t i = 0; i < NListeners; i++) {
+        close(Listeners[i].fd);
+    }
+    NListeners = 0;
+}
+
+/**
+ * Identify peer of Unix domain socket.
+ *
+ * @param   fd          Client socket file descriptor.
+ * @param   host        Buffer to store host ("unix").
+ * @param   hostlen     Size of host buffer.
+ * @param   port        Buffer to store process ID of peer (as its "port").
+ * @param   portlen     Size of port buffer.
+ * @return  User ID of peer or -1 if unknown.
+ *
+ * SO_PEERCRED reports the credentials the peer had when it connected, so
+ * no name lookup is needed.
+ **/
+int socket_peer(int fd, char *host, size_t hostlen, char *port, size_t portlen) {
+    struct ucred cred;
+    socklen_t    length = sizeof(cred);
+
+    snprintf(host, hostlen, "unix");
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &length) < 0) {
+        snprintf(port, portlen, "0");
+        return -1;
+    }
+    snprintf(port, portlen, "%d", cred.pid);
+    return cred.uid;
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
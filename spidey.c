@@ -3,9 +3,11 @@
 #include "spidey.h"
 
 #include <errno.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <string.h>
 
+#include <sys/socket.h>
 #include <unistd.h>
 
 /* Global Variables */
@@ -13,6 +15,20 @@ char *Port	      = "9898";
 char *MimeTypesPath   = "/etc/mime.types";
 char *DefaultMimeType = "text/plain";
 char *RootPath	      = "www";
+char *PackPath	      = NULL;
+char *UnixPath	      = NULL;
+char *TracePath	      = NULL;
+bool  ProfileMode     = false;
+char *TLSCertPath     = NULL;
+char *TLSKeyPath      = NULL;
+int   CGICacheTTL     = -1;
+bool  BrowseStream    = false;
+size_t FileCacheBudget = 16 << 20;
+size_t RequestPoolMax  = 1024;
+
+SocketOptions SocketConfig = {
+    .backlog = SOMAXCONN,
+};
 
 /**
  * Display usage message and exit with specified status code.
@@ -21,14 +37,39 @@ char *RootPath	      = "www";
  * @param   status      Exit status.
  */
 void usage(const char *progname, int status) {
-    fprintf(stderr, "Usage: %s [hcmMpr]\n", progname);
+    fprintf(stderr, "Usage: %s [hcmMpurPNOWCLEBSTXtkw]\n", progname);
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "    -h            Display help message\n");
-    fprintf(stderr, "    -c mode       Single or Forking mode\n");
+    fprintf(stderr, "    -c mode       Single, Forking, or Prefork mode\n");
     fprintf(stderr, "    -m path       Path to mimetypes file\n");
     fprintf(stderr, "    -M mimetype   Default mimetype\n");
-    fprintf(stderr, "    -p port       Port to listen on\n");
+    fprintf(stderr, "    -p port       Port to listen on (none = only Unix domain socket)\n");
+    fprintf(stderr, "    -u path       Also listen on Unix domain socket (for local proxies)\n");
     fprintf(stderr, "    -r path       Root directory\n");
+    fprintf(stderr, "    -P pack       Serve static content pack\n");
+    fprintf(stderr, "    -C seconds    Cache CGI output (default TTL if script sets none)\n");
+    fprintf(stderr, "    -L            Stream directory listings unsorted\n");
+    fprintf(stderr, "    -B bytes      File response cache budget (K/M/G suffix, 0 = off, default 16M;\n");
+    fprintf(stderr, "                  split across prefork workers, off in forking mode)\n");
+    fprintf(stderr, "    -N count      Maximum pooled requests (connections and HTTP/2 streams,\n");
+    fprintf(stderr, "                  default 1024)\n");
+    fprintf(stderr, "    -O option     Socket option (backlog=N, defer[=S], fastopen[=N], nodelay,\n");
+    fprintf(stderr, "                  cork, sndbuf=N, rcvbuf=N, dualstack)\n");
+    fprintf(stderr, "    -W option     Response buffering (high=N, notsent=N, cap=N, timeout=S;\n");
+    fprintf(stderr, "                  default high=64K notsent=128K cap=64M timeout=30)\n");
+    fprintf(stderr, "    -E executor   Request class executor (class=threads[:depth[:nice]],\n");
+    fprintf(stderr, "                  class is pack, browse, cgi, file, cold, or error;\n");
+    fprintf(stderr, "                  default cgi=4:64 and cold=2:64; per prefork worker,\n");
+    fprintf(stderr, "                  forking mode always handles requests inline)\n");
+    fprintf(stderr, "    -S option     Load shedding (target=MS, interval=MS, retry=S, queue=N,\n");
+    fprintf(stderr, "                  class=N in flight)\n");
+    fprintf(stderr, "    -w option     Prefork workers (min=N, max=N, interval=MS, delay=MS;\n");
+    fprintf(stderr, "                  default min=2 max=8 per CPU interval=1000 delay=5)\n");
+    fprintf(stderr, "    -T path       Record request phases; dump Chrome trace to path on SIGUSR1\n");
+    fprintf(stderr, "    -X profile    Count cycles and cache misses by request class; report on\n");
+    fprintf(stderr, "                  SIGUSR2 or exit (SIGINT/SIGTERM)\n");
+    fprintf(stderr, "    -t cert       Serve HTTPS with PEM certificate chain (see make cert)\n");
+    fprintf(stderr, "    -k key        PEM private key (default: in certificate file)\n");
     exit(status);
 }
 
@@ -56,6 +97,9 @@ bool parse_options(int argc, char *argv[], ServerMode *mode) {
             case 'p':
               Port = argv[argind++];
               break;
+            case 'u':
+              UnixPath = argv[argind++];
+              break;
             case 'r':
               RootPath = argv[argind++];
               break;
@@ -65,12 +109,75 @@ bool parse_options(int argc, char *argv[], ServerMode *mode) {
             case 'm':
               MimeTypesPath = argv[argind++];
               break;
+            case 'P':
+              PackPath = argv[argind++];
+              break;
+            case 't':
+              TLSCertPath = argv[argind++];
+              break;
+            case 'k':
+              TLSKeyPath = argv[argind++];
+              break;
+            case 'T':
+              TracePath = argv[argind++];
+              break;
+            case 'X':
+              if (argind >= argc || !streq(argv[argind++], "profile")) {
+                  usage(PROGRAM_NAME,1);
+              }
+              ProfileMode = true;
+              break;
+            case 'C':
+              CGICacheTTL = atoi(argv[argind++]);
+              break;
+            case 'L':
+              BrowseStream = true;
+              break;
+            case 'B':
+              if (argind >= argc || !parse_size(argv[argind++], &FileCacheBudget)) {
+                  usage(PROGRAM_NAME,1);
+              }
+              break;
+            case 'N':
+              if (argind >= argc || !parse_size(argv[argind++], &RequestPoolMax)) {
+                  usage(PROGRAM_NAME,1);
+              }
+              break;
+            case 'O':
+              if (argind >= argc || !parse_socket_option(argv[argind++])) {
+                  usage(PROGRAM_NAME,1);
+              }
+              break;
+            case 'W':
+              if (argind >= argc || !parse_write_option(argv[argind++])) {
+                  usage(PROGRAM_NAME,1);
+              }
+              break;
+            case 'E':
+              if (argind >= argc || !parse_executor_option(argv[argind++])) {
+                  usage(PROGRAM_NAME,1);
+              }
+              break;
+            case 'S':
+              if (argind >= argc || !parse_shed_option(argv[argind++])) {
+                  usage(PROGRAM_NAME,1);
+              }
+              break;
+            case 'w':
+              if (argind >= argc || !parse_worker_option(argv[argind++])) {
+                  usage(PROGRAM_NAME,1);
+              }
+              break;
             case 'c':
               if (streq(argv[argind], "forking"))
               {
                   *mode = FORKING;
                   argind++;
               }
+              else if (streq(argv[argind], "prefork")){
+                  *mode = PREFORK;
+                  argind++;
+              }
               else if (streq(argv[argind], "single")){
                   *mode = SINGLE;
                   argind++;
@@ -92,7 +199,7 @@ bool parse_options(int argc, char *argv[], ServerMode *mode) {
  * Parses command line options and starts appropriate server
  **/
 int main(int argc, char *argv[]) {
-    ServerMode mode;
+    ServerMode mode = SINGLE;
 
     /* Parse command line options */
     bool parsed = parse_options(argc, argv, &mode);
@@ -101,9 +208,30 @@ int main(int argc, char *argv[]) {
       return EXIT_FAILURE;
     }
 
+    /* Select request scanning implementation */
+    const char *scanner = scan_init();
+
+    /* Ignore SIGPIPE so writes to closed sockets fail with EPIPE instead */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Size worker pool */
+    if (mode == PREFORK) {
+      prefork_defaults();
+    }
+
+    /* Timestamp requests if shedding or the worker pool uses queueing delay */
+    SocketConfig.timestamps = ShedConfig.target || mode == PREFORK;
+
     /* Listen to server socket */
 
-    int FD = socket_listen(Port);
+    int FD = streq(Port, "none") ? -1 : socket_listen(Port);
+    if (UnixPath) {
+      int UFD = socket_listen_unix(UnixPath);
+      FD = FD < 0 ? UFD : FD;
+      if (UFD < 0) {
+        return EXIT_FAILURE;
+      }
+    }
     if(FD == -1){
       fprintf(stderr, "Unable to open file... %s\n", strerror(errno));
       close(FD);
@@ -115,17 +243,91 @@ int main(int argc, char *argv[]) {
 
     /* Determine real RootPath */
 
-    log("Listening on port %s", Port);
+    /* Create CGI cache directory */
+    if (CGICacheTTL >= 0 && cgi_cache_init() < 0) {
+      return EXIT_FAILURE;
+    }
+
+    /* Map static content pack */
+    if (PackPath && pack_open(PackPath) < 0) {
+      return EXIT_FAILURE;
+    }
+
+    if (!streq(Port, "none")) {
+      log("Listening on port %s", Port);
+    }
+    if (UnixPath) {
+      log("Listening on %s", UnixPath);
+    }
+    log("Socket options: backlog=%d defer=%d fastopen=%d nodelay=%s cork=%s sndbuf=%d rcvbuf=%d dualstack=%s",
+        SocketConfig.backlog, SocketConfig.defer_accept, SocketConfig.fastopen,
+        SocketConfig.nodelay ? "on" : "off", SocketConfig.cork ? "on" : "off",
+        SocketConfig.sndbuf, SocketConfig.rcvbuf, SocketConfig.dualstack ? "on" : "off");
+    log("Response buffering: high=%zu notsent=%zu cap=%zu timeout=%d",
+        WriteConfig.high, WriteConfig.notsent, WriteConfig.cap, WriteConfig.timeout);
     debug("RootPath        = %s", RootPath);
     debug("MimeTypesPath   = %s", MimeTypesPath);
     debug("DefaultMimeType = %s", DefaultMimeType);
-    debug("ConcurrencyMode = %s", mode == SINGLE ? "Single" : "Forking");
+    debug("Scanner         = %s", scanner);
+    debug("CGICacheTTL     = %d", CGICacheTTL);
+    debug("PackPath        = %s", PackPath ? PackPath : "(none)");
+    debug("ConcurrencyMode = %s", mode == SINGLE ? "Single" : mode == PREFORK ? "Prefork" : "Forking");
+
+    /* Forking children exit after one request, so what they cache is never
+     * reused; prefork workers each keep their own cache, so share the budget */
+    if (mode == FORKING) {
+      FileCacheBudget = 0;
+    } else if (mode == PREFORK) {
+      FileCacheBudget /= WorkerConfig.max;
+    }
+    debug("FileCacheBudget = %zu", FileCacheBudget);
+
+    /* Reserve request pool */
+    if (request_pool_init() < 0) {
+      return EXIT_FAILURE;
+    }
+
+    /* Load TLS certificate (ticket keys must exist before workers fork) */
+    if (tls_init() < 0) {
+      return EXIT_FAILURE;
+    }
 
-    /* Start either forking or single HTTP server */
+    /* Share lookups between worker processes */
+    if (shm_cache_init() < 0) {
+      return EXIT_FAILURE;
+    }
+
+    /* Share response buffer accounting with forked children */
+    if (response_init() < 0) {
+      return EXIT_FAILURE;
+    }
+
+    /* Share load shedding state with executors and forked children */
+    if (shed_init() < 0) {
+      return EXIT_FAILURE;
+    }
+
+    /* Start trace dump thread (before any other thread, so it alone gets SIGUSR1) */
+    if (trace_init() < 0) {
+      return EXIT_FAILURE;
+    }
+
+    /* Start profile report thread (also before other threads, for its signals) */
+    if (profile_init() < 0) {
+      return EXIT_FAILURE;
+    }
+
+    /* Start either forking or single HTTP server (with request executors;
+     * prefork workers start their own after fork) */
     if(mode == SINGLE){
+      if (executor_start() < 0) {
+        return EXIT_FAILURE;
+      }
       single_server(FD);
     } else if (mode == FORKING) {
       forking_server(FD);
+    } else if (mode == PREFORK) {
+      return prefork_server(FD);
     } else {
       fprintf(stderr, "Unable to start server... %s\n", strerror(errno));
       return EXIT_FAILURE;
@@ -1,16 +1,29 @@
 #ifndef SPIDEY_H
 #define SPIDEY_H
 
+#include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <netdb.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 /* Constants */
 
 #define WHITESPACE	" \t\n"
+#define REQUEST_BUFSIZ	    8192        /* Size of request receive buffer */
+#define CGI_CACHE_KEYSIZ    2048        /* Maximum CGI cache key length */
+#define REQUEST_HEADERS_MAX 32          /* Maximum unknown headers per request */
+#define REQUEST_HOSTSIZ     64          /* Numeric IPv6 address with scope */
+#define REQUEST_PORTSIZ     8           /* Port number (or peer pid) */
+#define CACHE_LINE          64          /* Alignment of pooled requests */
+#define RESPONSE_BUFSIZ	    1024        /* Initial size of response text buffer */
+#define RESPONSE_SEGMENTS   16          /* Maximum pending response segments */
+#define FILE_CACHE_OBJSIZ   (256*1024)  /* Largest file kept in response cache */
 
 /**
  * Concurrency modes
@@ -18,15 +31,129 @@
 typedef enum {
     SINGLE,                             /**< Single connection */
     FORKING,                            /**< Process per connection */
+    PREFORK,                            /**< Self-tuning pool of worker processes */
     UNKNOWN
 } ServerMode;
 
+/**
+ * Socket tuning options
+ */
+typedef struct {
+    int     backlog;                    /**< Listen backlog */
+    int     defer_accept;               /**< TCP_DEFER_ACCEPT seconds (0 = off) */
+    int     fastopen;                   /**< TCP_FASTOPEN queue length (0 = off) */
+    bool    nodelay;                    /**< TCP_NODELAY on client sockets */
+    bool    cork;                       /**< TCP_CORK around responses */
+    int     sndbuf;                     /**< SO_SNDBUF size (0 = default) */
+    int     rcvbuf;                     /**< SO_RCVBUF size (0 = default) */
+    bool    dualstack;                  /**< Accept IPv4 on IPv6 listener */
+    bool    timestamps;                 /**< SO_TIMESTAMPNS to measure queueing delay */
+} SocketOptions;
+
+/**
+ * Response buffering options
+ */
+typedef struct {
+    size_t  high;                       /**< Flush once this much output is buffered */
+    size_t  notsent;                    /**< Unsent bytes allowed in socket (TCP_NOTSENT_LOWAT) */
+    size_t  cap;                        /**< Total buffered output of all connections */
+    int     timeout;                    /**< Seconds a client may stop draining */
+} WriteOptions;
+
+/**
+ * Request classes (determined before a request is handled)
+ */
+typedef enum {
+    REQUEST_UNKNOWN = 0,                /**< Not yet classified */
+    REQUEST_PACK,                       /**< Static content pack entry */
+    REQUEST_BROWSE,                     /**< Directory listing */
+    REQUEST_CGI,                        /**< CGI script */
+    REQUEST_FILE,                       /**< Static file (in page cache) */
+    REQUEST_COLD,                       /**< Static file (maybe not in page cache) */
+    REQUEST_ERROR,                      /**< Missing or inaccessible path */
+    REQUEST_CLASSES
+} RequestClass;
+
+/**
+ * Profiled sections of request handling (see -X profile)
+ */
+typedef enum {
+    PROFILE_PARSE = 0,                  /**< Reading and parsing request */
+    PROFILE_RESOLVE,                    /**< Resolving path and classifying request */
+    PROFILE_REALPATH,                   /**< determine_request_path (part of resolve) */
+    PROFILE_HANDLE,                     /**< Running request handler */
+    PROFILE_MIMETYPE,                   /**< determine_mimetype (part of handle) */
+    PROFILE_SECTIONS
+} ProfileSection;
+
+/**
+ * Values measured for each profiled section
+ */
+typedef enum {
+    PROFILE_WALL = 0,                   /**< Wall time (ns) */
+    PROFILE_CPU,                        /**< Thread CPU time (ns) */
+    PROFILE_CYCLES,                     /**< CPU cycles */
+    PROFILE_INSTRUCTIONS,               /**< Instructions retired */
+    PROFILE_CACHE_MISSES,               /**< Last level cache misses */
+    PROFILE_BRANCH_MISSES,              /**< Mispredicted branches */
+    PROFILE_VALUES
+} ProfileValue;
+
+typedef struct {
+    uint64_t values[PROFILE_VALUES];    /**< Readings at start of section */
+} ProfileSample;
+
+/**
+ * Executor options (per request class)
+ */
+typedef struct {
+    int     threads;                    /**< Worker threads (0 = handle inline) */
+    int     depth;                      /**< Maximum queued requests */
+    int     nice;                       /**< Scheduling priority of threads */
+} ExecutorOptions;
+
+/**
+ * Load shedding options
+ */
+typedef struct {
+    int     target;                     /**< Target queueing delay in ms (0 = off) */
+    int     interval;                   /**< Window delay must exceed target in ms */
+    int     retry;                      /**< Retry-After seconds sent with 503 */
+    int     queue;                      /**< Maximum listen queue length (0 = off) */
+    int     inflight[REQUEST_CLASSES];  /**< Maximum requests in flight (0 = off) */
+} ShedOptions;
+
+/**
+ * Prefork worker pool options
+ */
+typedef struct {
+    int     min;                        /**< Minimum worker processes */
+    int     max;                        /**< Maximum worker processes (0 = not prefork) */
+    int     interval;                   /**< Controller sampling interval in ms */
+    int     delay;                      /**< Accept-to-start delay that adds workers in ms */
+} WorkerOptions;
+
 /* Global Variables */
 
 extern char *Port;                      /**< Port number */
 extern char *MimeTypesPath;             /**< Path to mime.types file */
 extern char *DefaultMimeType;           /**< Default file mimetype */
 extern char *RootPath;                  /**< Path to root directory */
+extern char *PackPath;                  /**< Path to static content pack */
+extern char *UnixPath;                  /**< Path of Unix domain socket (NULL = none) */
+extern SocketOptions SocketConfig;      /**< Socket tuning options */
+extern WriteOptions WriteConfig;        /**< Response buffering options */
+extern int  CGICacheTTL;                /**< Default CGI cache TTL (-1 = disabled) */
+extern bool BrowseStream;               /**< Stream directory listings unsorted */
+extern ExecutorOptions ExecutorConfig[REQUEST_CLASSES]; /**< Executor options by class */
+extern size_t FileCacheBudget;          /**< Response cache memory budget (0 = disabled) */
+extern ShedOptions ShedConfig;          /**< Load shedding options */
+extern WorkerOptions WorkerConfig;      /**< Prefork worker pool options */
+extern char *TracePath;                 /**< Path of trace dump (NULL = disabled) */
+extern bool ProfileMode;                /**< Profile request classes (-X profile) */
+extern size_t RequestPoolMax;           /**< Maximum requests in pool (connections and streams) */
+extern char *TLSCertPath;               /**< Path to TLS certificate (NULL = plain HTTP) */
+extern char *TLSKeyPath;                /**< Path to TLS private key (NULL = in certificate) */
 
 /* Logging Macros */
 
@@ -41,62 +168,430 @@ extern char *RootPath;                  /**< Path to root directory */
 
 /* HTTP Request */
 
-typedef struct header Header;
-struct header {
+typedef enum {
+    HEADER_ACCEPT = 0,
+    HEADER_ACCEPT_ENCODING,
+    HEADER_ACCEPT_LANGUAGE,
+    HEADER_AUTHORIZATION,
+    HEADER_CACHE_CONTROL,
+    HEADER_CONNECTION,
+    HEADER_CONTENT_LENGTH,
+    HEADER_CONTENT_TYPE,
+    HEADER_COOKIE,
+    HEADER_EXPECT,
+    HEADER_HOST,
+    HEADER_HTTP2_SETTINGS,
+    HEADER_IF_MODIFIED_SINCE,
+    HEADER_IF_NONE_MATCH,
+    HEADER_PORT,
+    HEADER_RANGE,
+    HEADER_REFERER,
+    HEADER_TRANSFER_ENCODING,
+    HEADER_UPGRADE,
+    HEADER_USER_AGENT,
+    HEADER_X_FORWARDED_FOR,
+    HEADER_X_FORWARDED_PORT,
+    HEADER_COUNT,
+    HEADER_UNKNOWN = HEADER_COUNT,
+} HeaderID;
+
+typedef struct {
     char    *name;                      /*< Name of header entry */
     char    *value;                     /*< Value of header entry */
-    Header  *next;                      /*< Next header entry */
-};
+} Header;
+
+typedef struct {
+    const char *data;                   /*< External data (NULL if in buffer) */
+    size_t      offset;                 /*< Offset into response buffer */
+    size_t      length;                 /*< Length of segment */
+} Segment;
+
+typedef struct {
+    Segment  segments[RESPONSE_SEGMENTS];/*< Pending segments (become iovecs) */
+    size_t   nsegments;                 /*< Number of pending segments */
+    char    *buffer;                    /*< Formatted text buffer */
+    size_t   length;                    /*< Length of formatted text */
+    size_t   capacity;                  /*< Capacity of formatted text buffer */
+} Response;
+
+typedef struct FileCacheEntry FileCacheEntry;
+struct ssl_st;
+struct TLSPump;
 
+/**
+ * Request fields used once per connection or only when a feature is
+ * enabled, and the request's large arrays.  These live in a parallel slab
+ * (see pool.c), so they do not share cache lines with the fields every
+ * request touches.
+ */
+typedef struct {
+    char host[REQUEST_HOSTSIZ];         /*< Host name of client */
+    char port[REQUEST_PORTSIZ];         /*< Port number of client */
+
+    uint32_t id;                        /*< Trace identifier (0 = not yet traced) */
+    uint64_t traced;                    /*< Time of last traced phase (ns) */
+
+    unsigned profiled;                  /*< Sections profiled (bit mask) */
+    uint64_t profile[PROFILE_SECTIONS][PROFILE_VALUES]; /*< Measured by section */
+
+    Header  extra[REQUEST_HEADERS_MAX]; /*< Unknown or repeated headers (not cleared) */
+    char    buffer[REQUEST_BUFSIZ];     /*< Receive buffer (not cleared) */
+} RequestCold;
+
+/**
+ * HTTP Request (one per connection or HTTP/2 stream)
+ *
+ * Fields are ordered by how often they are used: the first cache line holds
+ * what every request reads.  The receive buffer and extra headers are
+ * reached through pointers into the cold slab, so pooled requests stay
+ * small and reusing one only clears what it holds itself.
+ */
 typedef struct {
     int     fd;                         /*< Client socket file descripter */
-    FILE    *file;                      /*< Client socket file stream */
+    RequestClass type;                  /*< Class of request */
+    unsigned phases;                    /*< Phases already traced (bit mask) */
+    bool    local;                      /*< Client connected over Unix domain socket */
+    bool    secure;                     /*< Connection uses TLS */
+    bool    admitted;                   /*< Counted as in flight for its class */
+    char    *buffer;                    /*< Receive buffer (REQUEST_BUFSIZ, in cold slab) */
+    size_t  nbuffer;                    /*< Number of bytes in receive buffer */
+    size_t  offset;                     /*< Offset of unparsed data in buffer */
+    struct ssl_st *tls;                 /*< TLS session (if reads go through OpenSSL) */
     char    *method;                    /*< HTTP method */
     char    *uri;                       /*< HTTP uniform resource identifier */
-    char    *path;                      /*< Real path corrsponding to URI and RootPath */
     char    *query;                     /*< HTTP query string */
 
-    char host[NI_MAXHOST];              /*< Host name of client */
-    char port[NI_MAXSERV];              /*< Port number of client */
+    char    *path;                      /*< Real path corrsponding to URI and RootPath */
+    FileCacheEntry *cached;             /*< Cached response (if any) */
+    uint64_t arrival;                   /*< Time first data arrived (ns) */
+    uint64_t start;                     /*< Time handling started (ns) */
+    int      backlog;                   /*< Listen queue length at accept */
+    RequestCold    *cold;               /*< Out-of-line fields */
+    struct TLSPump *pump;               /*< TLS pump thread (if not using kTLS) */
+    size_t  nextra;                     /*< Number of extra headers */
+
+    char    *headers[HEADER_COUNT];     /*< Values of known headers (by HeaderID) */
+    Header  *extra;                     /*< Unknown or repeated headers (in cold slab) */
+    Response response;                  /*< Pending response */
+} __attribute__((aligned(CACHE_LINE))) Request;
+
+typedef enum {
+    BODY_DONE = 0,                      /* Body complete (or absent) */
+    BODY_DATA,                          /* Reading payload bytes */
+    BODY_CHUNK_SIZE,                    /* Reading chunk size line */
+    BODY_CHUNK_END,                     /* Reading CRLF after chunk data */
+    BODY_TRAILER,                       /* Reading trailer fields */
+} RequestBodyState;
 
-    Header  *headers;                   /*< List of name, value Header pairs */
-} Request;
+typedef struct {
+    RequestBodyState state;             /*< Decoder state */
+    bool     chunked;                   /*< Transfer-Encoding: chunked */
+    bool     extension;                 /*< Skipping chunk extension */
+    uint64_t remaining;                 /*< Bytes left in body or chunk */
+    int      digits;                    /*< Characters seen on current line */
+} RequestBody;
 
 Request *       accept_request(int sfd);
 void	        free_request(Request *request);
 int	        parse_request(Request *request);
+char *          read_request_line(Request *request, size_t *length);
+ssize_t         request_recv(Request *request, void *buffer, size_t size);
+ssize_t         request_body_decode(RequestBody *b, char *data, size_t length);
+int             request_body_init(Request *request, RequestBody *b);
+
+HeaderID        header_lookup(const char *name, size_t length);
+const char *    header_name(HeaderID id);
+int             request_add_header(Request *request, char *name, char *value);
+
+/* HTTP Response */
+
+void            response_account(size_t *bytes);
+int             response_flush(Request *request);
+void            response_free(Request *request);
+int             response_init(void);
+bool            parse_write_option(const char *option);
+int             response_printf(Request *request, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void            response_release(size_t *bytes);
+int             response_write(Request *request, const void *data, size_t length);
 
 /* HTTP Request Handlers */
 
 typedef enum {
     HTTP_STATUS_OK = 0,			/* 200 OK */
+    HTTP_STATUS_NOT_MODIFIED,		/* 304 Not Modified */
     HTTP_STATUS_BAD_REQUEST,		/* 400 Bad Request */
     HTTP_STATUS_NOT_FOUND,		/* 404 Not Found */
     HTTP_STATUS_INTERNAL_SERVER_ERROR,	/* 500 Internal Server Error */
     HTTP_STATUS_I_AM_A_TEAPOT,
+    HTTP_STATUS_SERVICE_UNAVAILABLE,	/* 503 Service Unavailable */
+    HTTP_STATUS_NOT_IMPLEMENTED,	/* 501 Not Implemented */
+    HTTP_STATUS_DEFERRED,		/* Request handed to executor (not sent yet) */
 } HTTPStatus;
 
+RequestClass    classify_request(Request *request);
+HTTPStatus      handle_dispatch(Request *request);
+HTTPStatus      handle_error(Request *request, HTTPStatus status);
 HTTPStatus      handle_request(Request *request);
 
 /* HTTP Server */
 
 int             single_server(int sfd);
 int             forking_server(int sfd);
+int             prefork_server(int sfd);
+bool            parse_worker_option(const char *option);
+void            prefork_defaults(void);
+
+/* Executors */
+
+typedef enum {
+    EXECUTOR_INLINE,                    /* Caller must handle request */
+    EXECUTOR_QUEUED,                    /* Executor now owns request */
+    EXECUTOR_FULL,                      /* Queue is at its depth limit */
+} ExecutorStatus;
+
+int             executor_start(void);
+ExecutorStatus  executor_submit(Request *request);
+void            executor_drain(void);
+bool            parse_executor_option(const char *option);
+
+/* Load Shedding */
+
+bool            parse_shed_option(const char *option);
+void            shed_account(int *counts);
+bool            shed_admit(Request *request);
+bool            shed_enter(Request *request);
+int             shed_init(void);
+void            shed_leave(Request *request);
+void            shed_release(int *counts);
+
+/* TLS */
+
+int             tls_accept(Request *request);
+void            tls_close(Request *request);
+int             tls_init(void);
+bool            tls_pending(Request *request);
+ssize_t         tls_recv(Request *request, void *buffer, size_t size);
+
+/* Tracing */
+
+typedef enum {
+    TRACE_ACCEPT = 0,                   /* Connection accepted */
+    TRACE_REQUEST_LINE,                 /* Request line parsed */
+    TRACE_HEADERS,                      /* Headers parsed */
+    TRACE_RESOLVED,                     /* Path resolved and request classified */
+    TRACE_DISPATCH,                     /* Handler started */
+    TRACE_FIRST_BYTE,                   /* First response byte sent */
+    TRACE_DONE,                         /* Request completed */
+    TRACE_PHASES
+} TracePhase;
+
+/*
+ * USDT probes (spidey:<phase>) for bpftrace, perf, and systemtap.  Every
+ * probe receives the Request pointer and its socket; the second argument
+ * depends on the phase.  Without <sys/sdt.h> the probes compile to nothing.
+ */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_PROBE(name, r, arg)       DTRACE_PROBE3(spidey, name, (r), (r)->fd, (arg))
+#endif
+#endif
+#ifndef TRACE_PROBE
+#define TRACE_PROBE(name, r, arg)       do { (void)(arg); } while (0)
+#endif
+
+#define TRACE_PROBE_ACCEPT(r, a)        TRACE_PROBE(accept, r, a)       /* client port */
+#define TRACE_PROBE_REQUEST_LINE(r, a)  TRACE_PROBE(request_line, r, a) /* uri */
+#define TRACE_PROBE_HEADERS(r, a)       TRACE_PROBE(headers, r, a)      /* extra headers */
+#define TRACE_PROBE_RESOLVED(r, a)      TRACE_PROBE(resolved, r, a)     /* path */
+#define TRACE_PROBE_DISPATCH(r, a)      TRACE_PROBE(dispatch, r, a)     /* request class */
+#define TRACE_PROBE_FIRST_BYTE(r, a)    TRACE_PROBE(first_byte, r, a)   /* bytes */
+#define TRACE_PROBE_DONE(r, a)          TRACE_PROBE(done, r, a)         /* request class */
+
+/*
+ * Mark request as having reached phase.  Only the first occurrence of each
+ * phase counts; it fires the USDT probe and, if a trace dump is configured,
+ * records the time since the previous phase in the trace ring.
+ */
+#define TRACE(r, phase, arg) do {                                       \
+    if (!((r)->phases & (1u << TRACE_##phase))) {                       \
+        (r)->phases |= 1u << TRACE_##phase;                             \
+        TRACE_PROBE_##phase(r, arg);                                    \
+        if (TracePath) {                                                \
+            trace_record((r), TRACE_##phase);                           \
+        }                                                               \
+    }                                                                   \
+} while (0)
+
+int             signal_thread(pthread_t *thread, void *(*routine)(void *), void *arg);
+int             trace_init(void);
+void            trace_record(Request *request, TracePhase phase);
+
+/* Request Pool */
+
+int             request_pool_init(void);
+Request *       request_pool_get(bool wait);
+void            request_pool_put(Request *request);
+
+/* Profiling */
+
+int             profile_init(void);
+void            profile_begin(ProfileSample *sample);
+void            profile_end(Request *request, ProfileSection section, const ProfileSample *sample);
+void            profile_finish(Request *request);
 
 /* Socket */
 
+void            socket_close_listeners(void);
 int	        socket_listen(const char *port);
+int             socket_listen_unix(const char *path);
+int             socket_peer(int fd, char *host, size_t hostlen, char *port, size_t portlen);
+int             socket_wait(int sfd);
+bool            socket_ready(int timeout);
+int             socket_share_listeners(void);
+int             socket_watch_listeners(void);
+bool            parse_socket_option(const char *option);
+void            socket_cork(int fd, bool cork);
+int             socket_queue_length(int sfd);
+void            socket_tune(int fd, bool tcp);
+bool            socket_writable(int fd);
+
+/* CGI Cache */
+
+typedef enum {
+    CGI_CACHE_BYPASS,                   /* Request is not cacheable */
+    CGI_CACHE_HIT,                      /* Cached response was sent */
+    CGI_CACHE_MISS,                     /* Caller must run script and commit */
+} CGICacheStatus;
+
+typedef struct {
+    char    key[CGI_CACHE_KEYSIZ];      /*< Cache key */
+    int     keylen;                     /*< Length of cache key */
+    char    path[96];                   /*< Path of cache entry */
+    char    temp[128];                  /*< Path of pending cache entry */
+    int     fd;                         /*< Pending cache entry file descriptor */
+    int     lock_fd;                    /*< Lock file descriptor */
+    int     pipe[2];                    /*< Pipe used to tee output into entry */
+    off_t   offset;                     /*< Write offset in pending entry */
+} CGICache;
+
+void            cgi_cache_abort(CGICache *c);
+void            cgi_cache_commit(CGICache *c, bool status);
+int             cgi_cache_init(void);
+CGICacheStatus  cgi_cache_lookup(Request *request, CGICache *c);
+ssize_t         cgi_cache_tee(CGICache *c, int pipe, size_t length);
+void            cgi_cache_write(CGICache *c, const void *data, size_t length);
+
+/* HTTP/2 */
+
+typedef struct {
+    char    *name;                      /*< Header name (shares allocation with value) */
+    char    *value;                     /*< Header value */
+    size_t   nlen;                      /*< Length of name */
+    size_t   vlen;                      /*< Length of value */
+    size_t   size;                      /*< Entry size (RFC 7541 4.1) */
+} HPACKEntry;
+
+typedef struct {
+    HPACKEntry *entries;                /*< Ring buffer of entries */
+    size_t   capacity;                  /*< Capacity of ring buffer */
+    size_t   head;                      /*< Slot for next (newest) entry */
+    size_t   count;                     /*< Number of entries */
+    size_t   size;                      /*< Total size of entries */
+    size_t   max_size;                  /*< Current maximum table size */
+    size_t   limit;                     /*< Largest size a peer may select */
+    bool     update;                    /*< Size change not yet signalled */
+} HPACKTable;
+
+typedef int (*HPACKCallback)(void *arg, const char *name, size_t nlen, const char *value, size_t vlen);
+
+int             hpack_decode(HPACKTable *t, const uint8_t *block, size_t length, HPACKCallback callback, void *arg);
+ssize_t         hpack_encode(HPACKTable *t, uint8_t *dst, size_t size, const char *name, const char *value);
+void            hpack_free(HPACKTable *t);
+void            hpack_init(HPACKTable *t, size_t max_size);
+void            hpack_resize(HPACKTable *t, size_t max_size);
+
+HTTPStatus      http2_serve(Request *request, bool upgrade);
+
+/* File Response Cache */
+
+struct FileCacheEntry {
+    FileCacheEntry *next;               /*< Next entry in hash chain */
+    FileCacheEntry *clock_prev;         /*< Previous entry in CLOCK ring */
+    FileCacheEntry *clock_next;         /*< Next entry in CLOCK ring */
+    uint64_t        hash;               /*< Hash of path */
+    char           *path;               /*< Resolved path of file */
+    char           *data;               /*< Complete response (headers and body) */
+    size_t          length;             /*< Length of response */
+    ino_t           ino;                /*< Inode of file */
+    off_t           size;               /*< Size of file */
+    struct timespec mtime;              /*< Modification time of file */
+    struct timespec ctime;              /*< Status change time of file */
+    bool            referenced;         /*< CLOCK reference bit */
+    bool            linked;             /*< Still reachable from the table */
+    int             refs;               /*< Requests currently sending entry */
+};
+
+void            file_cache_insert(const char *path, const struct stat *s, char *data, size_t length);
+FileCacheEntry *file_cache_lookup(const char *path, const struct stat *s);
+void            file_cache_release(FileCacheEntry *e);
+
+/* Shared Lookup Cache */
+
+typedef enum {
+    SHM_CACHE_MIMETYPE,                 /* File extension to mimetype */
+    SHM_CACHE_PATH,                     /* URI to real path */
+    SHM_CACHE_WARM,                     /* Path to version of file recently read */
+    SHM_CACHE_KINDS
+} ShmCacheKind;
+
+#define SHM_CACHE_VERSIZ    64          /* Largest file version (inode:size:mtime) */
+
+int             shm_cache_init(void);
+bool            shm_cache_lookup(ShmCacheKind kind, const char *key, char *value, size_t size);
+void            shm_cache_store(ShmCacheKind kind, const char *key, const char *value);
+
+/* Request Scanning */
+
+char *          scan_char(const char *s, size_t n, char c);
+const char *    scan_init(void);
+char *          scan_nonspace(const char *s, size_t n);
+char *          scan_space(const char *s, size_t n);
+
+/* Static Content Pack */
+
+typedef struct {
+    uint64_t uri;                       /*< Offset of URI string */
+    uint64_t mimetype;                  /*< Offset of mimetype string */
+    uint64_t offset;                    /*< Offset of file data (page-aligned) */
+    uint64_t length;                    /*< Length of file data */
+    uint64_t gzip_offset;               /*< Offset of gzip variant (0 if none) */
+    uint64_t gzip_length;               /*< Length of gzip variant */
+    int64_t  mtime;                     /*< Modification time of file */
+    char     etag[40];                  /*< Quoted entity tag */
+} PackEntry;
+
+int             pack_build(const char *root, const char *path, bool compress);
+const char *    pack_data(uint64_t offset);
+const PackEntry *pack_lookup(const char *uri);
+int             pack_open(const char *path);
 
 /* Utilities */
 
 #define chomp(s)    (s)[strlen(s) - 1] = '\0'
 #define streq(a, b) (strcmp((a), (b)) == 0)
+#define streqn(s, n, name) (strlen(name) == (n) && strncmp((s), (name), (n)) == 0)
 
 char *	        determine_mimetype(const char *path);
 char *	        determine_request_path(const char *uri);
 const char *    http_status_string(HTTPStatus status);
+const char *    request_class_name(RequestClass type);
+bool            parse_size(const char *s, size_t *size);
+long            query_number(const char *query, const char *name, long fallback);
+bool            query_string(const char *query, const char *name, char *value, size_t size);
 char *	        skip_nonwhitespace(char *s);
 char *	        skip_whitespace(char *s);
+uint64_t        time_now(void);
 
 #endif
 
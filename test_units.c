@@ -0,0 +1,663 @@
+/* test_units: Unit tests for spidey components */
+
+#include "spidey.h"
+
+#include <ctype.h>
+#include <limits.h>
+#include <signal.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Global Variables */
+char *Port	      = "9898";
+char *MimeTypesPath   = "/etc/mime.types";
+char *DefaultMimeType = "text/plain";
+char *RootPath	      = "www";
+char *PackPath	      = NULL;
+char *UnixPath	      = NULL;
+char *TracePath	      = NULL;
+bool  ProfileMode     = false;
+char *TLSCertPath     = NULL;
+char *TLSKeyPath      = NULL;
+int   CGICacheTTL     = -1;
+bool  BrowseStream    = false;
+size_t FileCacheBudget = 16 << 20;
+size_t RequestPoolMax  = 1024;
+
+SocketOptions SocketConfig = {
+    .backlog = SOMAXCONN,
+};
+
+static int Failures = 0;
+
+/* Functions */
+
+/**
+ * Print section heading.
+ **/
+static void section(const char *name) {
+    printf("\n %-64s ... \n", name);
+}
+
+/**
+ * Print result of test and count failures.
+ *
+ * @param   name        Test name.
+ * @param   passed      Whether test passed.
+ **/
+static void check(const char *name, bool passed) {
+    printf("     %-60s ... %s\n", name, passed ? "Success" : "Failure");
+    Failures += !passed;
+}
+
+/* Static Content Pack */
+
+/**
+ * Write file at path formed from root and name.
+ **/
+static void write_file(const char *root, const char *name, const char *data) {
+    char  path[PATH_MAX];
+    FILE *fs;
+
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+    if ((fs = fopen(path, "w"))) {
+        fputs(data, fs);
+        fclose(fs);
+    }
+}
+
+static void test_pack(void) {
+    char root[] = "/tmp/spidey-test.XXXXXX";
+    char www[64], pack[64], secret[64], path[PATH_MAX];
+
+    section("Static Content Pack");
+
+    if (!mkdtemp(root)) {
+        check("setup", false);
+        return;
+    }
+    snprintf(www, sizeof(www), "%s/www", root);
+    snprintf(pack, sizeof(pack), "%s/test.pack", root);
+    snprintf(secret, sizeof(secret), "%s/secret.txt", root);
+    snprintf(path, sizeof(path), "%s/sub", www);
+    mkdir(www, 0755);
+    mkdir(path, 0755);
+    write_file(www, "hello.txt", "Hello, World!\n");
+    write_file(www, "sub/index.html", "<html></html>\n");
+    write_file(root, "secret.txt", "secret\n");
+    snprintf(path, sizeof(path), "%s/link.txt", www);
+    symlink(secret, path);
+
+    check("pack_build", pack_build(www, pack, true) == 0);
+    check("pack_open", pack_open(pack) == 0);
+
+    const PackEntry *e = pack_lookup("/hello.txt");
+    check("pack_lookup /hello.txt", e != NULL);
+    if (e) {
+        check("entry data", e->length == 14 && memcmp(pack_data(e->offset), "Hello, World!\n", 14) == 0);
+        check("entry offset is page-aligned", e->offset % sysconf(_SC_PAGESIZE) == 0);
+        check("entry uri", streq(pack_data(e->uri), "/hello.txt"));
+        check("entry etag is quoted", e->etag[0] == '"' && e->etag[strlen(e->etag) - 1] == '"');
+    }
+
+    e = pack_lookup("/sub/index.html");
+    check("pack_lookup /sub/index.html", e && streq(pack_data(e->mimetype), "text/html"));
+    check("pack_lookup /missing.txt", pack_lookup("/missing.txt") == NULL);
+    check("pack_lookup skips symlinks", pack_lookup("/link.txt") == NULL);
+
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/sub/index.html", www);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/sub", www);
+    rmdir(path);
+    snprintf(path, sizeof(path), "%s/hello.txt", www);
+    unlink(path);
+    rmdir(www);
+    unlink(secret);
+    unlink(pack);
+    rmdir(root);
+}
+
+/* HPACK */
+
+/**
+ * Append decoded header to buffer as "name: value\n".
+ **/
+static int hpack_collect(void *arg, const char *name, size_t nlen, const char *value, size_t vlen) {
+    char *buffer = arg;
+    size_t used  = strlen(buffer);
+    snprintf(buffer + used, BUFSIZ - used, "%.*s: %.*s\n", (int)nlen, name, (int)vlen, value);
+    return 0;
+}
+
+static void test_hpack(void) {
+    /* RFC 7541 C.3 and C.4 */
+    static const uint8_t raw1[] = {
+        0x82, 0x86, 0x84, 0x41, 0x0f, 0x77, 0x77, 0x77, 0x2e, 0x65, 0x78, 0x61,
+        0x6d, 0x70, 0x6c, 0x65, 0x2e, 0x63, 0x6f, 0x6d,
+    };
+    static const uint8_t raw2[] = {
+        0x82, 0x86, 0x84, 0xbe, 0x58, 0x08, 0x6e, 0x6f, 0x2d, 0x63, 0x61, 0x63,
+        0x68, 0x65,
+    };
+    static const uint8_t huffman1[] = {
+        0x82, 0x86, 0x84, 0x41, 0x8c, 0xf1, 0xe3, 0xc2, 0xe5, 0xf2, 0x3a, 0x6b,
+        0xa0, 0xab, 0x90, 0xf4, 0xff,
+    };
+    const char *expected1 = ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n";
+    const char *expected2 = ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\ncache-control: no-cache\n";
+    HPACKTable  table;
+    char        buffer[BUFSIZ];
+    uint8_t     block[BUFSIZ];
+
+    section("HPACK Decoding");
+
+    hpack_init(&table, 4096);
+    buffer[0] = 0;
+    check("literal with indexing (RFC 7541 C.3.1)",
+          hpack_decode(&table, raw1, sizeof(raw1), hpack_collect, buffer) == 0 && streq(buffer, expected1));
+    buffer[0] = 0;
+    check("dynamic table reference (RFC 7541 C.3.2)",
+          hpack_decode(&table, raw2, sizeof(raw2), hpack_collect, buffer) == 0 && streq(buffer, expected2));
+    hpack_free(&table);
+
+    hpack_init(&table, 4096);
+    buffer[0] = 0;
+    check("huffman string (RFC 7541 C.4.1)",
+          hpack_decode(&table, huffman1, sizeof(huffman1), hpack_collect, buffer) == 0 && streq(buffer, expected1));
+    hpack_free(&table);
+
+    hpack_init(&table, 4096);
+    check("truncated block", hpack_decode(&table, raw1, sizeof(raw1) - 4, hpack_collect, buffer) < 0);
+    hpack_free(&table);
+
+    hpack_init(&table, 4096);
+    check("index out of range", hpack_decode(&table, (const uint8_t *)"\xff\x00", 2, hpack_collect, buffer) < 0);
+    hpack_free(&table);
+
+    HPACKTable encoder, decoder;
+    ssize_t    length = 0, n;
+    hpack_init(&encoder, 4096);
+    hpack_init(&decoder, 4096);
+    for (int round = 0; round < 2; round++) {
+        length = 0;
+        if ((n = hpack_encode(&encoder, block + length, sizeof(block) - length, ":status", "200")) > 0) {
+            length += n;
+        }
+        if ((n = hpack_encode(&encoder, block + length, sizeof(block) - length, "server", "spidey")) > 0) {
+            length += n;
+        }
+        buffer[0] = 0;
+        if (hpack_decode(&decoder, block, length, hpack_collect, buffer) < 0) {
+            break;
+        }
+    }
+    check("encode and decode round trip", streq(buffer, ":status: 200\nserver: spidey\n") && length == 2);
+    hpack_free(&encoder);
+    hpack_free(&decoder);
+}
+
+/* HTTP/2 */
+
+/**
+ * Append frame to buffer.
+ **/
+static size_t h2_frame_put(uint8_t *dst, uint8_t type, uint8_t flags, uint32_t stream, const void *payload, size_t length) {
+    uint8_t header[9] = {length >> 16, length >> 8, length, type, flags, stream >> 24, stream >> 16, stream >> 8, stream};
+    memcpy(dst, header, sizeof(header));
+    memcpy(dst + sizeof(header), payload, length);
+    return sizeof(header) + length;
+}
+
+/**
+ * Append HEADERS frame with request for path to buffer.
+ **/
+static size_t h2_request_put(uint8_t *dst, HPACKTable *encoder, uint32_t stream, uint8_t flags, const char *method, const char *path) {
+    uint8_t block[256];
+    size_t  nblock = 0;
+
+    nblock += hpack_encode(encoder, block + nblock, sizeof(block) - nblock, ":method", method);
+    nblock += hpack_encode(encoder, block + nblock, sizeof(block) - nblock, ":scheme", "http");
+    nblock += hpack_encode(encoder, block + nblock, sizeof(block) - nblock, ":path", path);
+    nblock += hpack_encode(encoder, block + nblock, sizeof(block) - nblock, ":authority", "localhost");
+    return h2_frame_put(dst, 1, flags, stream, block, nblock);
+}
+
+/**
+ * Run HTTP/2 connection in a child process (as in forking mode).
+ *
+ * @param   output      Frames sent by client (after the client preface).
+ * @param   noutput     Length of frames.
+ * @param   input       Buffer to store everything the server sent.
+ * @param   size        Size of input buffer.
+ * @return  Number of bytes received or -1 on error.
+ **/
+static ssize_t h2_session(const uint8_t *output, size_t noutput, uint8_t *input, size_t size) {
+    static const char preface[] = "SM\r\n\r\n\0\0\0\4\0\0\0\0\0";
+    size_t  ninput = 0;
+    ssize_t nread;
+    int     sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(sv[0]);
+        Request *r = request_pool_get(false);
+        r->fd = sv[1];
+        http2_serve(r, false);
+        _exit(EXIT_SUCCESS);
+    }
+    close(sv[1]);
+
+    /* Rest of the client preface (the HTTP/1 parser consumed the first line)
+     * and an empty SETTINGS frame, then the frames and a GOAWAY */
+    bool sent = pid > 0 &&
+                write(sv[0], preface, sizeof(preface) - 1) == sizeof(preface) - 1 &&
+                write(sv[0], output, noutput) == (ssize_t)noutput &&
+                write(sv[0], "\0\0\10\7\0\0\0\0\0\0\0\0\0\0\0\0\0", 17) == 17;
+    shutdown(sv[0], SHUT_WR);
+    while (ninput < size && (nread = read(sv[0], input + ninput, size - ninput)) > 0) {
+        ninput += nread;
+    }
+    close(sv[0]);
+    if (pid > 0) {
+        waitpid(pid, NULL, 0);
+    }
+    return sent ? (ssize_t)ninput : -1;
+}
+
+static void test_http2(void) {
+    const char *paths[]    = {"/a.txt", "/b.html", "/c.txt", "/a.txt", "/b.html"};
+    const char *expected[] = {
+        ":status: 200\ncontent-length: 6\ncontent-type: text/plain\n",
+        ":status: 200\ncontent-length: 12\ncontent-type: text/html\n",
+        ":status: 200\ncontent-length: 12\ncontent-type: text/plain\n",
+        ":status: 200\ncontent-length: 6\ncontent-type: text/plain\n",
+        ":status: 200\ncontent-length: 12\ncontent-type: text/html\n",
+    };
+    const size_t npaths = sizeof(paths) / sizeof(paths[0]);
+    char        root[] = "/tmp/spidey-test.XXXXXX";
+    char        path[PATH_MAX];
+    char        buffer[BUFSIZ];
+    static uint8_t output[BUFSIZ], input[1 << 16];
+    size_t      noutput = 0;
+    ssize_t     ninput;
+    HPACKTable  encoder, decoder;
+    bool        passed;
+
+    section("HTTP/2");
+
+    if (!mkdtemp(root) || request_pool_init() < 0) {
+        check("setup", false);
+        return;
+    }
+    write_file(root, "a.txt", "alpha\n");
+    write_file(root, "b.html", "<p>beta</p>\n");
+    write_file(root, "c.txt", "gamma gamma\n");
+    char *saved = RootPath;
+    RootPath = root;
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Every response head must decode in order through one decoder */
+    hpack_init(&encoder, 4096);
+    for (size_t i = 0; i < npaths; i++) {
+        noutput += h2_request_put(output + noutput, &encoder, 2 * i + 1, 0x05, "GET", paths[i]);
+    }
+    hpack_free(&encoder);
+    ninput = h2_session(output, noutput, input, sizeof(input));
+
+    size_t responses = 0;
+    passed = ninput > 0;
+    hpack_init(&decoder, 4096);
+    for (ssize_t offset = 0; offset + 9 <= ninput;) {
+        size_t   length = (input[offset] << 16) | (input[offset + 1] << 8) | input[offset + 2];
+        uint32_t stream = ((uint32_t)input[offset + 5] << 24 | input[offset + 6] << 16 | input[offset + 7] << 8 | input[offset + 8]) & 0x7fffffff;
+        if (offset + 9 + (ssize_t)length > ninput) {
+            break;
+        }
+        if (input[offset + 3] == 1) {
+            buffer[0] = 0;
+            passed &= hpack_decode(&decoder, input + offset + 9, length, hpack_collect, buffer) == 0 &&
+                      stream % 2 && stream / 2 < npaths && streq(buffer, expected[stream / 2]);
+            responses++;
+        }
+        offset += 9 + length;
+    }
+    hpack_free(&decoder);
+    check("successive responses share encoder table", passed && responses == npaths);
+
+    /* A second HEADERS frame on a stream whose request is complete is refused */
+    hpack_init(&encoder, 4096);
+    noutput  = h2_request_put(output, &encoder, 1, 0x05, "GET", "/c.txt");
+    noutput += h2_request_put(output + noutput, &encoder, 1, 0x05, "GET", "/c.txt");
+    hpack_free(&encoder);
+    ninput = h2_session(output, noutput, input, sizeof(input));
+
+    size_t heads = 0, resets = 0;
+    for (ssize_t offset = 0; offset + 9 <= ninput;) {
+        size_t length = (input[offset] << 16) | (input[offset + 1] << 8) | input[offset + 2];
+        heads  += input[offset + 3] == 1;
+        resets += input[offset + 3] == 3 && length == 4 && input[offset + 12] == 5;
+        offset += 9 + length;
+    }
+    check("HEADERS on half-closed stream", ninput > 0 && heads == 1 && resets == 1);
+
+    /* Request bodies are refused rather than mixed up with header fields */
+    hpack_init(&encoder, 4096);
+    noutput  = h2_request_put(output, &encoder, 1, 0x04, "POST", "/a.txt");
+    noutput += h2_frame_put(output + noutput, 0, 0x01, 1, "x=1", 3);
+    hpack_free(&encoder);
+    ninput = h2_session(output, noutput, input, sizeof(input));
+
+    passed = false;
+    hpack_init(&decoder, 4096);
+    for (ssize_t offset = 0; offset + 9 <= ninput;) {
+        size_t length = (input[offset] << 16) | (input[offset + 1] << 8) | input[offset + 2];
+        if (input[offset + 3] == 1) {
+            buffer[0] = 0;
+            passed = hpack_decode(&decoder, input + offset + 9, length, hpack_collect, buffer) == 0 &&
+                     strncmp(buffer, ":status: 501\n", 13) == 0;
+        }
+        offset += 9 + length;
+    }
+    hpack_free(&decoder);
+    check("request body is refused", passed);
+
+    for (size_t i = 0; i < 3; i++) {
+        snprintf(path, sizeof(path), "%s/%s", root, paths[i] + 1);
+        unlink(path);
+    }
+    rmdir(root);
+    RootPath = saved;
+}
+
+/* Header Lookup */
+
+static void test_header(void) {
+    char name[BUFSIZ];
+    bool passed;
+
+    section("Header Perfect Hash");
+
+    passed = true;
+    for (HeaderID id = 0; id < HEADER_COUNT; id++) {
+        passed &= header_lookup(header_name(id), strlen(header_name(id))) == id;
+    }
+    check("every known header", passed);
+
+    passed = true;
+    for (HeaderID id = 0; id < HEADER_COUNT; id++) {
+        size_t length = strlen(header_name(id));
+        for (size_t i = 0; i < length; i++) {
+            name[i] = (i % 2) ? tolower(header_name(id)[i]) : toupper(header_name(id)[i]);
+        }
+        passed &= header_lookup(name, length) == id;
+    }
+    check("mixed case", passed);
+
+    strcpy(name, "Content-Lengthy");
+    check("not NUL-terminated", header_lookup(name, strlen("Content-Length")) == HEADER_CONTENT_LENGTH);
+    check("longer name", header_lookup(name, strlen(name)) == HEADER_UNKNOWN);
+    check("prefix of known name", header_lookup("Hos", 3) == HEADER_UNKNOWN);
+    check("unknown name", header_lookup("X-Unknown", 9) == HEADER_UNKNOWN);
+    check("empty name", header_lookup("", 0) == HEADER_UNKNOWN);
+}
+
+/* Request Scanning */
+
+static void test_scan(void) {
+    enum { TRIALS = 64, OFFSETS = 32, LENGTH = 96 };
+    static char buffer[TRIALS][OFFSETS + LENGTH];
+    static int  space[TRIALS][OFFSETS][LENGTH + 1];
+    static int  nonspace[TRIALS][OFFSETS][LENGTH + 1];
+    const char *request = "GET / HTTP/1.1\r\n";
+    char        name[BUFSIZ];
+    bool        passed = true;
+
+    section("Request Scanning");
+
+    /* Alternate between sparse and dense whitespace */
+    srand(0);
+    for (int t = 0; t < TRIALS; t++) {
+        for (int i = 0; i < OFFSETS + LENGTH; i++) {
+            buffer[t][i] = (rand() % (t % 2 ? 2 : 16)) ? "ab:\x80"[rand() % 4] : " \t\r\n"[rand() % 4];
+        }
+    }
+
+    /* Until scan_init is called the scalar implementation is used */
+    for (int t = 0; t < TRIALS; t++) {
+        for (int o = 0; o < OFFSETS; o++) {
+            for (int n = 0; n <= LENGTH; n++) {
+                char *s = scan_space(buffer[t] + o, n);
+                char *u = scan_nonspace(buffer[t] + o, n);
+                space[t][o][n]    = s ? s - buffer[t] : -1;
+                nonspace[t][o][n] = u ? u - buffer[t] : -1;
+            }
+        }
+    }
+
+    snprintf(name, sizeof(name), "%s matches scalar", scan_init());
+    for (int t = 0; t < TRIALS; t++) {
+        for (int o = 0; o < OFFSETS; o++) {
+            for (int n = 0; n <= LENGTH; n++) {
+                char *s = scan_space(buffer[t] + o, n);
+                char *u = scan_nonspace(buffer[t] + o, n);
+                passed &= (s ? s - buffer[t] : -1) == space[t][o][n];
+                passed &= (u ? u - buffer[t] : -1) == nonspace[t][o][n];
+            }
+        }
+    }
+    check(name, passed);
+    check("scan_char", scan_char(request, strlen(request), '\r') == request + 14 && !scan_char(request, 14, '\r'));
+}
+
+/* File Response Cache */
+
+static void test_file_cache(void) {
+    struct stat s = {.st_ino = 1, .st_size = 1000};
+    FileCacheEntry *e;
+    int hits = 0;
+
+    section("File Cache (TinyLFU)");
+
+    /* Room for two entries */
+    FileCacheBudget = 2 * (sizeof(FileCacheEntry) + 3 + 1000) + 100;
+
+    file_cache_insert("/a", &s, calloc(1, 1000), 1000);
+    file_cache_insert("/b", &s, calloc(1, 1000), 1000);
+    for (int i = 0; i < 3; i++) {
+        if ((e = file_cache_lookup("/a", &s))) {
+            hits++;
+            file_cache_release(e);
+        }
+        if ((e = file_cache_lookup("/b", &s))) {
+            hits++;
+            file_cache_release(e);
+        }
+    }
+    check("insert within budget", hits == 6);
+
+    file_cache_insert("/c", &s, calloc(1, 1000), 1000);
+    e = file_cache_lookup("/c", &s);
+    check("one-off entry is not admitted", e == NULL);
+
+    for (int i = 0; i < 8; i++) {
+        file_cache_lookup("/c", &s);
+    }
+    file_cache_insert("/c", &s, calloc(1, 1000), 1000);
+    e = file_cache_lookup("/c", &s);
+    check("popular entry is admitted", e != NULL);
+    if (e) {
+        file_cache_release(e);
+    }
+
+    hits = 0;
+    if ((e = file_cache_lookup("/a", &s))) {
+        hits++;
+        file_cache_release(e);
+    }
+    if ((e = file_cache_lookup("/b", &s))) {
+        hits++;
+        file_cache_release(e);
+    }
+    check("admission evicts one entry", hits == 1);
+
+    struct stat changed = s;
+    changed.st_size++;
+    check("changed file misses", file_cache_lookup("/c", &changed) == NULL);
+    check("changed file is dropped", file_cache_lookup("/c", &s) == NULL);
+}
+
+/* Shared Lookup Cache */
+
+static void test_shm_cache(void) {
+    char key[BUFSIZ];
+    char value[BUFSIZ];
+    char large[1024];
+
+    section("Shared Cache (seqlock)");
+
+    check("lookup before init misses", !shm_cache_lookup(SHM_CACHE_PATH, "/a", value, sizeof(value)));
+    check("shm_cache_init", shm_cache_init() == 0);
+
+    shm_cache_store(SHM_CACHE_MIMETYPE, "html", "text/html");
+    check("store and lookup", shm_cache_lookup(SHM_CACHE_MIMETYPE, "html", value, sizeof(value)) && streq(value, "text/html"));
+    check("kinds are separate", !shm_cache_lookup(SHM_CACHE_PATH, "html", value, sizeof(value)));
+    check("small value buffer misses", !shm_cache_lookup(SHM_CACHE_MIMETYPE, "html", value, 4));
+
+    shm_cache_store(SHM_CACHE_MIMETYPE, "html", "text/plain");
+    check("store replaces", shm_cache_lookup(SHM_CACHE_MIMETYPE, "html", value, sizeof(value)) && streq(value, "text/plain"));
+
+    memset(large, 'x', sizeof(large) - 1);
+    large[sizeof(large) - 1] = 0;
+    shm_cache_store(SHM_CACHE_PATH, large, "/tmp");
+    check("oversized key is not stored", !shm_cache_lookup(SHM_CACHE_PATH, large, value, sizeof(value)));
+    shm_cache_store(SHM_CACHE_PATH, "/large", large);
+    check("oversized value is not stored", !shm_cache_lookup(SHM_CACHE_PATH, "/large", value, sizeof(value)));
+
+    /* A writer process alternates between two values; a reader must never see a mix */
+    char a[400], b[400];
+    memset(a, 'a', sizeof(a) - 1);
+    memset(b, 'b', sizeof(b) - 1);
+    a[sizeof(a) - 1] = b[sizeof(b) - 1] = 0;
+    strcpy(key, "/torn");
+    shm_cache_store(SHM_CACHE_PATH, key, a);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        for (int i = 0; ; i++) {
+            shm_cache_store(SHM_CACHE_PATH, key, i % 2 ? a : b);
+        }
+    }
+
+    int  hits = 0;
+    bool torn = false;
+    for (int i = 0; i < 200000 && pid > 0; i++) {
+        if (shm_cache_lookup(SHM_CACHE_PATH, key, value, sizeof(value))) {
+            hits++;
+            torn |= !streq(value, a) && !streq(value, b);
+        }
+    }
+    if (pid > 0) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+    }
+    check("concurrent writer never tears entry", pid > 0 && hits > 0 && !torn);
+}
+
+/* Utilities */
+
+static void test_utils(void) {
+    char   value[8];
+    size_t size = 0;
+
+    section("Utilities");
+
+    check("parse_size 10", parse_size("10", &size) && size == 10);
+    check("parse_size 4K", parse_size("4K", &size) && size == 4096);
+    check("parse_size 16m", parse_size("16m", &size) && size == 16 << 20);
+    check("parse_size 1G", parse_size("1G", &size) && size == 1 << 30);
+    check("parse_size rejects empty", !parse_size("", &size));
+    check("parse_size rejects negative", !parse_size("-1", &size));
+    check("parse_size rejects unknown suffix", !parse_size("12X", &size));
+    check("parse_size rejects trailing text", !parse_size("1KB", &size));
+
+    check("query_string", query_string("a=1&b=two&c=3", "b", value, sizeof(value)) && streq(value, "two"));
+    check("query_string first", query_string("a=1&b=two", "a", value, sizeof(value)) && streq(value, "1"));
+    check("query_string last", query_string("a=1&b=two", "b", value, sizeof(value)) && streq(value, "two"));
+    check("query_string whole name only", !query_string("ab=1&bb=2", "b", value, sizeof(value)));
+    check("query_string empty value", query_string("a=&b=2", "a", value, sizeof(value)) && streq(value, ""));
+    check("query_string truncates", query_string("a=123456789", "a", value, sizeof(value)) && streq(value, "1234567"));
+    check("query_string absent", !query_string("a=1", "b", value, sizeof(value)));
+    check("query_string empty query", !query_string("", "a", value, sizeof(value)));
+    check("query_number", query_number("ttl=30&x=y", "ttl", -1) == 30);
+    check("query_number fallback", query_number("x=y", "ttl", -1) == -1);
+}
+
+/* Options */
+
+static void test_options(void) {
+    section("Option Parsing");
+
+    check("socket backlog", parse_socket_option("backlog=64") && SocketConfig.backlog == 64);
+    check("socket defer", parse_socket_option("defer") && SocketConfig.defer_accept == 1);
+    check("socket rejects prefix", !parse_socket_option("b=5") && !parse_socket_option("d"));
+    check("socket rejects empty", !parse_socket_option(""));
+    check("socket rejects unknown", !parse_socket_option("bogus"));
+
+    check("shed target", parse_shed_option("target=5") && ShedConfig.target == 5);
+    check("shed interval", parse_shed_option("interval=200") && ShedConfig.interval == 200);
+    check("shed interval rejects zero", !parse_shed_option("interval=0"));
+    check("shed retry", parse_shed_option("retry=2") && ShedConfig.retry == 2);
+    check("shed queue", parse_shed_option("queue=64") && ShedConfig.queue == 64);
+    check("shed class", parse_shed_option("cgi=16") && ShedConfig.inflight[REQUEST_CGI] == 16);
+    check("shed rejects negative", !parse_shed_option("target=-1"));
+    check("shed rejects missing value", !parse_shed_option("target"));
+    check("shed rejects unknown", !parse_shed_option("bogus=1"));
+    check("shed rejects prefix", !parse_shed_option("t=5") && !parse_shed_option("c=1"));
+
+    check("write high", parse_write_option("high=128K") && WriteConfig.high == 128 << 10);
+    check("write notsent", parse_write_option("notsent=0") && WriteConfig.notsent == 0);
+    check("write rejects prefix", !parse_write_option("c=1") && !parse_write_option("h=128K"));
+    check("write rejects missing value", !parse_write_option("cap"));
+
+    check("worker min", parse_worker_option("min=4") && WorkerConfig.min == 4);
+    check("worker max", parse_worker_option("max=32") && WorkerConfig.max == 32);
+    check("worker interval", parse_worker_option("interval=500") && WorkerConfig.interval == 500);
+    check("worker delay", parse_worker_option("delay=10") && WorkerConfig.delay == 10);
+    check("worker rejects zero", !parse_worker_option("min=0"));
+    check("worker rejects too many", !parse_worker_option("max=100000"));
+    check("worker rejects missing value", !parse_worker_option("max"));
+    check("worker rejects unknown", !parse_worker_option("bogus=1"));
+    check("worker rejects prefix", !parse_worker_option("m=4"));
+}
+
+/**
+ * Run unit tests and exit with number of failures.
+ **/
+int main(int argc, char *argv[]) {
+    setvbuf(stdout, NULL, _IONBF, 0);
+    printf("Testing spidey components ...\n");
+
+    test_pack();
+    test_hpack();
+    test_http2();
+    test_header();
+    test_scan();
+    test_file_cache();
+    test_shm_cache();
+    test_utils();
+    test_options();
+
+    printf("\n");
+    return Failures;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
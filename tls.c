@@ -0,0 +1,274 @@
+/* tls.c: TLS Termination */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define TLS_PUMPSIZ     16384           /* Largest TLS record payload */
+#define TLS_SESSIONS    4096            /* Sessions kept for resumption by ID */
+
+/* TLS Structures */
+
+struct TLSPump {
+    pthread_t   thread;                 /*< Thread moving data */
+    SSL        *ssl;                    /*< TLS session */
+    int         fd;                     /*< Client socket */
+    int         plain;                  /*< Pump's end of plaintext socket pair */
+};
+
+/* Globals */
+
+static SSL_CTX *TLSContext = NULL;
+
+/**
+ * Log pending OpenSSL errors.
+ **/
+static void tls_log_errors(const char *message) {
+    unsigned long error;
+    char          buffer[256];
+
+    while ((error = ERR_get_error())) {
+        ERR_error_string_n(error, buffer, sizeof(buffer));
+        debug("%s: %s", message, buffer);
+    }
+}
+
+/**
+ * Create TLS context from TLSCertPath and TLSKeyPath.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * The context asks OpenSSL to hand record encryption to the kernel (kTLS)
+ * after each handshake.  Sessions can be resumed with tickets, whose keys
+ * are generated here, before workers are forked, so a ticket issued by one
+ * child is accepted by every other; single mode also resumes by session ID.
+ **/
+int tls_init(void) {
+    if (!TLSCertPath) {
+        return 0;
+    }
+
+    if (!(TLSContext = SSL_CTX_new(TLS_server_method()))) {
+        tls_log_errors("SSL_CTX_new");
+        fprintf(stderr, "Unable to create TLS context\n");
+        return -1;
+    }
+
+    SSL_CTX_set_min_proto_version(TLSContext, TLS1_2_VERSION);
+    SSL_CTX_set_options(TLSContext, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE);
+    SSL_CTX_set_mode(TLSContext, SSL_MODE_AUTO_RETRY);
+
+    if (SSL_CTX_use_certificate_chain_file(TLSContext, TLSCertPath) != 1 ||
+        SSL_CTX_use_PrivateKey_file(TLSContext, TLSKeyPath ? TLSKeyPath : TLSCertPath, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(TLSContext) != 1) {
+        tls_log_errors("TLS certificate");
+        fprintf(stderr, "Unable to load TLS certificate %s and key %s\n", TLSCertPath, TLSKeyPath ? TLSKeyPath : TLSCertPath);
+        return -1;
+    }
+
+    static const unsigned char context[] = "spidey";
+    SSL_CTX_set_session_id_context(TLSContext, context, sizeof(context) - 1);
+    SSL_CTX_set_session_cache_mode(TLSContext, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(TLSContext, TLS_SESSIONS);
+
+    log("TLS enabled with %s", TLSCertPath);
+    return 0;
+}
+
+/**
+ * Move decrypted data between client socket and plaintext socket pair.
+ *
+ * This runs until either side closes; then the client gets a close_notify.
+ **/
+static void * tls_pump(void *arg) {
+    struct TLSPump *p = arg;
+    char            buffer[TLS_PUMPSIZ];
+    bool            reading = true;
+
+    while (true) {
+        struct pollfd pfds[2] = {{p->plain, POLLIN, 0}, {p->fd, POLLIN, 0}};
+        int           timeout = reading && SSL_pending(p->ssl) ? 0 : -1;
+
+        if (poll(pfds, reading ? 2 : 1, timeout) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        /* Response from handler */
+        if (pfds[0].revents) {
+            ssize_t n = read(p->plain, buffer, sizeof(buffer));
+            if (n <= 0 || SSL_write(p->ssl, buffer, n) <= 0) {
+                break;
+            }
+        }
+
+        /* Request data from client */
+        if (reading && (pfds[1].revents || timeout == 0)) {
+            int n = SSL_read(p->ssl, buffer, sizeof(buffer));
+            if (n <= 0) {
+                shutdown(p->plain, SHUT_WR);
+                reading = false;
+            } else {
+                for (int written = 0; written < n; ) {
+                    ssize_t w = write(p->plain, buffer + written, n - written);
+                    if (w < 0 && errno == EINTR) continue;
+                    if (w <= 0) break;
+                    written += w;
+                }
+            }
+        }
+    }
+
+    SSL_shutdown(p->ssl);
+    close(p->plain);
+    return NULL;
+}
+
+/**
+ * Perform TLS handshake on accepted request.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  -1 on error and 0 on success.
+ *
+ * If the kernel took over transmit encryption, the request keeps its
+ * socket: every write, sendfile(2), and splice(2) the handlers make is
+ * encrypted by the kernel without copies, and reads go through OpenSSL
+ * (request_recv) unless receive was offloaded as well.
+ *
+ * Without kTLS, the request gets one end of a socket pair instead, and a
+ * pump thread encrypts and decrypts on the other end, so handlers work
+ * unchanged at the cost of a copy.
+ **/
+int tls_accept(Request *r) {
+    SSL *ssl = SSL_new(TLSContext);
+
+    if (!ssl || SSL_set_fd(ssl, r->fd) != 1) {
+        tls_log_errors("SSL_new");
+        SSL_free(ssl);
+        return -1;
+    }
+
+    int status;
+    while ((status = SSL_accept(ssl)) <= 0 && SSL_get_error(ssl, status) == SSL_ERROR_SYSCALL && errno == EINTR);
+    if (status != 1) {
+        tls_log_errors("SSL_accept");
+        debug("TLS handshake with %s:%s failed", r->cold->host, r->cold->port);
+        SSL_free(ssl);
+        return -1;
+    }
+
+    /* Handling starts now (receive timestamps of the handshake are not read) */
+    r->secure = true;
+    if (SocketConfig.timestamps) {
+        r->start = time_now();
+    }
+    debug("TLS %s %s (kTLS send=%d recv=%d, %s)", SSL_get_version(ssl), SSL_get_cipher_name(ssl),
+          BIO_get_ktls_send(SSL_get_wbio(ssl)), BIO_get_ktls_recv(SSL_get_rbio(ssl)),
+          SSL_session_reused(ssl) ? "resumed" : "new session");
+
+    if (BIO_get_ktls_send(SSL_get_wbio(ssl))) {
+        r->tls = ssl;
+        return 0;
+    }
+
+    /* Fall back to pumping plaintext through a socket pair */
+    struct TLSPump *p = calloc(1, sizeof(struct TLSPump));
+    int             pair[2];
+
+    if (!p || socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) {
+        free(p);
+        SSL_free(ssl);
+        return -1;
+    }
+    p->ssl   = ssl;
+    p->fd    = r->fd;
+    p->plain = pair[1];
+    if ((errno = pthread_create(&p->thread, NULL, tls_pump, p)) != 0) {
+        fprintf(stderr, "Unable to start TLS pump: %s\n", strerror(errno));
+        close(pair[0]);
+        close(pair[1]);
+        SSL_free(ssl);
+        free(p);
+        return -1;
+    }
+
+    r->pump = p;
+    r->fd   = pair[0];
+    return 0;
+}
+
+/**
+ * Receive decrypted data through OpenSSL.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   buffer      Buffer to receive into.
+ * @param   size        Size of buffer.
+ * @return  Number of bytes received, 0 on end of stream, or -1 on error.
+ **/
+ssize_t tls_recv(Request *r, void *buffer, size_t size) {
+    int n = SSL_read(r->tls, buffer, size > INT_MAX ? INT_MAX : size);
+    if (n > 0) {
+        return n;
+    }
+
+    switch (SSL_get_error(r->tls, n)) {
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_SYSCALL:
+            if (errno == EINTR) {
+                return -1;
+            }
+            /* Fall through */
+        default:
+            errno = EIO;
+            return -1;
+    }
+}
+
+/**
+ * Return whether OpenSSL holds decrypted data not yet received.
+ **/
+bool tls_pending(Request *r) {
+    return r->tls && SSL_pending(r->tls) > 0;
+}
+
+/**
+ * Shut down TLS session of request (before its socket is closed).
+ *
+ * @param   r           HTTP Request structure.
+ *
+ * For pumped connections, closing our end of the socket pair tells the
+ * pump to flush the response and finish, which is waited for so that a
+ * forked child does not exit with the response still in flight.
+ **/
+void tls_close(Request *r) {
+    if (r->tls) {
+        SSL_shutdown(r->tls);
+        SSL_free(r->tls);
+        r->tls = NULL;
+    }
+
+    if (r->pump) {
+        struct TLSPump *p = r->pump;
+        close(r->fd);
+        pthread_join(p->thread, NULL);
+        SSL_free(p->ssl);
+        r->fd   = p->fd;
+        r->pump = NULL;
+        free(p);
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
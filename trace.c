@@ -0,0 +1,215 @@
+/* trace.c: Request Phase Tracing */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define TRACE_EVENTS    65536           /* Events kept in ring (power of two) */
+#define TRACE_SIGNAL    SIGUSR1         /* Signal that requests a dump */
+
+/* Trace Structures */
+
+typedef struct {
+    uint64_t seq;                       /*< Ring index + 1 once written (0 = being written) */
+    uint64_t start;                     /*< Start of phase (ns) */
+    uint64_t duration;                  /*< Time spent reaching phase (ns) */
+    uint32_t id;                        /*< Request trace identifier */
+    int32_t  pid;                       /*< Process that recorded event */
+    uint8_t  phase;                     /*< TracePhase */
+    uint8_t  type;                      /*< RequestClass at time of event */
+} TraceEvent;
+
+typedef struct {
+    uint64_t   head;                    /*< Number of events ever recorded */
+    uint32_t   ids;                     /*< Last assigned request identifier */
+    TraceEvent events[TRACE_EVENTS];    /*< Ring of most recent events */
+} TraceRing;
+
+/* Globals */
+
+static TraceRing *Trace = NULL;         /*< Shared with forked workers */
+
+static const char *TracePhaseNames[TRACE_PHASES] = {
+    [TRACE_ACCEPT]       = "accept",
+    [TRACE_REQUEST_LINE] = "request_line",
+    [TRACE_HEADERS]      = "headers",
+    [TRACE_RESOLVED]     = "resolved",
+    [TRACE_DISPATCH]     = "dispatch",
+    [TRACE_FIRST_BYTE]   = "first_byte",
+    [TRACE_DONE]         = "done",
+};
+
+/**
+ * Record that request reached phase.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   phase       Phase reached.
+ *
+ * Each event covers the time since the request's previous phase, so a
+ * request's events tile its lifetime.  Writers claim a slot with a single
+ * atomic increment and publish it by storing its sequence number last.
+ **/
+void trace_record(Request *r, TracePhase phase) {
+    if (!Trace) {
+        return;
+    }
+
+    uint64_t now = time_now();
+    if (!r->cold->id) {
+        r->cold->id = __atomic_add_fetch(&Trace->ids, 1, __ATOMIC_RELAXED);
+    }
+
+    uint64_t    index = __atomic_fetch_add(&Trace->head, 1, __ATOMIC_RELAXED);
+    TraceEvent *e     = &Trace->events[index & (TRACE_EVENTS - 1)];
+
+    __atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    e->start    = r->cold->traced ? r->cold->traced : now;
+    e->duration = now - e->start;
+    e->id       = r->cold->id;
+    e->pid      = getpid();
+    e->phase    = phase;
+    e->type     = r->type;
+    __atomic_store_n(&e->seq, index + 1, __ATOMIC_RELEASE);
+
+    r->cold->traced = now;
+}
+
+/**
+ * Write events in ring as Chrome trace JSON.
+ *
+ * @param   path        Path of trace file.
+ * @return  Number of events written or -1 on error.
+ *
+ * Every request gets its own row (tid) so its phases line up as
+ * consecutive slices in chrome://tracing or Perfetto.
+ **/
+static int trace_dump(const char *path) {
+    FILE *fs = fopen(path, "w");
+    if (!fs) {
+        fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    uint64_t head  = __atomic_load_n(&Trace->head, __ATOMIC_ACQUIRE);
+    uint64_t first = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0;
+    int      count = 0;
+
+    fprintf(fs, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (uint64_t index = first; index < head; index++) {
+        TraceEvent *e = &Trace->events[index & (TRACE_EVENTS - 1)];
+        TraceEvent  copy;
+
+        /* Skip slots that are being (re)written */
+        if (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != index + 1) {
+            continue;
+        }
+        copy = *e;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != index + 1 || copy.phase >= TRACE_PHASES) {
+            continue;
+        }
+
+        fprintf(fs, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u}",
+                count ? "," : "", TracePhaseNames[copy.phase], request_class_name(copy.type),
+                copy.start / 1e3, copy.duration / 1e3, copy.pid, copy.id);
+        count++;
+    }
+    fprintf(fs, "\n]}\n");
+
+    if (fclose(fs) != 0) {
+        fprintf(stderr, "Unable to write %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return count;
+}
+
+/**
+ * Dump trace whenever TRACE_SIGNAL arrives.
+ **/
+static void * trace_thread(void *arg) {
+    sigset_t *signals = arg;
+    int       signal;
+
+    while (true) {
+        if (sigwait(signals, &signal) != 0) {
+            continue;
+        }
+        int count = trace_dump(TracePath);
+        if (count >= 0) {
+            log("Dumped %d trace events to %s", count, TracePath);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Start thread that waits for signals with sigwait(3).
+ *
+ * @param   thread      Pointer to store thread identifier in.
+ * @param   routine     Thread function.
+ * @param   arg         Argument to thread function.
+ * @return  0 on success or an error number.
+ *
+ * The thread starts with every signal blocked, so it only ever receives
+ * the signals it waits for (and not, say, those another such thread
+ * waits for, which would otherwise kill the process).
+ **/
+int signal_thread(pthread_t *thread, void *(*routine)(void *), void *arg) {
+    sigset_t all, saved;
+    int      status;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    status = pthread_create(thread, NULL, routine, arg);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    return status;
+}
+
+/**
+ * Allocate trace ring and start thread that dumps it on SIGUSR1.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * This must be called before any other thread is started, since it blocks
+ * SIGUSR1 in the calling thread (and therefore in every thread created
+ * later) so that only the dump thread receives it.  The ring is mapped
+ * MAP_SHARED, so events from forked children end up in the server's dump.
+ **/
+int trace_init(void) {
+    static sigset_t signals;
+    pthread_t       thread;
+
+    if (!TracePath) {
+        return 0;
+    }
+
+    Trace = mmap(NULL, sizeof(TraceRing), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (Trace == MAP_FAILED) {
+        fprintf(stderr, "Unable to map trace ring: %s\n", strerror(errno));
+        Trace = NULL;
+        return -1;
+    }
+
+    sigemptyset(&signals);
+    sigaddset(&signals, TRACE_SIGNAL);
+    if ((errno = pthread_sigmask(SIG_BLOCK, &signals, NULL)) != 0 ||
+        (errno = signal_thread(&thread, trace_thread, &signals)) != 0) {
+        fprintf(stderr, "Unable to start trace thread: %s\n", strerror(errno));
+        return -1;
+    }
+    pthread_detach(thread);
+
+    log("Tracing to %s (send SIGUSR1 to %d to dump)", TracePath, getpid());
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -5,6 +5,7 @@
 #include <ctype.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 
 #include <sys/stat.h>
 #include <unistd.h>
@@ -29,21 +30,32 @@
  * If no extension exists or no matching mimetype is found, then return
  * DefaultMimeType.
  *
+ * Results are kept in the shared lookup cache, so the file is scanned
+ * only once per extension for all worker processes.
+ *
  * This function returns an allocated string that must be free'd.
  **/
 char * determine_mimetype(const char *path) {
     char *ext = NULL;
     char *mimetype;
     char *token = NULL;
+    char *state = NULL;
     char buffer[BUFSIZ];
     FILE *fs = NULL;
 
 
     /* Find file extension */
 
-    ext = strrchr(path, '.');
+    if ((ext = strrchr(path, '.')) == NULL) {
+        goto fail;
+    }
     ext++;
 
+    /* Check shared cache */
+    if (shm_cache_lookup(SHM_CACHE_MIMETYPE, ext, buffer, sizeof(buffer))) {
+        return strdup(buffer);
+    }
+
     /* Open MimeTypesPath file */
     if ( (fs = fopen(MimeTypesPath, "r")) == NULL){
         goto fail;
@@ -53,7 +65,7 @@ char * determine_mimetype(const char *path) {
     while (fgets(buffer, BUFSIZ, fs) && sizeof(buffer) > 2){
         chomp(buffer);
 
-        mimetype = strtok(buffer, WHITESPACE);
+        mimetype = strtok_r(buffer, WHITESPACE, &state);
 
         // If there was nothing or it is a comment
         if (mimetype == NULL || mimetype[0] == '#'){
@@ -72,18 +84,19 @@ char * determine_mimetype(const char *path) {
             if (streq(token, ext)){
                 goto complete;
             }
-            token = strtok(NULL, WHITESPACE);
+            token = strtok_r(NULL, WHITESPACE, &state);
         }
     }
 
-fail:
     mimetype = DefaultMimeType;
 
 complete:
-    if (fs){
-        fclose(fs);
-    }
+    shm_cache_store(SHM_CACHE_MIMETYPE, ext, mimetype);
+    fclose(fs);
     return strdup(mimetype);
+
+fail:
+    return strdup(DefaultMimeType);
 }
 
 /**
@@ -101,24 +114,31 @@ complete:
  *
  * Otherwise, return a newly allocated string containing the real path.  This
  * string must later be free'd.
+ *
+ * Resolved paths are kept briefly in the shared lookup cache, which saves
+ * the per-component lookups realpath(3) makes for every request.
  **/
 char * determine_request_path(const char *uri) {
     char real_path_str[BUFSIZ];
     char path[BUFSIZ];
 
+    if (shm_cache_lookup(SHM_CACHE_PATH, uri, real_path_str, sizeof(real_path_str))) {
+        return strdup(real_path_str);
+    }
+
     // Construct the path with root and the uri
     strcpy(path, RootPath);
     strcat(path, uri);
 
     int len_root = strlen(RootPath);
-    realpath(path, real_path_str);
-    if (real_path_str == NULL){
+    if (realpath(path, real_path_str) == NULL){
         return NULL;
     }
     if (strncmp(real_path_str, RootPath, len_root) != 0){
         return NULL;
     }
 
+    shm_cache_store(SHM_CACHE_PATH, uri, real_path_str);
     return strdup(real_path_str);
 }
 
@@ -133,31 +153,65 @@ char * determine_request_path(const char *uri) {
 const char * http_status_string(HTTPStatus status) {
     static char *StatusStrings[] = {
         "200 OK",
+        "304 Not Modified",
         "400 Bad Request",
         "404 Not Found",
         "500 Internal Server Error",
         "418 I'm A Teapot",
+        "503 Service Unavailable",
+        "501 Not Implemented",
     };
     const char *str;
     if (status == HTTP_STATUS_OK){
         str = StatusStrings[0];
     }
-    else if (status == HTTP_STATUS_BAD_REQUEST){
+    else if (status == HTTP_STATUS_NOT_MODIFIED){
         str = StatusStrings[1];
     }
-    else if (status == HTTP_STATUS_NOT_FOUND){
+    else if (status == HTTP_STATUS_BAD_REQUEST){
         str = StatusStrings[2];
     }
-    else if (status == HTTP_STATUS_INTERNAL_SERVER_ERROR){
+    else if (status == HTTP_STATUS_NOT_FOUND){
         str = StatusStrings[3];
     }
-    else if (status == HTTP_STATUS_I_AM_A_TEAPOT){
+    else if (status == HTTP_STATUS_INTERNAL_SERVER_ERROR){
         str = StatusStrings[4];
     }
+    else if (status == HTTP_STATUS_I_AM_A_TEAPOT){
+        str = StatusStrings[5];
+    }
+    else if (status == HTTP_STATUS_SERVICE_UNAVAILABLE){
+        str = StatusStrings[6];
+    }
+    else if (status == HTTP_STATUS_NOT_IMPLEMENTED){
+        str = StatusStrings[7];
+    }
+    else {
+        str = NULL;
+    }
 
     return str;
 }
 
+/**
+ * Return static name of request class.
+ *
+ * @param   type        Request class.
+ * @return  Lowercase class name (as used in executor options).
+ **/
+const char * request_class_name(RequestClass type) {
+    static const char *ClassNames[REQUEST_CLASSES] = {
+        [REQUEST_UNKNOWN]   = "unknown",
+        [REQUEST_PACK]      = "pack",
+        [REQUEST_BROWSE]    = "browse",
+        [REQUEST_CGI]       = "cgi",
+        [REQUEST_FILE]      = "file",
+        [REQUEST_COLD]      = "cold",
+        [REQUEST_ERROR]     = "error",
+    };
+    return type < REQUEST_CLASSES ? ClassNames[type] : "unknown";
+}
+
 /**
  * Advance string pointer pass all nonwhitespace characters
  *
@@ -184,4 +238,77 @@ char * skip_whitespace(char *s) {
     return s;
 }
 
+/**
+ * Extract parameter value from query string.
+ *
+ * @param   query       Query string (name=value pairs separated by &).
+ * @param   name        Parameter name.
+ * @param   value       Buffer to store value.
+ * @param   size        Size of value buffer.
+ * @return  true if the parameter was found, false otherwise.
+ **/
+bool query_string(const char *query, const char *name, char *value, size_t size) {
+    size_t length = strlen(name);
+
+    for (const char *p = query; p && *p; p = strchr(p, '&') ? strchr(p, '&') + 1 : NULL) {
+        if (strncmp(p, name, length) == 0 && p[length] == '=') {
+            const char *start = p + length + 1;
+            size_t n = strcspn(start, "&");
+            snprintf(value, size, "%.*s", (int)n, start);
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Extract numeric parameter value from query string.
+ *
+ * @param   query       Query string.
+ * @param   name        Parameter name.
+ * @param   fallback    Value to return if parameter is absent.
+ * @return  Numeric value of parameter (or fallback).
+ **/
+long query_number(const char *query, const char *name, long fallback) {
+    char value[32];
+    return query_string(query, name, value, sizeof(value)) ? strtol(value, NULL, 10) : fallback;
+}
+
+/**
+ * Return current wall clock time.
+ *
+ * @return  Nanoseconds since the epoch.
+ *
+ * CLOCK_REALTIME is used so that times can be compared with the kernel's
+ * SO_TIMESTAMPNS receive timestamps.
+ **/
+uint64_t time_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Parse size with optional K, M, or G suffix.
+ *
+ * @param   s           Size string.
+ * @param   size        Pointer to store size in bytes.
+ * @return  true if parsing was successful, false if there was an error.
+ **/
+bool parse_size(const char *s, size_t *size) {
+    char *end;
+    long  value = strtol(s, &end, 10);
+
+    if (end == s || value < 0) {
+        return false;
+    }
+    switch (*end) {
+        case 'G': case 'g': value <<= 10; /* Fall through */
+        case 'M': case 'm': value <<= 10; /* Fall through */
+        case 'K': case 'k': value <<= 10; end++; break;
+    }
+    *size = value;
+    return *end == 0;
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */